@@ -30,6 +30,7 @@
 #include <lib/unittest/unittest.h>
 #include <lk/init.h>
 #include <lk/trace.h>
+#include <platform.h>
 #include <stdbool.h>
 #include <stdio.h>
 
@@ -626,6 +627,150 @@ TEST_P(pincputest, PinCpuWhenThreadStateBlockingOnEvent) {
 test_abort:;
 }
 
+/*
+ * Tests verifying placement with a cpu affinity mask: threads confined
+ * to a subset of cpus only run there while the scheduler balances them
+ * within it, and a running thread whose mask or pinned cpu changes is
+ * moved to a cpu it is allowed on.
+ */
+#define PINCPUMASKTEST_WORKER_COUNT 4
+#define PINCPUMASKTEST_ITERATIONS 200
+#define PINCPUMASKTEST_SPIN_NS 100000ULL        /* 100us */
+#define PINCPUMASKTEST_WAIT_NS 1000000ULL       /* 1ms */
+#define PINCPUMASKTEST_WAIT_COUNT 1000
+
+/**
+ * struct pincpumasktest_worker - worker thread context structure
+ * @thread:     worker thread's thread structure
+ * @cpus_seen:  mask of the cpus the worker was seen running on
+ * @curr_cpu:   cpu the worker last saw itself running on
+ * @stop:       if set, a spinning worker returns
+ */
+struct pincpumasktest_worker {
+    thread_t* thread;
+    mp_cpu_mask_t cpus_seen;
+    volatile int curr_cpu;
+    volatile bool stop;
+};
+
+static int pincpumasktest_yield_thread(void* arg) {
+    struct pincpumasktest_worker* worker = arg;
+
+    for (int i = 0; i < PINCPUMASKTEST_ITERATIONS; i++) {
+        lk_time_ns_t start = current_time_ns();
+        worker->cpus_seen |= 1U << thread_curr_cpu(get_current_thread());
+        while (current_time_ns() - start < PINCPUMASKTEST_SPIN_NS) {
+        }
+        thread_yield();
+    }
+    return 0;
+}
+
+static int pincpumasktest_spin_thread(void* arg) {
+    struct pincpumasktest_worker* worker = arg;
+
+    while (!worker->stop) {
+        worker->curr_cpu = thread_curr_cpu(get_current_thread());
+    }
+    return 0;
+}
+
+static bool pincpumasktest_wait_for_cpu(struct pincpumasktest_worker* worker,
+                                        int cpu) {
+    for (int i = 0; i < PINCPUMASKTEST_WAIT_COUNT; i++) {
+        if (worker->curr_cpu == cpu) {
+            return true;
+        }
+        thread_sleep_ns(PINCPUMASKTEST_WAIT_NS);
+    }
+    LTRACEF("%s: thread %s, curr_cpu [%d] != expected_cpu [%d]\n", __func__,
+            worker->thread->name, worker->curr_cpu, cpu);
+    return false;
+}
+
+TEST(pincpumasktest, AffinityMaskConfinesThreads) {
+    struct pincpumasktest_worker workers[PINCPUMASKTEST_WORKER_COUNT] = {0};
+    const mp_cpu_mask_t mask = (1U << 1) | (1U << 2);
+    mp_cpu_mask_t cpus_seen = 0;
+    int ret;
+
+    /* keep the test thread out of the way of the workers */
+    thread_set_pinned_cpu(get_current_thread(), 0);
+
+    for (int i = 0; i < PINCPUMASKTEST_WORKER_COUNT; i++) {
+        workers[i].thread = thread_create("pincpumasktest-yield",
+                                          pincpumasktest_yield_thread,
+                                          &workers[i], DEFAULT_PRIORITY,
+                                          DEFAULT_STACK_SIZE);
+        ASSERT_NE(NULL, workers[i].thread);
+        thread_set_cpu_affinity(workers[i].thread, mask);
+        EXPECT_EQ(mask, thread_cpu_affinity(workers[i].thread));
+        EXPECT_EQ(-1, thread_pinned_cpu(workers[i].thread));
+    }
+    for (int i = 0; i < PINCPUMASKTEST_WORKER_COUNT; i++) {
+        thread_resume(workers[i].thread);
+    }
+    for (int i = 0; i < PINCPUMASKTEST_WORKER_COUNT; i++) {
+        thread_join(workers[i].thread, &ret, INFINITE_TIME);
+        workers[i].thread = NULL;
+        EXPECT_EQ(0U, workers[i].cpus_seen & ~mask);
+        cpus_seen |= workers[i].cpus_seen;
+    }
+
+    /* four busy workers on two cpus shall have used both of them */
+    EXPECT_EQ(mask, cpus_seen);
+
+test_abort:
+    for (int i = 0; i < PINCPUMASKTEST_WORKER_COUNT; i++) {
+        if (workers[i].thread) {
+            thread_resume(workers[i].thread);
+            thread_join(workers[i].thread, &ret, INFINITE_TIME);
+        }
+    }
+    thread_set_pinned_cpu(get_current_thread(), -1);
+}
+
+TEST(pincpumasktest, AffinityMaskMovesRunningThread) {
+    struct pincpumasktest_worker worker = {0};
+    int ret;
+
+    thread_set_pinned_cpu(get_current_thread(), 0);
+
+    worker.curr_cpu = -1;
+    worker.thread = thread_create("pincpumasktest-spin",
+                                  pincpumasktest_spin_thread, &worker,
+                                  DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    ASSERT_NE(NULL, worker.thread);
+    thread_set_cpu_affinity(worker.thread, 1U << 1);
+    thread_resume(worker.thread);
+    EXPECT_EQ(true, pincpumasktest_wait_for_cpu(&worker, 1));
+
+    /* current cpu no longer allowed, the worker shall move */
+    thread_set_cpu_affinity(worker.thread, 1U << 3);
+    EXPECT_EQ(true, pincpumasktest_wait_for_cpu(&worker, 3));
+
+    /* current cpu still allowed, the worker shall stay */
+    thread_set_cpu_affinity(worker.thread, (1U << 2) | (1U << 3));
+    thread_sleep_ns(10 * PINCPUMASKTEST_WAIT_NS);
+    EXPECT_EQ(3, worker.curr_cpu);
+
+    /* a pinned cpu overrides the mask */
+    thread_set_pinned_cpu(worker.thread, 1);
+    EXPECT_EQ(true, pincpumasktest_wait_for_cpu(&worker, 1));
+
+    /* and the mask applies again once unpinned */
+    thread_set_cpu_affinity(worker.thread, 1U << 2);
+    EXPECT_EQ(1, worker.curr_cpu);
+    thread_set_pinned_cpu(worker.thread, -1);
+    EXPECT_EQ(true, pincpumasktest_wait_for_cpu(&worker, 2));
+
+    worker.stop = true;
+    thread_join(worker.thread, &ret, INFINITE_TIME);
+
+test_abort:
+    thread_set_pinned_cpu(get_current_thread(), -1);
+}
+
 INSTANTIATE_TEST_SUITE_P(
         standard_threads,
         pincputest,
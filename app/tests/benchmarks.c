@@ -31,6 +31,8 @@
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/timer.h>
+#include <kernel/mp.h>
 #include <platform.h>
 
 const size_t BUFSIZE = (1024*1024);
@@ -247,6 +249,113 @@ __NO_INLINE static void bench_sincos(void)
 
 #endif // WITH_LIB_LIBM
 
+static enum handler_return bench_timer_callback(struct timer *t,
+                                                 lk_time_ns_t now, void *arg)
+{
+    return INT_NO_RESCHEDULE;
+}
+
+__NO_INLINE static void bench_timer_arm_cancel(void)
+{
+#define TIMER_COUNT 10000
+    timer_t *timers = malloc(sizeof(timer_t) * TIMER_COUNT);
+    if (!timers) {
+        printf("failed to allocate timers\n");
+        return;
+    }
+
+    for (uint i = 0; i < TIMER_COUNT; i++) {
+        timer_initialize(&timers[i]);
+    }
+
+    /* far enough in the future that none of them fire during the test */
+    const lk_time_ns_t base_delay = 3600ULL * 1000 * 1000 * 1000;
+
+    uint count = arch_cycle_count();
+    for (uint i = 0; i < TIMER_COUNT; i++) {
+        timer_set_oneshot_ns(&timers[i], base_delay + (lk_time_ns_t)rand() * 1000,
+                             bench_timer_callback, NULL);
+    }
+    count = arch_cycle_count() - count;
+    printf("took %u cycles to arm %u timers with random deadlines (%u cycles/timer)\n",
+           count, TIMER_COUNT, count / TIMER_COUNT);
+
+    count = arch_cycle_count();
+    for (uint i = 0; i < TIMER_COUNT; i++) {
+        timer_cancel_sync(&timers[(i * 7919) % TIMER_COUNT]);
+    }
+    count = arch_cycle_count() - count;
+    printf("took %u cycles to cancel %u timers (%u cycles/timer)\n",
+           count, TIMER_COUNT, count / TIMER_COUNT);
+
+    count = arch_cycle_count();
+    for (uint i = 0; i < TIMER_COUNT; i++) {
+        timer_set_oneshot_ns(&timers[i], base_delay + i * 1000ULL,
+                             bench_timer_callback, NULL);
+    }
+    count = arch_cycle_count() - count;
+    printf("took %u cycles to arm %u timers with increasing deadlines (%u cycles/timer)\n",
+           count, TIMER_COUNT, count / TIMER_COUNT);
+
+    count = arch_cycle_count();
+    for (uint i = 0; i < TIMER_COUNT; i++) {
+        timer_cancel_sync(&timers[TIMER_COUNT - 1 - i]);
+    }
+    count = arch_cycle_count() - count;
+    printf("took %u cycles to cancel %u timers, latest first (%u cycles/timer)\n",
+           count, TIMER_COUNT, count / TIMER_COUNT);
+
+    free(timers);
+#undef TIMER_COUNT
+}
+
+#if WITH_SMP
+static void bench_mp_call_func(void *arg)
+{
+}
+
+__NO_INLINE static void bench_mp_sync_exec(void)
+{
+#define MP_CALL_ITER 1000
+    thread_t *current_thread = get_current_thread();
+    int old_pinned_cpu = thread_pinned_cpu(current_thread);
+    uint local_cpu = arch_curr_cpu_num();
+    mp_cpu_mask_t others = 0;
+    uint count;
+
+    /* stay on this cpu so the calls below always cross to another one */
+    thread_set_pinned_cpu(current_thread, local_cpu);
+    local_cpu = arch_curr_cpu_num();
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (cpu == local_cpu || !mp_is_cpu_active(cpu))
+            continue;
+        others |= 1U << cpu;
+
+        count = arch_cycle_count();
+        for (uint i = 0; i < MP_CALL_ITER; i++) {
+            mp_sync_exec(1U << cpu, bench_mp_call_func, NULL);
+        }
+        count = arch_cycle_count() - count;
+        printf("took %u cycles per mp_sync_exec round trip from cpu %u to cpu %u\n",
+               count / MP_CALL_ITER, local_cpu, cpu);
+    }
+
+    if (others) {
+        count = arch_cycle_count();
+        for (uint i = 0; i < MP_CALL_ITER; i++) {
+            mp_sync_exec(others, bench_mp_call_func, NULL);
+        }
+        count = arch_cycle_count() - count;
+        printf("took %u cycles per mp_sync_exec round trip to cpus 0x%x\n",
+               count / MP_CALL_ITER, others);
+    }
+
+    thread_set_pinned_cpu(current_thread, old_pinned_cpu);
+#undef MP_CALL_ITER
+}
+#endif
+
 void benchmarks(void)
 {
     bench_set_overhead();
@@ -259,6 +368,11 @@ void benchmarks(void)
     bench_cset_uint64_t();
     bench_cset_wide();
 
+    bench_timer_arm_cancel();
+#if WITH_SMP
+    bench_mp_sync_exec();
+#endif
+
 #if ARCH_ARM
     arm_bench_cset_stm();
 
@@ -21,6 +21,7 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <rand.h>
 #include <err.h>
 #include <app/tests.h>
@@ -30,6 +31,46 @@
 #include <kernel/event.h>
 #include <platform.h>
 
+#define SLEEP_ACCURACY_SAMPLES 200
+
+static int sleep_error_compare(const void *a, const void *b)
+{
+    lk_time_ns_t x = *(const lk_time_ns_t *)a;
+    lk_time_ns_t y = *(const lk_time_ns_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* how late thread_sleep_ns() returns, for delays around the spin threshold */
+static void sleep_accuracy_test(void)
+{
+    static const lk_time_ns_t delays[] = {
+        1000, 5000, 10000, 20000, 100000, 1000000, 10000000,
+    };
+    static lk_time_ns_t err[SLEEP_ACCURACY_SAMPLES];
+
+    printf("measuring thread_sleep_ns() accuracy\n");
+    for (uint i = 0; i < countof(delays); i++) {
+        uint samples = SLEEP_ACCURACY_SAMPLES;
+
+        /* keep the longest delays from taking too long */
+        if (delays[i] >= 10000000)
+            samples /= 4;
+
+        for (uint j = 0; j < samples; j++) {
+            lk_time_ns_t start = current_time_ns();
+            thread_sleep_ns(delays[i]);
+            lk_time_ns_t slept = current_time_ns() - start;
+            err[j] = slept > delays[i] ? slept - delays[i] : 0;
+        }
+        qsort(err, samples, sizeof(err[0]), sleep_error_compare);
+
+        printf("%llu ns sleep: late by p50 %llu p90 %llu p99 %llu max %llu ns\n",
+               delays[i], err[samples / 2], err[samples * 9 / 10],
+               err[samples * 99 / 100], err[samples - 1]);
+    }
+}
+
 void clock_tests(void)
 {
     uint32_t c;
@@ -104,6 +145,8 @@ void clock_tests(void)
         printf("%d\n", i + 1);
     }
 
+    sleep_accuracy_test();
+
     printf("measuring cpu clock against current_time_hires()\n");
     for (int i = 0; i < 5; i++) {
         uint cycles = arch_cycle_count();
@@ -28,9 +28,16 @@
 #include <string.h>
 #include <app/tests.h>
 #include <kernel/thread.h>
+#include <kernel/cond.h>
 #include <kernel/mutex.h>
+#include <kernel/rcu.h>
+#include <kernel/rwlock.h>
+#include <kernel/seqlock.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/wait_address.h>
+#include <kernel/mp.h>
+#include <malloc.h>
 #include <platform.h>
 
 static int sleep_thread(void *arg)
@@ -240,6 +247,750 @@ int mutex_test(void)
     return 0;
 }
 
+/*
+ * Classic priority inversion: a low priority thread holds a mutex wanted by a
+ * high priority thread while a medium priority thread hogs the cpu. With
+ * priority inheritance the high priority thread only waits for the low
+ * priority thread's critical section, not for the medium priority thread.
+ */
+#define PI_TEST_HOLD_TIME_US (20 * 1000)
+#define PI_TEST_HOG_TIME_US (500 * 1000)
+#define PI_TEST_MAX_WAIT_NS (200 * 1000 * 1000ULL)
+
+static mutex_t pi_test_mutex;
+static event_t pi_test_locked_event;
+static lk_time_ns_t pi_test_wait_time;
+
+static int pi_test_low_thread(void *arg)
+{
+    mutex_acquire(&pi_test_mutex);
+    event_signal(&pi_test_locked_event, false);
+    spin(PI_TEST_HOLD_TIME_US);
+    mutex_release(&pi_test_mutex);
+
+    return 0;
+}
+
+static int pi_test_medium_thread(void *arg)
+{
+    spin(PI_TEST_HOG_TIME_US);
+
+    return 0;
+}
+
+static int pi_test_high_thread(void *arg)
+{
+    lk_time_ns_t start = current_time_ns();
+
+    mutex_acquire(&pi_test_mutex);
+    pi_test_wait_time = current_time_ns() - start;
+    mutex_release(&pi_test_mutex);
+
+    return 0;
+}
+
+static void mutex_pi_test(void)
+{
+    thread_t *low, *medium, *high;
+    int cpu = arch_curr_cpu_num();
+
+    printf("testing mutex priority inheritance\n");
+
+    mutex_init(&pi_test_mutex);
+    event_init(&pi_test_locked_event, false, 0);
+
+    /* run everything on one cpu so the medium thread can starve the low one */
+    low = thread_create("pi low", &pi_test_low_thread, NULL,
+                        LOW_PRIORITY, DEFAULT_STACK_SIZE);
+    medium = thread_create("pi medium", &pi_test_medium_thread, NULL,
+                           DEFAULT_PRIORITY + 1, DEFAULT_STACK_SIZE);
+    high = thread_create("pi high", &pi_test_high_thread, NULL,
+                         HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_set_pinned_cpu(low, cpu);
+    thread_set_pinned_cpu(medium, cpu);
+    thread_set_pinned_cpu(high, cpu);
+
+    thread_resume(low);
+    event_wait(&pi_test_locked_event);
+
+    /* high blocks on the mutex, then medium becomes runnable */
+    thread_resume(high);
+    thread_resume(medium);
+
+    thread_join(high, NULL, INFINITE_TIME);
+    thread_join(medium, NULL, INFINITE_TIME);
+    thread_join(low, NULL, INFINITE_TIME);
+
+    printf("high priority thread waited %llu us for the mutex (limit %llu us): %s\n",
+           pi_test_wait_time / 1000, PI_TEST_MAX_WAIT_NS / 1000,
+           pi_test_wait_time < PI_TEST_MAX_WAIT_NS ? "PASSED" : "FAILED");
+
+    event_destroy(&pi_test_locked_event);
+    mutex_destroy(&pi_test_mutex);
+}
+
+/*
+ * A high priority waiter that times out must not leave the holder boosted,
+ * neither while it still holds the mutex nor once it released it on the fast
+ * path.
+ */
+static mutex_t pi_timeout_test_mutex;
+static event_t pi_timeout_test_locked_event;
+static event_t pi_timeout_test_timed_out_event;
+
+static int pi_timeout_test_low_thread(void *arg)
+{
+    thread_t *current_thread = get_current_thread();
+    int ret = 0;
+
+    mutex_acquire(&pi_timeout_test_mutex);
+    event_signal(&pi_timeout_test_locked_event, false);
+    event_wait(&pi_timeout_test_timed_out_event);
+
+    if (current_thread->priority != current_thread->base_priority) {
+        printf("holder still at priority %d after the waiter timed out\n",
+               current_thread->priority);
+        ret = -1;
+    }
+
+    mutex_release(&pi_timeout_test_mutex);
+
+    if (current_thread->priority != current_thread->base_priority) {
+        printf("holder still at priority %d after releasing the mutex\n",
+               current_thread->priority);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static int pi_timeout_test_high_thread(void *arg)
+{
+    status_t err = mutex_acquire_timeout(&pi_timeout_test_mutex, 50);
+
+    event_signal(&pi_timeout_test_timed_out_event, false);
+
+    return err == ERR_TIMED_OUT ? 0 : -1;
+}
+
+static void mutex_pi_timeout_test(void)
+{
+    thread_t *low, *high;
+    int low_ret, high_ret;
+
+    printf("testing mutex priority inheritance with a timed out waiter\n");
+
+    mutex_init(&pi_timeout_test_mutex);
+    event_init(&pi_timeout_test_locked_event, false, 0);
+    event_init(&pi_timeout_test_timed_out_event, false, 0);
+
+    low = thread_create("pi timeout low", &pi_timeout_test_low_thread, NULL,
+                        LOW_PRIORITY, DEFAULT_STACK_SIZE);
+    high = thread_create("pi timeout high", &pi_timeout_test_high_thread, NULL,
+                         HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+
+    thread_resume(low);
+    event_wait(&pi_timeout_test_locked_event);
+    thread_resume(high);
+
+    thread_join(high, &high_ret, INFINITE_TIME);
+    thread_join(low, &low_ret, INFINITE_TIME);
+
+    printf("mutex priority inheritance timeout test %s\n",
+           !low_ret && !high_ret ? "PASSED" : "FAILED");
+
+    event_destroy(&pi_timeout_test_timed_out_event);
+    event_destroy(&pi_timeout_test_locked_event);
+    mutex_destroy(&pi_timeout_test_mutex);
+}
+
+/*
+ * Low priority threads pass a mutex around on the fast path while a high
+ * priority thread keeps blocking on it, so releases race with new holders
+ * being boosted. A thread that released the mutex must not keep a priority
+ * inherited through it.
+ */
+#define PI_RACE_TEST_ITER 100000
+#define PI_RACE_TEST_THREADS 3
+
+static mutex_t pi_race_test_mutex;
+static volatile int pi_race_test_running;
+static volatile int pi_race_test_leaks;
+
+static int pi_race_test_low_thread(void *arg)
+{
+    thread_t *current_thread = get_current_thread();
+
+    for (int i = 0; i < PI_RACE_TEST_ITER; i++) {
+        mutex_acquire(&pi_race_test_mutex);
+        mutex_release(&pi_race_test_mutex);
+
+        if (current_thread->priority != current_thread->base_priority)
+            atomic_add(&pi_race_test_leaks, 1);
+    }
+    atomic_add(&pi_race_test_running, -1);
+
+    return 0;
+}
+
+static int pi_race_test_high_thread(void *arg)
+{
+    while (pi_race_test_running) {
+        mutex_acquire(&pi_race_test_mutex);
+        mutex_release(&pi_race_test_mutex);
+        thread_sleep(1);
+    }
+
+    return 0;
+}
+
+static void mutex_pi_race_test(void)
+{
+    thread_t *low[PI_RACE_TEST_THREADS];
+    thread_t *high;
+
+    printf("testing mutex priority inheritance with racing releases\n");
+
+    mutex_init(&pi_race_test_mutex);
+    pi_race_test_running = PI_RACE_TEST_THREADS;
+    pi_race_test_leaks = 0;
+
+    for (uint i = 0; i < countof(low); i++) {
+        low[i] = thread_create("pi race low", &pi_race_test_low_thread, NULL,
+                               LOW_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(low[i]);
+    }
+    high = thread_create("pi race high", &pi_race_test_high_thread, NULL,
+                         HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_resume(high);
+
+    for (uint i = 0; i < countof(low); i++)
+        thread_join(low[i], NULL, INFINITE_TIME);
+    thread_join(high, NULL, INFINITE_TIME);
+
+    printf("%d releases kept an inherited priority: %s\n", pi_race_test_leaks,
+           pi_race_test_leaks ? "FAILED" : "PASSED");
+
+    mutex_destroy(&pi_race_test_mutex);
+}
+
+/*
+ * Readers check that no writer holds the lock with them, writers that they
+ * hold it alone.
+ */
+#define RWLOCK_TEST_ITER 10000
+
+static rwlock_t rwlock_test_lock;
+static volatile int rwlock_test_readers;
+static volatile int rwlock_test_writers;
+static volatile int rwlock_test_max_readers;
+
+static int rwlock_test_reader(void *arg)
+{
+    for (int i = 0; i < RWLOCK_TEST_ITER; i++) {
+        rwlock_acquire_read(&rwlock_test_lock);
+
+        int readers = atomic_add(&rwlock_test_readers, 1) + 1;
+        if (readers > rwlock_test_max_readers)
+            rwlock_test_max_readers = readers;
+        if (rwlock_test_writers)
+            panic("reader got the rwlock while a writer held it\n");
+        if (i % 16 == 0)
+            thread_yield();
+        atomic_add(&rwlock_test_readers, -1);
+
+        rwlock_release_read(&rwlock_test_lock);
+    }
+
+    return 0;
+}
+
+static int rwlock_test_writer(void *arg)
+{
+    for (int i = 0; i < RWLOCK_TEST_ITER / 10; i++) {
+        rwlock_acquire_write(&rwlock_test_lock);
+
+        if (atomic_add(&rwlock_test_writers, 1) != 0 || rwlock_test_readers)
+            panic("writer got the rwlock while it was held\n");
+        thread_yield();
+        atomic_add(&rwlock_test_writers, -1);
+
+        rwlock_release_write(&rwlock_test_lock);
+        thread_yield();
+    }
+
+    return 0;
+}
+
+static int rwlock_test_timed_reader(void *arg)
+{
+    status_t ret;
+
+    ret = rwlock_acquire_read_timeout(&rwlock_test_lock, (uintptr_t)arg);
+    if (ret == NO_ERROR)
+        rwlock_release_read(&rwlock_test_lock);
+
+    return ret;
+}
+
+static int rwlock_test_timed_writer(void *arg)
+{
+    status_t ret;
+
+    ret = rwlock_acquire_write_timeout(&rwlock_test_lock, (uintptr_t)arg);
+    if (ret == NO_ERROR)
+        rwlock_release_write(&rwlock_test_lock);
+
+    return ret;
+}
+
+static void rwlock_test(void)
+{
+    thread_t *threads[6];
+    thread_t *writer, *reader;
+    status_t ret;
+    int retcode;
+
+    printf("testing rwlock\n");
+
+    rwlock_init(&rwlock_test_lock);
+    rwlock_test_max_readers = 0;
+
+    for (uint i = 0; i < countof(threads); i++) {
+        if (i < 2) {
+            threads[i] = thread_create("rwlock writer", &rwlock_test_writer,
+                                       NULL, DEFAULT_PRIORITY,
+                                       DEFAULT_STACK_SIZE);
+        } else {
+            threads[i] = thread_create("rwlock reader", &rwlock_test_reader,
+                                       NULL, DEFAULT_PRIORITY,
+                                       DEFAULT_STACK_SIZE);
+        }
+        thread_resume(threads[i]);
+    }
+
+    for (uint i = 0; i < countof(threads); i++) {
+        thread_join(threads[i], NULL, INFINITE_TIME);
+    }
+
+    printf("done with simple rwlock tests, up to %d readers held the lock together\n",
+           rwlock_test_max_readers);
+
+    rwlock_acquire_read(&rwlock_test_lock);
+
+    ret = rwlock_acquire_read_timeout(&rwlock_test_lock, 0);
+    printf("second reader: %d (expected %d): %s\n", ret, NO_ERROR,
+           ret == NO_ERROR ? "PASSED" : "FAILED");
+    if (ret == NO_ERROR)
+        rwlock_release_read(&rwlock_test_lock);
+
+    ret = rwlock_acquire_write_timeout(&rwlock_test_lock, 0);
+    printf("writer, zero timeout: %d (expected %d): %s\n", ret, ERR_TIMED_OUT,
+           ret == ERR_TIMED_OUT ? "PASSED" : "FAILED");
+
+    writer = thread_create("rwlock timed writer", &rwlock_test_timed_writer,
+                           (void *)(uintptr_t)100, DEFAULT_PRIORITY,
+                           DEFAULT_STACK_SIZE);
+    thread_resume(writer);
+    thread_join(writer, &retcode, INFINITE_TIME);
+    printf("writer, 100 ms timeout: %d (expected %d): %s\n", retcode,
+           ERR_TIMED_OUT, retcode == ERR_TIMED_OUT ? "PASSED" : "FAILED");
+
+    /* a waiting writer keeps new readers out */
+    writer = thread_create("rwlock timed writer", &rwlock_test_timed_writer,
+                           (void *)(uintptr_t)INFINITE_TIME, DEFAULT_PRIORITY,
+                           DEFAULT_STACK_SIZE);
+    thread_resume(writer);
+    thread_sleep(50);
+
+    reader = thread_create("rwlock timed reader", &rwlock_test_timed_reader,
+                           (void *)(uintptr_t)0, DEFAULT_PRIORITY,
+                           DEFAULT_STACK_SIZE);
+    thread_resume(reader);
+    thread_join(reader, &retcode, INFINITE_TIME);
+    printf("reader behind waiting writer: %d (expected %d): %s\n", retcode,
+           ERR_TIMED_OUT, retcode == ERR_TIMED_OUT ? "PASSED" : "FAILED");
+
+    rwlock_release_read(&rwlock_test_lock);
+    thread_join(writer, &retcode, INFINITE_TIME);
+    printf("writer after readers left: %d (expected %d): %s\n", retcode,
+           NO_ERROR, retcode == NO_ERROR ? "PASSED" : "FAILED");
+
+    /* readers queued behind a writer get in when it gives up */
+    rwlock_acquire_read(&rwlock_test_lock);
+
+    writer = thread_create("rwlock timed writer", &rwlock_test_timed_writer,
+                           (void *)(uintptr_t)100, DEFAULT_PRIORITY,
+                           DEFAULT_STACK_SIZE);
+    thread_resume(writer);
+    thread_sleep(20);
+
+    reader = thread_create("rwlock timed reader", &rwlock_test_timed_reader,
+                           (void *)(uintptr_t)INFINITE_TIME, DEFAULT_PRIORITY,
+                           DEFAULT_STACK_SIZE);
+    thread_resume(reader);
+
+    ret = thread_join(reader, &retcode, 1000);
+    printf("reader after writer timed out: %d, %d (expected %d): %s\n", ret,
+           retcode, NO_ERROR,
+           ret == NO_ERROR && retcode == NO_ERROR ? "PASSED" : "FAILED");
+
+    rwlock_release_read(&rwlock_test_lock);
+    if (ret != NO_ERROR)
+        thread_join(reader, NULL, INFINITE_TIME);
+    thread_join(writer, &retcode, INFINITE_TIME);
+    printf("writer timed out: %d (expected %d): %s\n", retcode, ERR_TIMED_OUT,
+           retcode == ERR_TIMED_OUT ? "PASSED" : "FAILED");
+
+    rwlock_destroy(&rwlock_test_lock);
+
+    printf("done with rwlock tests\n");
+}
+
+/*
+ * Writers update a pair of values that readers check for consistency. Readers
+ * on other cpus retry the reads that overlap an update.
+ */
+#define SEQLOCK_TEST_TIME_NS (200 * 1000 * 1000ULL)
+
+static seqlock_t seqlock_test_lock;
+static struct {
+    uint64_t value;
+    uint64_t inverse;
+} seqlock_test_data;
+static lk_time_ns_t seqlock_test_start;
+
+static int seqlock_test_writer(void *arg)
+{
+    spin_lock_saved_state_t state;
+    uint64_t i = 0;
+
+    while (current_time_ns() - seqlock_test_start < SEQLOCK_TEST_TIME_NS) {
+        i++;
+        seqlock_write_begin(&seqlock_test_lock, &state);
+        seqlock_test_data.value = i;
+        seqlock_test_data.inverse = ~i;
+        seqlock_write_end(&seqlock_test_lock, state);
+    }
+
+    return 0;
+}
+
+static int seqlock_test_reader(void *arg)
+{
+    uint64_t value, inverse;
+    uint32_t seq;
+    int retries = 0;
+
+    while (current_time_ns() - seqlock_test_start < SEQLOCK_TEST_TIME_NS) {
+        int reads = 0;
+        do {
+            seq = seqlock_read_begin(&seqlock_test_lock);
+            value = seqlock_test_data.value;
+            inverse = seqlock_test_data.inverse;
+            reads++;
+        } while (seqlock_read_retry(&seqlock_test_lock, seq));
+
+        if (value != ~inverse)
+            panic("seqlock reader saw a partial update\n");
+        retries += reads - 1;
+    }
+
+    return retries;
+}
+
+static void seqlock_test(void)
+{
+    thread_t *threads[4];
+    int retries = 0;
+    int retcode;
+
+    printf("testing seqlock\n");
+
+    seqlock_init(&seqlock_test_lock);
+    seqlock_test_start = current_time_ns();
+
+    for (uint i = 0; i < countof(threads); i++) {
+        threads[i] = thread_create(i ? "seqlock reader" : "seqlock writer",
+                                   i ? &seqlock_test_reader :
+                                   &seqlock_test_writer,
+                                   NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(threads[i]);
+    }
+
+    for (uint i = 0; i < countof(threads); i++) {
+        thread_join(threads[i], &retcode, INFINITE_TIME);
+        retries += retcode;
+    }
+
+    printf("done with seqlock tests, readers retried %d times\n", retries);
+}
+
+/*
+ * Updaters replace an object that readers on every cpu check, and free the
+ * old one with call_rcu() after poisoning it. A reader seeing a poisoned
+ * object has had it freed under its read side critical section.
+ */
+#define RCU_TEST_TIME_NS (200 * 1000 * 1000ULL)
+#define RCU_TEST_MAGIC (0x72637574) // 'rcut'
+
+struct rcu_test_obj {
+    uint32_t magic;
+    struct rcu_head rcu;
+};
+
+static struct rcu_test_obj *rcu_test_obj;
+static lk_time_ns_t rcu_test_start;
+static volatile int rcu_test_freed;
+
+static void rcu_test_free(struct rcu_head *head)
+{
+    struct rcu_test_obj *obj = containerof(head, struct rcu_test_obj, rcu);
+
+    obj->magic = 0;
+    free(obj);
+    atomic_add(&rcu_test_freed, 1);
+}
+
+static int rcu_test_updater(void *arg)
+{
+    int updates = 0;
+
+    while (current_time_ns() - rcu_test_start < RCU_TEST_TIME_NS) {
+        struct rcu_test_obj *obj = malloc(sizeof(*obj));
+        if (!obj) {
+            rcu_synchronize();
+            continue;
+        }
+        obj->magic = RCU_TEST_MAGIC;
+
+        struct rcu_test_obj *old = __atomic_exchange_n(&rcu_test_obj, obj,
+                                                       __ATOMIC_RELEASE);
+        call_rcu(&old->rcu, rcu_test_free);
+        updates++;
+
+        /* also bounds the number of objects waiting to be freed */
+        if (updates % 64 == 0)
+            rcu_synchronize();
+    }
+
+    return updates;
+}
+
+static int rcu_test_reader(void *arg)
+{
+    spin_lock_saved_state_t state;
+    int reads = 0;
+
+    while (current_time_ns() - rcu_test_start < RCU_TEST_TIME_NS) {
+        rcu_read_lock(&state);
+        struct rcu_test_obj *obj = rcu_dereference(rcu_test_obj);
+        uint32_t magic = obj->magic;
+        for (volatile int i = 0; i < 100; i++)
+            ;
+        if (magic != RCU_TEST_MAGIC || obj->magic != RCU_TEST_MAGIC)
+            panic("rcu reader saw a freed object\n");
+        rcu_read_unlock(state);
+        reads++;
+    }
+
+    return reads;
+}
+
+static void rcu_test(void)
+{
+    thread_t *threads[SMP_MAX_CPUS];
+    thread_t *updater;
+    uint thread_count = 0;
+    int updates;
+    int reads = 0;
+    int retcode;
+
+    printf("testing rcu\n");
+
+    rcu_test_obj = malloc(sizeof(*rcu_test_obj));
+    if (!rcu_test_obj) {
+        printf("failed to allocate test object\n");
+        return;
+    }
+    rcu_test_obj->magic = RCU_TEST_MAGIC;
+    rcu_test_freed = 0;
+    rcu_test_start = current_time_ns();
+
+    /* one reader per active cpu */
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!mp_is_cpu_active(i))
+            continue;
+        threads[thread_count] = thread_create("rcu reader", &rcu_test_reader,
+                                              NULL, DEFAULT_PRIORITY,
+                                              DEFAULT_STACK_SIZE);
+        thread_set_pinned_cpu(threads[thread_count], i);
+        thread_resume(threads[thread_count++]);
+    }
+    updater = thread_create("rcu updater", &rcu_test_updater, NULL,
+                            DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_resume(updater);
+
+    for (uint i = 0; i < thread_count; i++) {
+        thread_join(threads[i], &retcode, INFINITE_TIME);
+        reads += retcode;
+    }
+    thread_join(updater, &updates, INFINITE_TIME);
+
+    /* every callback queued before rcu_synchronize() has been called */
+    rcu_synchronize();
+    printf("rcu test %s: %d reads, %d updates, %d objects freed\n",
+           rcu_test_freed == updates ? "PASSED" : "FAILED", reads, updates,
+           rcu_test_freed);
+
+    free(rcu_test_obj);
+    rcu_test_obj = NULL;
+}
+
+/*
+ * A lock built on wait_on_address(), with the lock word 0 when unlocked, 1
+ * when locked and 2 when locked with waiters, so only contended releases call
+ * wake_address().
+ */
+#define WAIT_ADDRESS_TEST_ITER 10000
+
+static volatile uint32_t wait_address_test_lock;
+static int wait_address_test_count;
+
+static void wait_address_test_acquire(volatile uint32_t *lock)
+{
+    uint32_t state = 0;
+
+    if (__atomic_compare_exchange_n(lock, &state, 1, false, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED))
+        return;
+
+    if (state != 2)
+        state = __atomic_exchange_n(lock, 2, __ATOMIC_ACQUIRE);
+    while (state != 0) {
+        wait_on_address(lock, 2, INFINITE_TIME);
+        state = __atomic_exchange_n(lock, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+static void wait_address_test_release(volatile uint32_t *lock)
+{
+    if (__atomic_exchange_n(lock, 0, __ATOMIC_RELEASE) == 2)
+        wake_address(lock, 1);
+}
+
+static int wait_address_tester(void *arg)
+{
+    for (int i = 0; i < WAIT_ADDRESS_TEST_ITER; i++) {
+        wait_address_test_acquire(&wait_address_test_lock);
+        int count = wait_address_test_count;
+        if (rand() % 16 == 0)
+            thread_yield();
+        wait_address_test_count = count + 1;
+        wait_address_test_release(&wait_address_test_lock);
+    }
+
+    return 0;
+}
+
+static void wait_address_test(void)
+{
+    volatile uint32_t word = 1;
+    thread_t *threads[4];
+    status_t err;
+
+    printf("testing wait on address\n");
+
+    err = wait_on_address(&word, 0, INFINITE_TIME);
+    if (err != ERR_BAD_STATE)
+        printf("wait with a stale value returned %d, expected %d\n", err,
+               ERR_BAD_STATE);
+
+    lk_time_ns_t t = current_time_ns();
+    err = wait_on_address(&word, 1, 10);
+    t = current_time_ns() - t;
+    if (err != ERR_TIMED_OUT || t < 10 * 1000 * 1000ULL)
+        printf("wait with a timeout returned %d after %llu ns\n", err, t);
+
+    if (wake_address(&word, UINT32_MAX) != 0)
+        printf("wake_address woke a thread that timed out\n");
+
+    wait_address_test_lock = 0;
+    wait_address_test_count = 0;
+    for (uint i = 0; i < countof(threads); i++) {
+        threads[i] = thread_create("wait address tester", &wait_address_tester,
+                                   NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(threads[i]);
+    }
+    for (uint i = 0; i < countof(threads); i++)
+        thread_join(threads[i], NULL, INFINITE_TIME);
+
+    printf("wait on address lock test %s, count %d, expected %d\n",
+           wait_address_test_count ==
+           (int)countof(threads) * WAIT_ADDRESS_TEST_ITER ? "PASSED" : "FAILED",
+           wait_address_test_count,
+           (int)countof(threads) * WAIT_ADDRESS_TEST_ITER);
+}
+
+static mutex_t cond_test_mutex;
+static cond_t cond_test_cond;
+static bool cond_test_ready;
+static volatile int cond_test_holders;
+
+static int cond_test_waiter(void *arg)
+{
+    mutex_acquire(&cond_test_mutex);
+    while (!cond_test_ready)
+        cond_wait(&cond_test_cond, &cond_test_mutex);
+
+    if (atomic_add(&cond_test_holders, 1) != 0)
+        panic("cond waiter returned without exclusive hold of the mutex\n");
+    thread_yield();
+    atomic_add(&cond_test_holders, -1);
+
+    mutex_release(&cond_test_mutex);
+    return 0;
+}
+
+static void cond_test(void)
+{
+    thread_t *threads[8];
+    status_t err;
+
+    printf("testing cond\n");
+
+    mutex_init(&cond_test_mutex);
+    cond_init(&cond_test_cond);
+
+    mutex_acquire(&cond_test_mutex);
+    err = cond_wait_timeout(&cond_test_cond, &cond_test_mutex, 10);
+    if (err != ERR_TIMED_OUT || !is_mutex_held(&cond_test_mutex))
+        printf("cond_wait_timeout returned %d, mutex %sheld\n", err,
+               is_mutex_held(&cond_test_mutex) ? "" : "not ");
+    mutex_release(&cond_test_mutex);
+
+    cond_test_ready = false;
+    for (uint i = 0; i < countof(threads); i++) {
+        threads[i] = thread_create("cond waiter", &cond_test_waiter, NULL,
+                                   DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(threads[i]);
+    }
+    thread_sleep(100);
+
+    mutex_acquire(&cond_test_mutex);
+    cond_test_ready = true;
+    cond_broadcast(&cond_test_cond);
+    mutex_release(&cond_test_mutex);
+
+    for (uint i = 0; i < countof(threads); i++)
+        thread_join(threads[i], NULL, INFINITE_TIME);
+
+    cond_destroy(&cond_test_cond);
+    mutex_destroy(&cond_test_mutex);
+
+    printf("done with cond tests\n");
+}
+
 static event_t e;
 
 static int event_signaler(void *arg)
@@ -325,6 +1076,150 @@ void event_test(void)
     printf("event tests done\n");
 }
 
+/*
+ * Each signaler signals its own event and waits for the waiter, which waits
+ * on all of them at once, to acknowledge it before signaling again. The waiter
+ * must see every signal exactly once.
+ */
+#define EVENT_WAIT_ANY_TEST_EVENTS 4
+#define EVENT_WAIT_ANY_TEST_ITER 1000
+
+static event_t event_wait_any_test_events[EVENT_WAIT_ANY_TEST_EVENTS];
+static event_t event_wait_any_test_acks[EVENT_WAIT_ANY_TEST_EVENTS];
+
+static int event_wait_any_signaler(void *arg)
+{
+    uint i = (uintptr_t)arg;
+
+    for (int j = 0; j < EVENT_WAIT_ANY_TEST_ITER; j++) {
+        event_signal(&event_wait_any_test_events[i], rand() % 2);
+        if (event_wait_timeout(&event_wait_any_test_acks[i], 1000) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static event_t *event_wait_any_destroy_events[2];
+
+static int event_wait_any_destroy_waiter(void *arg)
+{
+    uint index;
+    status_t err;
+
+    err = event_wait_any(event_wait_any_destroy_events,
+                         countof(event_wait_any_destroy_events), INFINITE_TIME,
+                         &index);
+    if (err != ERR_OBJECT_DESTROYED || index != 0) {
+        printf("event_wait_any returned %d, index %u, expected %d, index 0\n",
+               err, index, ERR_OBJECT_DESTROYED);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void event_wait_any_test(void)
+{
+    event_t *events[EVENT_WAIT_ANY_TEST_EVENTS];
+    thread_t *threads[EVENT_WAIT_ANY_TEST_EVENTS];
+    int counts[EVENT_WAIT_ANY_TEST_EVENTS] = {0};
+    bool passed = true;
+    status_t err;
+    uint index;
+
+    printf("testing event_wait_any\n");
+
+    for (uint i = 0; i < EVENT_WAIT_ANY_TEST_EVENTS; i++) {
+        event_init(&event_wait_any_test_events[i], false,
+                   EVENT_FLAG_AUTOUNSIGNAL);
+        event_init(&event_wait_any_test_acks[i], false,
+                   EVENT_FLAG_AUTOUNSIGNAL);
+        events[i] = &event_wait_any_test_events[i];
+    }
+
+    /* already signaled events are picked in order, and only one consumed */
+    event_signal(events[2], false);
+    event_signal(events[1], false);
+    err = event_wait_any(events, countof(events), INFINITE_TIME, &index);
+    if (err != NO_ERROR || index != 1) {
+        printf("event_wait_any returned %d, index %u, expected index 1\n",
+               err, index);
+        passed = false;
+    }
+    err = event_wait_any(events, countof(events), 0, &index);
+    if (err != NO_ERROR || index != 2) {
+        printf("event_wait_any returned %d, index %u, expected index 2\n",
+               err, index);
+        passed = false;
+    }
+    err = event_wait_any(events, countof(events), 10, &index);
+    if (err != ERR_TIMED_OUT) {
+        printf("event_wait_any returned %d, expected a timeout\n", err);
+        passed = false;
+    }
+
+    for (uint i = 0; i < countof(threads); i++) {
+        threads[i] = thread_create("event_wait_any signaler",
+                                   &event_wait_any_signaler,
+                                   (void *)(uintptr_t)i, DEFAULT_PRIORITY,
+                                   DEFAULT_STACK_SIZE);
+        thread_resume(threads[i]);
+    }
+
+    for (int j = 0; j < EVENT_WAIT_ANY_TEST_EVENTS * EVENT_WAIT_ANY_TEST_ITER;
+         j++) {
+        err = event_wait_any(events, countof(events), 1000, &index);
+        if (err != NO_ERROR) {
+            printf("event_wait_any returned %d after %d signals\n", err, j);
+            passed = false;
+            break;
+        }
+        counts[index]++;
+        event_signal(&event_wait_any_test_acks[index], false);
+    }
+
+    for (uint i = 0; i < countof(threads); i++) {
+        if (counts[i] != EVENT_WAIT_ANY_TEST_ITER) {
+            printf("event %u signaled %d times, expected %d\n", i, counts[i],
+                   EVENT_WAIT_ANY_TEST_ITER);
+            passed = false;
+        }
+        thread_join(threads[i], NULL, INFINITE_TIME);
+        event_destroy(&event_wait_any_test_acks[i]);
+        event_destroy(&event_wait_any_test_events[i]);
+    }
+
+    /* destroy and free an event while a caller is blocked on it */
+    event_t *destroyed = malloc(sizeof(*destroyed));
+    event_t other;
+    thread_t *waiter;
+    int ret;
+
+    if (!destroyed) {
+        printf("failed to allocate test state\n");
+        return;
+    }
+    event_init(destroyed, false, 0);
+    event_init(&other, false, 0);
+    event_wait_any_destroy_events[0] = destroyed;
+    event_wait_any_destroy_events[1] = &other;
+    waiter = thread_create("event_wait_any destroy waiter",
+                           &event_wait_any_destroy_waiter, NULL,
+                           DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_resume(waiter);
+    thread_sleep(50);
+    event_destroy(destroyed);
+    memset(destroyed, 0xaa, sizeof(*destroyed));
+    free(destroyed);
+    thread_join(waiter, &ret, INFINITE_TIME);
+    if (ret)
+        passed = false;
+    event_destroy(&other);
+
+    printf("event_wait_any test %s\n", passed ? "PASSED" : "FAILED");
+}
+
 static int quantum_tester(void *arg)
 {
     for (;;) {
@@ -502,6 +1397,179 @@ static void preempt_test(void)
     printf("done with real-time preempt test, above time stamps should be 1 second apart\n");
 }
 
+/*
+ * A deadline thread and a high priority hog share a cpu. The deadline thread
+ * must run in every period despite the hog, and budget enforcement must keep
+ * it from starving the hog for more than about two budgets in a row.
+ */
+#define DEADLINE_TEST_RUNTIME_NS (2 * 1000 * 1000ULL)
+#define DEADLINE_TEST_PERIOD_NS (10 * 1000 * 1000ULL)
+#define DEADLINE_TEST_PERIODS 50
+#define DEADLINE_TEST_MAX_GAP_NS (2 * DEADLINE_TEST_RUNTIME_NS + 2 * 1000 * 1000ULL)
+
+static lk_time_ns_t deadline_test_start;
+static uint deadline_test_periods_served;
+static lk_time_ns_t deadline_test_hog_max_gap;
+
+static int deadline_test_thread(void *arg)
+{
+    uint last_period = ~0U;
+    lk_time_ns_t elapsed;
+
+    while ((elapsed = current_time_ns() - deadline_test_start) <
+           DEADLINE_TEST_PERIODS * DEADLINE_TEST_PERIOD_NS) {
+        uint period = elapsed / DEADLINE_TEST_PERIOD_NS;
+        if (period != last_period) {
+            deadline_test_periods_served++;
+            last_period = period;
+        }
+    }
+
+    return 0;
+}
+
+static int deadline_test_hog_thread(void *arg)
+{
+    lk_time_ns_t last = current_time_ns();
+    lk_time_ns_t now;
+
+    while ((now = current_time_ns()) - deadline_test_start <
+           DEADLINE_TEST_PERIODS * DEADLINE_TEST_PERIOD_NS) {
+        if (now - last > deadline_test_hog_max_gap)
+            deadline_test_hog_max_gap = now - last;
+        last = now;
+    }
+
+    return 0;
+}
+
+static void deadline_test(void)
+{
+    thread_t *dl, *hog;
+    status_t ret;
+    int cpu = arch_curr_cpu_num();
+
+    printf("testing earliest deadline first scheduling\n");
+
+    dl = thread_create("deadline", &deadline_test_thread, NULL,
+                       LOW_PRIORITY, DEFAULT_STACK_SIZE);
+    hog = thread_create("deadline hog", &deadline_test_hog_thread, NULL,
+                        HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_set_pinned_cpu(dl, cpu);
+    thread_set_pinned_cpu(hog, cpu);
+
+    ret = thread_set_deadline(dl, DEADLINE_TEST_RUNTIME_NS,
+                              DEADLINE_TEST_PERIOD_NS * 2,
+                              DEADLINE_TEST_PERIOD_NS);
+    printf("deadline after period: %d (expected %d): %s\n", ret,
+           ERR_INVALID_ARGS, ret == ERR_INVALID_ARGS ? "PASSED" : "FAILED");
+
+    ret = thread_set_deadline(dl, DEADLINE_TEST_PERIOD_NS,
+                              DEADLINE_TEST_PERIOD_NS,
+                              DEADLINE_TEST_PERIOD_NS);
+    printf("admit full cpu: %d (expected %d): %s\n", ret, ERR_NO_RESOURCES,
+           ret == ERR_NO_RESOURCES ? "PASSED" : "FAILED");
+
+    ret = thread_set_deadline(dl, DEADLINE_TEST_RUNTIME_NS,
+                              DEADLINE_TEST_PERIOD_NS,
+                              DEADLINE_TEST_PERIOD_NS);
+    printf("admit %llu us every %llu us: %d: %s\n",
+           DEADLINE_TEST_RUNTIME_NS / 1000, DEADLINE_TEST_PERIOD_NS / 1000,
+           ret, ret == NO_ERROR ? "PASSED" : "FAILED");
+
+    deadline_test_periods_served = 0;
+    deadline_test_hog_max_gap = 0;
+    deadline_test_start = current_time_ns();
+    thread_resume(hog);
+    thread_resume(dl);
+
+    thread_join(dl, NULL, INFINITE_TIME);
+    thread_join(hog, NULL, INFINITE_TIME);
+
+    printf("deadline thread ran in %u of %u periods: %s\n",
+           deadline_test_periods_served, DEADLINE_TEST_PERIODS,
+           deadline_test_periods_served >= DEADLINE_TEST_PERIODS - 1 ?
+           "PASSED" : "FAILED");
+    printf("hog waited at most %llu us (limit %llu us): %s\n",
+           deadline_test_hog_max_gap / 1000, DEADLINE_TEST_MAX_GAP_NS / 1000,
+           deadline_test_hog_max_gap < DEADLINE_TEST_MAX_GAP_NS ?
+           "PASSED" : "FAILED");
+}
+
+/*
+ * A high priority hog limited to a fraction of a cpu shares it with a low
+ * priority thread, which must get to run whenever the hog is throttled.
+ */
+#define QUOTA_TEST_RUNTIME_NS (20 * 1000 * 1000ULL)
+#define QUOTA_TEST_PERIOD_NS (100 * 1000 * 1000ULL)
+#define QUOTA_TEST_TIME_NS (5 * QUOTA_TEST_PERIOD_NS)
+/* the hog may overrun its quota by a tick */
+#define QUOTA_TEST_MAX_GAP_NS (QUOTA_TEST_RUNTIME_NS + 20 * 1000 * 1000ULL)
+
+static lk_time_ns_t quota_test_start;
+static lk_time_ns_t quota_test_max_gap;
+
+static int quota_test_hog_thread(void *arg)
+{
+    while (current_time_ns() - quota_test_start < QUOTA_TEST_TIME_NS)
+        ;
+
+    return 0;
+}
+
+static int quota_test_low_thread(void *arg)
+{
+    lk_time_ns_t last = current_time_ns();
+    lk_time_ns_t now;
+
+    while ((now = current_time_ns()) - quota_test_start < QUOTA_TEST_TIME_NS) {
+        if (now - last > quota_test_max_gap)
+            quota_test_max_gap = now - last;
+        last = now;
+    }
+
+    return 0;
+}
+
+static void quota_test(void)
+{
+    thread_t *hog, *low;
+    status_t ret;
+    int cpu = arch_curr_cpu_num();
+
+    printf("testing cpu quota\n");
+
+    hog = thread_create("quota hog", &quota_test_hog_thread, NULL,
+                        HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    low = thread_create("quota low", &quota_test_low_thread, NULL,
+                        LOW_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_set_pinned_cpu(hog, cpu);
+    thread_set_pinned_cpu(low, cpu);
+
+    ret = thread_set_cpu_quota(hog, QUOTA_TEST_RUNTIME_NS,
+                               QUOTA_TEST_RUNTIME_NS / 2);
+    printf("quota above period: %d (expected %d): %s\n", ret,
+           ERR_INVALID_ARGS, ret == ERR_INVALID_ARGS ? "PASSED" : "FAILED");
+
+    ret = thread_set_cpu_quota(hog, QUOTA_TEST_RUNTIME_NS,
+                               QUOTA_TEST_PERIOD_NS);
+    printf("limit to %llu us every %llu us: %d: %s\n",
+           QUOTA_TEST_RUNTIME_NS / 1000, QUOTA_TEST_PERIOD_NS / 1000,
+           ret, ret == NO_ERROR ? "PASSED" : "FAILED");
+
+    quota_test_max_gap = 0;
+    quota_test_start = current_time_ns();
+    thread_resume(low);
+    thread_resume(hog);
+
+    thread_join(hog, NULL, INFINITE_TIME);
+    thread_join(low, NULL, INFINITE_TIME);
+
+    printf("low priority thread waited at most %llu us (limit %llu us): %s\n",
+           quota_test_max_gap / 1000, QUOTA_TEST_MAX_GAP_NS / 1000,
+           quota_test_max_gap < QUOTA_TEST_MAX_GAP_NS ? "PASSED" : "FAILED");
+}
+
 static int join_tester(void *arg)
 {
     long val = (long)arg;
@@ -616,19 +1684,561 @@ static void spinlock_test(void)
 #undef COUNT
 }
 
+/*
+ * Scaling test harness. Runs a tester function on a number of threads, each
+ * pinned to its own active cpu, starts them together and averages the cycles
+ * they report.
+ */
+typedef uint (*scaling_test_fn)(uint index, void *arg);
+
+struct scaling_test_thread {
+    scaling_test_fn fn;
+    void *arg;
+    uint index;
+    uint cycles;
+};
+
+static event_t scaling_test_start_event;
+
+static int scaling_test_thread(void *arg)
+{
+    struct scaling_test_thread *st = arg;
+
+    event_wait(&scaling_test_start_event);
+    st->cycles = st->fn(st->index, st->arg);
+
+    return 0;
+}
+
+static uint scaling_test_cpu_count(void)
+{
+    uint cpu_count = 0;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (mp_is_cpu_active(i))
+            cpu_count++;
+    }
+    return cpu_count;
+}
+
+/* 1, 2, 4, ... up to and always ending with @max */
+static uint scaling_test_next_count(uint count, uint max)
+{
+    if (count == max)
+        return max + 1;
+    return MIN(count * 2, max);
+}
+
+/*
+ * Run @fn(index, @arg) for index 0 to @thread_count - 1, on threads pinned
+ * to different active cpus, and return the average of the cycles it returned.
+ */
+static uint scaling_test_run(scaling_test_fn fn, void *arg, uint thread_count)
+{
+    struct scaling_test_thread *st;
+    thread_t *threads[SMP_MAX_CPUS];
+    uint total_cycles = 0;
+    uint cpu = 0;
+
+    DEBUG_ASSERT(thread_count <= scaling_test_cpu_count());
+
+    st = calloc(thread_count, sizeof(*st));
+    if (!st) {
+        printf("failed to allocate test state\n");
+        return 0;
+    }
+
+    event_init(&scaling_test_start_event, false, 0);
+    for (uint i = 0; i < thread_count; i++, cpu++) {
+        while (!mp_is_cpu_active(cpu))
+            cpu++;
+
+        st[i].fn = fn;
+        st[i].arg = arg;
+        st[i].index = i;
+        threads[i] = thread_create("scaling tester", &scaling_test_thread,
+                                   &st[i], HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_set_pinned_cpu(threads[i], cpu);
+        thread_resume(threads[i]);
+    }
+
+    thread_sleep(100);
+    event_signal(&scaling_test_start_event, true);
+
+    for (uint i = 0; i < thread_count; i++) {
+        thread_join(threads[i], NULL, INFINITE_TIME);
+        total_cycles += st[i].cycles / thread_count;
+    }
+    event_destroy(&scaling_test_start_event);
+    free(st);
+
+    return total_cycles;
+}
+
+/*
+ * Private objects: each thread hammers its own mutex and event, which are
+ * never contended, so no thread ever blocks. Block/wake pairs: two threads on
+ * different cpus ping-pong through their own pair of events, so every
+ * iteration blocks and wakes a thread across cpus, but pairs still share no
+ * object. Any increase in cycles per iteration over the single thread or
+ * pair baseline as threads are added comes from locks shared between
+ * unrelated objects. Blocking and waking still go through the global thread
+ * lock, which the pairs show.
+ */
+#define LOCK_CONTENTION_ITER 100000
+#define LOCK_CONTENTION_PAIR_ITER 10000
+
+struct lock_contention_args {
+    mutex_t mutex;
+    event_t event;
+    event_t ping;
+    event_t pong;
+};
+
+static uint lock_contention_private(uint index, void *arg)
+{
+    struct lock_contention_args *args = (struct lock_contention_args *)arg + index;
+
+    uint count = arch_cycle_count();
+    for (int i = 0; i < LOCK_CONTENTION_ITER; i++) {
+        mutex_acquire(&args->mutex);
+        event_signal(&args->event, false);
+        event_unsignal(&args->event);
+        mutex_release(&args->mutex);
+    }
+    return (arch_cycle_count() - count) / LOCK_CONTENTION_ITER;
+}
+
+static uint lock_contention_pair(uint index, void *arg)
+{
+    struct lock_contention_args *args = (struct lock_contention_args *)arg + index / 2;
+
+    uint count = arch_cycle_count();
+    for (int i = 0; i < LOCK_CONTENTION_PAIR_ITER; i++) {
+        if (index % 2) {
+            event_wait(&args->ping);
+            event_signal(&args->pong, false);
+        } else {
+            event_signal(&args->ping, false);
+            event_wait(&args->pong);
+        }
+    }
+    return (arch_cycle_count() - count) / LOCK_CONTENTION_PAIR_ITER;
+}
+
+static void lock_contention_test(void)
+{
+    struct lock_contention_args *args;
+    uint cpu_count = scaling_test_cpu_count();
+    uint baseline = 0;
+
+    printf("testing lock contention between unrelated objects:\n");
+
+    args = calloc(cpu_count, sizeof(*args));
+    if (!args) {
+        printf("failed to allocate test state\n");
+        return;
+    }
+
+    for (uint n = 1; n <= cpu_count; n = scaling_test_next_count(n, cpu_count)) {
+        for (uint i = 0; i < n; i++) {
+            mutex_init(&args[i].mutex);
+            event_init(&args[i].event, false, 0);
+        }
+
+        uint cycles = scaling_test_run(lock_contention_private, args, n);
+        if (n == 1)
+            baseline = cycles;
+
+        for (uint i = 0; i < n; i++) {
+            event_destroy(&args[i].event);
+            mutex_destroy(&args[i].mutex);
+        }
+
+        printf("private objects, %u threads: %u cycles per mutex acquire/release and event signal/unsignal, %u with 1 thread (%u%%)\n",
+               n, cycles, baseline, baseline ? cycles * 100 / baseline : 0);
+    }
+
+    for (uint n = 1; n <= cpu_count / 2;
+         n = scaling_test_next_count(n, cpu_count / 2)) {
+        for (uint i = 0; i < n; i++) {
+            event_init(&args[i].ping, false, EVENT_FLAG_AUTOUNSIGNAL);
+            event_init(&args[i].pong, false, EVENT_FLAG_AUTOUNSIGNAL);
+        }
+
+        uint cycles = scaling_test_run(lock_contention_pair, args, n * 2);
+        if (n == 1)
+            baseline = cycles;
+
+        for (uint i = 0; i < n; i++) {
+            event_destroy(&args[i].pong);
+            event_destroy(&args[i].ping);
+        }
+
+        printf("block/wake pairs, %u pairs: %u cycles per cross-cpu round trip, %u with 1 pair (%u%%)\n",
+               n, cycles, baseline, baseline ? cycles * 100 / baseline : 0);
+    }
+
+    free(args);
+}
+
+/*
+ * Read side cost of each lock type as the number of cpus reading the same
+ * data grows.
+ */
+#define READ_SCALING_ITER 100000
+
+enum read_scaling_lock {
+    READ_SCALING_MUTEX,
+    READ_SCALING_RWLOCK,
+    READ_SCALING_SEQLOCK,
+    READ_SCALING_RCU,
+    READ_SCALING_LOCK_COUNT,
+};
+
+static const char *read_scaling_lock_names[READ_SCALING_LOCK_COUNT] = {
+    [READ_SCALING_MUTEX] = "mutex",
+    [READ_SCALING_RWLOCK] = "rwlock",
+    [READ_SCALING_SEQLOCK] = "seqlock",
+    [READ_SCALING_RCU] = "rcu",
+};
+
+static mutex_t read_scaling_mutex;
+static rwlock_t read_scaling_rwlock;
+static seqlock_t read_scaling_seqlock;
+static volatile int read_scaling_data;
+static volatile int *read_scaling_rcu_data = &read_scaling_data;
+
+static volatile int read_scaling_sum;
+
+static uint read_scaling_tester(uint index, void *arg)
+{
+    enum read_scaling_lock lock = *(enum read_scaling_lock *)arg;
+    spin_lock_saved_state_t state;
+    uint32_t seq;
+    int sum = 0;
+    int value;
+
+    uint count = arch_cycle_count();
+    for (int i = 0; i < READ_SCALING_ITER; i++) {
+        switch (lock) {
+            case READ_SCALING_MUTEX:
+                mutex_acquire(&read_scaling_mutex);
+                sum += read_scaling_data;
+                mutex_release(&read_scaling_mutex);
+                break;
+            case READ_SCALING_RWLOCK:
+                rwlock_acquire_read(&read_scaling_rwlock);
+                sum += read_scaling_data;
+                rwlock_release_read(&read_scaling_rwlock);
+                break;
+            case READ_SCALING_RCU:
+                rcu_read_lock(&state);
+                sum += *rcu_dereference(read_scaling_rcu_data);
+                rcu_read_unlock(state);
+                break;
+            default:
+                do {
+                    seq = seqlock_read_begin(&read_scaling_seqlock);
+                    value = read_scaling_data;
+                } while (seqlock_read_retry(&read_scaling_seqlock, seq));
+                sum += value;
+                break;
+        }
+    }
+    uint cycles = arch_cycle_count() - count;
+
+    /* keep the reads from being optimized out */
+    read_scaling_sum += sum;
+
+    return cycles / READ_SCALING_ITER;
+}
+
+static void read_scaling_test(void)
+{
+    uint cpu_count = scaling_test_cpu_count();
+
+    printf("testing read side lock scaling:\n");
+
+    mutex_init(&read_scaling_mutex);
+    rwlock_init(&read_scaling_rwlock);
+    seqlock_init(&read_scaling_seqlock);
+
+    for (enum read_scaling_lock lock = 0; lock < READ_SCALING_LOCK_COUNT; lock++) {
+        for (uint n = 1; n <= cpu_count; n = scaling_test_next_count(n, cpu_count)) {
+            printf("%s, %u readers: %u cycles per read\n",
+                   read_scaling_lock_names[lock], n,
+                   scaling_test_run(read_scaling_tester, &lock, n));
+        }
+    }
+
+    rwlock_destroy(&read_scaling_rwlock);
+    mutex_destroy(&read_scaling_mutex);
+}
+
+/*
+ * Producers and consumers passing items through a small buffer protected by a
+ * mutex, waiting for space or items on either a pair of events, as code did
+ * before cond_t existed, or a pair of condition variables. Signaling an event
+ * wakes every waiter, which then blocks again on the mutex.
+ */
+#define PC_ITEMS 20000
+#define PC_BUF_SIZE 4
+#define PC_THREADS 4 /* of each kind */
+
+enum pc_mode {
+    PC_EVENT,
+    PC_COND_SIGNAL,
+    PC_COND_BROADCAST,
+    PC_MODE_COUNT,
+};
+
+static const char *pc_mode_names[PC_MODE_COUNT] = {
+    [PC_EVENT] = "event",
+    [PC_COND_SIGNAL] = "cond signal",
+    [PC_COND_BROADCAST] = "cond broadcast",
+};
+
+static struct {
+    enum pc_mode mode;
+    mutex_t lock;
+    cond_t not_empty;
+    cond_t not_full;
+    event_t not_empty_event;
+    event_t not_full_event;
+    uint count; /* items in the buffer */
+    uint produced;
+    uint consumed;
+} pc;
+
+/* called with pc.lock held, returns with it held */
+static void pc_wait(cond_t *c, event_t *e)
+{
+    if (pc.mode == PC_EVENT) {
+        event_unsignal(e);
+        mutex_release(&pc.lock);
+        event_wait(e);
+        mutex_acquire(&pc.lock);
+    } else {
+        cond_wait(c, &pc.lock);
+    }
+}
+
+static void pc_wake(cond_t *c, event_t *e, bool all)
+{
+    if (pc.mode == PC_EVENT)
+        event_signal(e, false);
+    else if (all || pc.mode == PC_COND_BROADCAST)
+        cond_broadcast(c);
+    else
+        cond_signal(c);
+}
+
+static int pc_producer(void *arg)
+{
+    mutex_acquire(&pc.lock);
+    for (;;) {
+        while (pc.count == PC_BUF_SIZE && pc.produced < PC_ITEMS)
+            pc_wait(&pc.not_full, &pc.not_full_event);
+        if (pc.produced == PC_ITEMS)
+            break;
+
+        pc.count++;
+        pc.produced++;
+        pc_wake(&pc.not_empty, &pc.not_empty_event, false);
+        /* let the other producers see there is nothing left to do */
+        if (pc.produced == PC_ITEMS)
+            pc_wake(&pc.not_full, &pc.not_full_event, true);
+    }
+    mutex_release(&pc.lock);
+
+    return 0;
+}
+
+static int pc_consumer(void *arg)
+{
+    mutex_acquire(&pc.lock);
+    for (;;) {
+        while (pc.count == 0 && pc.consumed < PC_ITEMS)
+            pc_wait(&pc.not_empty, &pc.not_empty_event);
+        if (pc.consumed == PC_ITEMS)
+            break;
+
+        pc.count--;
+        pc.consumed++;
+        pc_wake(&pc.not_full, &pc.not_full_event, false);
+        if (pc.consumed == PC_ITEMS)
+            pc_wake(&pc.not_empty, &pc.not_empty_event, true);
+    }
+    mutex_release(&pc.lock);
+
+    return 0;
+}
+
+static void producer_consumer_test(void)
+{
+    thread_t *threads[2 * PC_THREADS];
+
+    printf("testing producer/consumer throughput:\n");
+
+    for (uint mode = 0; mode < PC_MODE_COUNT; mode++) {
+        pc.mode = mode;
+        pc.count = pc.produced = pc.consumed = 0;
+        mutex_init(&pc.lock);
+        cond_init(&pc.not_empty);
+        cond_init(&pc.not_full);
+        event_init(&pc.not_empty_event, false, 0);
+        event_init(&pc.not_full_event, false, 0);
+
+        lk_time_ns_t t = current_time_ns();
+        for (uint i = 0; i < countof(threads); i++) {
+            threads[i] = thread_create(i % 2 ? "consumer" : "producer",
+                                       i % 2 ? &pc_consumer : &pc_producer,
+                                       NULL, DEFAULT_PRIORITY,
+                                       DEFAULT_STACK_SIZE);
+            thread_resume(threads[i]);
+        }
+        for (uint i = 0; i < countof(threads); i++)
+            thread_join(threads[i], NULL, INFINITE_TIME);
+        t = current_time_ns() - t;
+
+        printf("%s, %d producers, %d consumers: %llu ns per item\n",
+               pc_mode_names[mode], PC_THREADS, PC_THREADS, t / PC_ITEMS);
+
+        event_destroy(&pc.not_full_event);
+        event_destroy(&pc.not_empty_event);
+        cond_destroy(&pc.not_full);
+        cond_destroy(&pc.not_empty);
+        mutex_destroy(&pc.lock);
+    }
+}
+
+/*
+ * Cost of waits that are woken before their timeout, compared to the same
+ * waits without one. Two threads ping-pong through a pair of events, then
+ * contend on a mutex.
+ */
+#define TW_ITERATIONS 20000
+#define TW_TIMEOUT 1000 /* ms, long enough to never expire */
+
+static struct {
+    lk_time_t timeout;
+    event_t ping;
+    event_t pong;
+    mutex_t lock;
+} tw;
+
+static int tw_event_ponger(void *arg)
+{
+    for (uint i = 0; i < TW_ITERATIONS; i++) {
+        if (event_wait_timeout(&tw.ping, tw.timeout) != NO_ERROR)
+            return -1;
+        event_signal(&tw.pong, true);
+    }
+    return 0;
+}
+
+static int tw_mutex_tester(void *arg)
+{
+    for (uint i = 0; i < TW_ITERATIONS; i++) {
+        if (mutex_acquire_timeout(&tw.lock, tw.timeout) != NO_ERROR)
+            return -1;
+        thread_yield();
+        mutex_release(&tw.lock);
+    }
+    return 0;
+}
+
+static void timed_wait_test(void)
+{
+    static const lk_time_t timeouts[] = { INFINITE_TIME, TW_TIMEOUT };
+    thread_t *threads[2];
+    int ret;
+
+    printf("testing timed wait cost:\n");
+
+    for (uint i = 0; i < countof(timeouts); i++) {
+        tw.timeout = timeouts[i];
+        event_init(&tw.ping, false, EVENT_FLAG_AUTOUNSIGNAL);
+        event_init(&tw.pong, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+        threads[0] = thread_create("timed wait ponger", &tw_event_ponger, NULL,
+                                   DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(threads[0]);
+
+        lk_time_ns_t t = current_time_ns();
+        for (uint j = 0; j < TW_ITERATIONS; j++) {
+            event_signal(&tw.ping, true);
+            ret = event_wait_timeout(&tw.pong, tw.timeout);
+            if (ret != NO_ERROR) {
+                printf("event_wait_timeout returned %d\n", ret);
+                break;
+            }
+        }
+        t = current_time_ns() - t;
+        thread_join(threads[0], &ret, INFINITE_TIME);
+        if (ret)
+            printf("ponger returned %d\n", ret);
+
+        printf("event ping-pong, %s timeout: %llu ns per round trip\n",
+               tw.timeout == INFINITE_TIME ? "no" : "finite",
+               t / TW_ITERATIONS);
+
+        event_destroy(&tw.pong);
+        event_destroy(&tw.ping);
+
+        mutex_init(&tw.lock);
+
+        t = current_time_ns();
+        for (uint j = 0; j < countof(threads); j++) {
+            threads[j] = thread_create("timed wait mutex", &tw_mutex_tester,
+                                       NULL, DEFAULT_PRIORITY,
+                                       DEFAULT_STACK_SIZE);
+            thread_resume(threads[j]);
+        }
+        for (uint j = 0; j < countof(threads); j++) {
+            thread_join(threads[j], &ret, INFINITE_TIME);
+            if (ret)
+                printf("mutex tester returned %d\n", ret);
+        }
+        t = current_time_ns() - t;
+
+        printf("mutex handoff, %s timeout: %llu ns per acquire\n",
+               tw.timeout == INFINITE_TIME ? "no" : "finite",
+               t / (TW_ITERATIONS * countof(threads)));
+
+        mutex_destroy(&tw.lock);
+    }
+}
+
 int thread_tests(void)
 {
     mutex_test();
+    mutex_pi_test();
+    mutex_pi_race_test();
+    mutex_pi_timeout_test();
+    rwlock_test();
+    seqlock_test();
+    rcu_test();
+    wait_address_test();
+    cond_test();
     semaphore_test();
     event_test();
+    event_wait_any_test();
 
     spinlock_test();
     atomic_test();
+    lock_contention_test();
+    read_scaling_test();
+    producer_consumer_test();
+    timed_wait_test();
 
     thread_sleep(200);
     context_switch_test();
 
     preempt_test();
+    deadline_test();
+    quota_test();
 
     join_test();
 
@@ -27,21 +27,22 @@
 
 #define LOCAL_TRACE 0
 
-static struct fpstate *current_fpstate[SMP_MAX_CPUS];
+static DEFINE_PER_CPU(struct fpstate *, current_fpstate);
 
 static void arm64_fpu_load_state(struct thread *t)
 {
     uint cpu = arch_curr_cpu_num();
     struct fpstate *fpstate = &t->arch.fpstate;
+    struct fpstate **current = &per_cpu(current_fpstate, cpu);
 
-    if (fpstate == current_fpstate[cpu] && fpstate->current_cpu == cpu) {
+    if (fpstate == *current && fpstate->current_cpu == cpu) {
         LTRACEF("cpu %d, thread %s, fpstate already valid\n", cpu, t->name);
         return;
     }
     LTRACEF("cpu %d, thread %s, load fpstate %p, last cpu %d, last fpstate %p\n",
-            cpu, t->name, fpstate, fpstate->current_cpu, current_fpstate[cpu]);
+            cpu, t->name, fpstate, fpstate->current_cpu, *current);
     fpstate->current_cpu = cpu;
-    current_fpstate[cpu] = fpstate;
+    *current = fpstate;
 
 
     STATIC_ASSERT(sizeof(fpstate->regs) == 16 * 32);
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2026 Google Inc. All rights reserved
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <kernel/mutex.h>
+#include <kernel/thread.h>
+
+__BEGIN_CDECLS;
+
+#define COND_MAGIC (0x636f6e64)  // 'cond'
+
+typedef struct cond {
+    uint32_t magic;
+    uint32_t seq; /* changed by every signal, waited on with wait_on_address() */
+    mutex_t *mutex; /* mutex of the current waiters */
+} cond_t;
+
+#define COND_INITIAL_VALUE(c) \
+{ \
+    .magic = COND_MAGIC, \
+    .seq = 0, \
+    .mutex = NULL, \
+}
+
+/* Rules for condition variables:
+ * - Condition variables are only safe to use from thread context.
+ * - All threads waiting on a condition variable at the same time must use the
+ *   same mutex.
+ * - Waits may return without a signal, the caller must check its condition
+ *   again.
+ * - Signaled waiters are moved to the mutex's wait queue instead of being
+ *   woken, and run once they get the mutex.
+ */
+
+void cond_init(cond_t *);
+void cond_destroy(cond_t *);
+status_t cond_wait_timeout(cond_t *, mutex_t *, lk_time_t);
+void cond_signal(cond_t *);
+void cond_broadcast(cond_t *);
+
+static inline status_t cond_wait(cond_t *c, mutex_t *m)
+{
+    return cond_wait_timeout(c, m, INFINITE_TIME);
+}
+
+__END_CDECLS;
@@ -37,16 +37,21 @@ typedef struct event {
     bool signaled;
     uint flags;
     wait_queue_t wait;
+    struct list_node any_waiters; /* event_wait_any() callers, protected by wait.lock */
 } event_t;
 
 #define EVENT_FLAG_AUTOUNSIGNAL 1
 
+/* maximum number of events event_wait_any() can wait on */
+#define EVENT_WAIT_ANY_MAX 16
+
 #define EVENT_INITIAL_VALUE(e, initial, _flags) \
 { \
     .magic = EVENT_MAGIC, \
     .signaled = initial, \
     .flags = _flags, \
     .wait = WAIT_QUEUE_INITIAL_VALUE((e).wait), \
+    .any_waiters = LIST_INITIAL_VALUE((e).any_waiters), \
 }
 
 /* Rules for Events:
@@ -63,11 +68,16 @@ typedef struct event {
  *     in the signaled state until a thread attempts to wait (at which
  *     time it will unsignal atomicly and return immediately) or
  *     event_unsignal() is called.
+ * - event_wait_any() waits for the first of several events to be signaled,
+ *   and consumes only that one if it has FLAG_AUTOUNSIGNAL. Its callers are
+ *   woken before threads waiting on the event alone, without rescheduling.
 */
 
 void event_init(event_t *, bool initial, uint flags);
 void event_destroy(event_t *);
 status_t event_wait_timeout(event_t *, lk_time_t); /* wait on the event with a timeout */
+status_t event_wait_any(event_t **events, uint count, lk_time_t timeout,
+                        uint *index);
 status_t event_signal(event_t *, bool reschedule);
 status_t event_unsignal(event_t *);
 
@@ -30,7 +30,7 @@
 
 __BEGIN_CDECLS;
 
-typedef uint32_t mp_cpu_mask_t;
+/* mp_cpu_mask_t is defined in kernel/thread.h, which uses it for affinity */
 
 #define MP_CPU_ALL_BUT_LOCAL (UINT32_MAX)
 
@@ -44,6 +44,39 @@ typedef enum {
     MP_IPI_RESCHEDULE,
 } mp_ipi_t;
 
+typedef void (*mp_call_func_t)(void *arg);
+
+struct mp_call;
+
+/* entry of an mp_call_t in the mailbox of one target cpu */
+struct mp_call_node {
+    struct mp_call_node *next;
+    struct mp_call *call;
+};
+
+/*
+ * A function call to run on a set of cpus, see mp_async_exec(). Owned by the
+ * caller, which may reuse it once mp_call_done() returns true.
+ */
+typedef struct mp_call {
+    mp_call_func_t func;
+    void *arg;
+    int pending; /* cpus that have not run func yet, updated atomically */
+    struct mp_call_node node[SMP_MAX_CPUS];
+} mp_call_t;
+
+#define MP_CALL_INITIAL_VALUE(c) { .pending = 0 }
+
+static inline void mp_call_init(mp_call_t *call)
+{
+    *call = (mp_call_t)MP_CALL_INITIAL_VALUE(*call);
+}
+
+static inline bool mp_call_done(mp_call_t *call)
+{
+    return !__atomic_load_n(&call->pending, __ATOMIC_ACQUIRE);
+}
+
 #ifdef WITH_SMP
 void mp_init(void);
 
@@ -53,6 +86,38 @@ void mp_set_curr_cpu_active(bool active);
 /* called from arch code during reschedule irq */
 enum handler_return mp_mbx_reschedule_irq(void);
 
+/* called from arch code during generic irq */
+enum handler_return mp_mbx_generic_irq(void);
+
+/**
+ * mp_sync_exec() - Run a function on a set of cpus and wait for it.
+ * @target: cpus to run @func on, may include the local cpu. Inactive cpus
+ *          are skipped.
+ * @func:   Function to run. It is called from interrupt context with
+ *          interrupts disabled and must not block.
+ * @arg:    Argument passed to @func.
+ *
+ * Returns once @func returned on every cpu in @target. Must not be called
+ * with the thread lock or another spin lock held that @func or an interrupt
+ * handler on a target cpu may wait for.
+ */
+void mp_sync_exec(mp_cpu_mask_t target, mp_call_func_t func, void *arg);
+
+/**
+ * mp_async_exec() - Run a function on a set of cpus without waiting for it.
+ * @call:   Call object, initialized with mp_call_init(). It must stay valid
+ *          until mp_call_done() returns %true.
+ * @target: cpus to run @func on, may include the local cpu, which runs it
+ *          before this function returns. Inactive cpus are skipped.
+ * @func:   Function to run, with the same restrictions as for
+ *          mp_sync_exec().
+ * @arg:    Argument passed to @func.
+ *
+ * Return: %NO_ERROR, or %ERR_BUSY if @call is still running.
+ */
+status_t mp_async_exec(mp_call_t *call, mp_cpu_mask_t target,
+                       mp_call_func_t func, void *arg);
+
 /* global mp state to track what the cpus are up to */
 struct mp_state {
     volatile mp_cpu_mask_t active_cpus;
@@ -60,6 +125,9 @@ struct mp_state {
     /* only safely accessible with thread lock held */
     mp_cpu_mask_t idle_cpus;
     mp_cpu_mask_t realtime_cpus;
+
+    /* cpus sent a reschedule ipi they have not taken yet, updated atomically */
+    volatile mp_cpu_mask_t reschedule_pending;
 };
 
 extern struct mp_state mp;
@@ -110,6 +178,25 @@ static inline void mp_reschedule(mp_cpu_mask_t target, uint flags) {}
 static inline void mp_set_curr_cpu_active(bool active) {}
 
 static inline enum handler_return mp_mbx_reschedule_irq(void) { return 0; }
+static inline enum handler_return mp_mbx_generic_irq(void) { return 0; }
+
+static inline void mp_sync_exec(mp_cpu_mask_t target, mp_call_func_t func,
+                                void *arg)
+{
+    if (target & 1) {
+        spin_lock_saved_state_t state;
+        arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+        func(arg);
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+    }
+}
+
+static inline status_t mp_async_exec(mp_call_t *call, mp_cpu_mask_t target,
+                                     mp_call_func_t func, void *arg)
+{
+    mp_sync_exec(target, func, arg);
+    return 0;
+}
 
 // only one cpu exists in UP and if you're calling these functions, it's active...
 static inline int mp_is_cpu_active(uint cpu) { return 1; }
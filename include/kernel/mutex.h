@@ -35,9 +35,11 @@ __BEGIN_CDECLS;
 
 typedef struct mutex {
     uint32_t magic;
-    thread_t *holder;
-    int count;
+    thread_t *holder; /* lock word, updated atomically */
+    int count; /* threads trying to acquire the mutex on the slow path */
     wait_queue_t wait;
+    struct list_node pi_node; /* on the holder's pi_mutexes while contended */
+    thread_t *pi_owner; /* thread whose pi_mutexes pi_node is on, or NULL */
 } mutex_t;
 
 #define MUTEX_INITIAL_VALUE(m) \
@@ -46,6 +48,8 @@ typedef struct mutex {
     .holder = NULL, \
     .count = 0, \
     .wait = WAIT_QUEUE_INITIAL_VALUE((m).wait), \
+    .pi_node = LIST_INITIAL_CLEARED_VALUE, \
+    .pi_owner = NULL, \
 }
 
 /* Rules for Mutexes:
@@ -63,10 +67,17 @@ static inline status_t mutex_acquire(mutex_t *m)
     return mutex_acquire_timeout(m, INFINITE_TIME);
 }
 
+/* condition variable helpers, see kernel/mutex.c */
+int mutex_requeue(mutex_t *, wait_queue_t *, uint count);
+status_t mutex_acquire_requeued(mutex_t *);
+
+/* priority inheritance helper for the scheduler, call with the thread lock held */
+int mutex_inherited_priority(thread_t *t);
+
 /* does the current thread hold the mutex? */
 static bool is_mutex_held(mutex_t *m)
 {
-    return m->holder == get_current_thread();
+    return __atomic_load_n(&m->holder, __ATOMIC_RELAXED) == get_current_thread();
 }
 
 __END_CDECLS;
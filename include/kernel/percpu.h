@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2026 Google Inc. All rights reserved
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <arch/ops.h>
+#include <compiler.h>
+
+/*
+ * Per-cpu variables.
+ *
+ * A per-cpu variable has one copy of its value for each cpu, each copy in its
+ * own cache line so a cpu updating its copy never bounces the line holding
+ * another cpu's copy. Values are zero initialized.
+ *
+ * Module private variables are defined with:
+ *
+ *     static DEFINE_PER_CPU(type, name);
+ *
+ * Variables shared between modules are declared in a header with
+ * DECLARE_PER_CPU(type, name) and defined in one source file, after that
+ * header is included, with DEFINE_PER_CPU_DECLARED(type, name).
+ *
+ * per_cpu(name, cpu) is the copy belonging to @cpu. this_cpu(name) is the copy
+ * of the calling cpu, which is only stable while the caller cannot migrate,
+ * e.g. with interrupts disabled or the thread lock held.
+ */
+
+#define PER_CPU_SYM(name) name##__percpu
+#define PER_CPU_STRUCT(name) struct percpu_##name
+
+#define DEFINE_PER_CPU(type, name) \
+    PER_CPU_STRUCT(name) { type val; } __CPU_ALIGN PER_CPU_SYM(name)[SMP_MAX_CPUS]
+
+#define DECLARE_PER_CPU(type, name) \
+    extern DEFINE_PER_CPU(type, name)
+
+#define DEFINE_PER_CPU_DECLARED(type, name) \
+    PER_CPU_STRUCT(name) PER_CPU_SYM(name)[SMP_MAX_CPUS]; \
+    STATIC_ASSERT(__builtin_types_compatible_p( \
+        type, __typeof__(PER_CPU_SYM(name)[0].val)))
+
+#define per_cpu(name, cpu) (PER_CPU_SYM(name)[(cpu)].val)
+#define this_cpu(name) per_cpu(name, arch_curr_cpu_num())
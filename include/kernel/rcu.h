@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2026 Google Inc. All rights reserved
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <list.h>
+#include <sys/types.h>
+#include <arch/ops.h>
+#include <kernel/spinlock.h>
+
+__BEGIN_CDECLS;
+
+/*
+ * Read-copy-update.
+ *
+ * Readers access shared data in a read side critical section, without taking
+ * a lock. Updaters unpublish old data, then free it from a callback that only
+ * runs once every reader that could still see it has left its critical
+ * section, i.e. once a grace period has passed.
+ *
+ * Read side critical sections run with interrupts disabled and must not block.
+ * A cpu that enters the scheduler or takes an interrupt is therefore outside
+ * any critical section, which is how grace periods are detected: they end
+ * once every cpu busy when they started has gone through a context switch,
+ * or, if that takes longer than RCU_GP_FORCE_MS, taken an interrupt sent to
+ * it. Idle cpus are never waited for.
+ *
+ * Readers must run in thread context. Callbacks run in the dpc thread.
+ */
+
+struct rcu_head;
+typedef void (*rcu_callback_t)(struct rcu_head *head);
+
+struct rcu_head {
+    struct list_node node;
+    rcu_callback_t func;
+};
+
+static inline void rcu_read_lock(spin_lock_saved_state_t *statep)
+{
+    arch_interrupt_save(statep, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+static inline void rcu_read_unlock(spin_lock_saved_state_t state)
+{
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+/* load a pointer published with rcu_assign_pointer() */
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+
+/* publish @v, after the stores initializing what it points to */
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/*
+ * List helpers. Updaters must serialize with each other, readers may iterate
+ * over the list concurrently with list_for_every_entry_rcu(). A deleted item
+ * must not be reused or freed before a grace period has passed.
+ */
+static inline void list_add_tail_rcu(struct list_node *list,
+                                     struct list_node *item)
+{
+    item->prev = list->prev;
+    item->next = list;
+    rcu_assign_pointer(list->prev->next, item);
+    list->prev = item;
+}
+
+static inline void list_delete_rcu(struct list_node *item)
+{
+    /* leave item->next alone for readers still on the item */
+    item->next->prev = item->prev;
+    __atomic_store_n(&item->prev->next, item->next, __ATOMIC_RELAXED);
+    item->prev = NULL;
+}
+
+#define list_for_every_entry_rcu(list, entry, type, member) \
+    for (struct list_node *_list_for_every_cursor = rcu_dereference((list)->next); \
+            (_list_for_every_cursor != (list)) && \
+            ((entry) = containerof(_list_for_every_cursor, type, member)); \
+            _list_for_every_cursor = rcu_dereference(_list_for_every_cursor->next))
+
+/*
+ * Call @func with @head once a grace period has passed. Must not be called
+ * from a read side critical section or with the thread lock held.
+ */
+void call_rcu(struct rcu_head *head, rcu_callback_t func);
+
+/*
+ * Wait for a grace period, and for the callbacks queued before it. Must be
+ * called from thread context outside of a read side critical section.
+ */
+void rcu_synchronize(void);
+
+void rcu_init(void);
+
+/* scheduler hook, called by thread_resched() with the thread lock held */
+#if WITH_SMP
+void rcu_note_context_switch(uint cpu);
+#else
+static inline void rcu_note_context_switch(uint cpu) {}
+#endif
+
+__END_CDECLS;
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2026 Google Inc. All rights reserved
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <kernel/thread.h>
+
+__BEGIN_CDECLS;
+
+#define RWLOCK_MAGIC (0x72776c6b)  // 'rwlk'
+
+/* state bits, the low bits count the readers holding the lock */
+#define RWLOCK_WRITER (1U << 31)
+#define RWLOCK_WAITERS (1U << 30)
+#define RWLOCK_READERS_MASK (RWLOCK_WAITERS - 1)
+
+typedef struct rwlock {
+    uint32_t magic;
+    uint32_t state; /* lock word, updated atomically */
+    uint readers_waiting; /* protected by read_wait.lock, as are the next */
+    uint writers_waiting;
+    wait_queue_t read_wait;
+    wait_queue_t write_wait;
+} rwlock_t;
+
+#define RWLOCK_INITIAL_VALUE(rw) \
+{ \
+    .magic = RWLOCK_MAGIC, \
+    .state = 0, \
+    .readers_waiting = 0, \
+    .writers_waiting = 0, \
+    .read_wait = WAIT_QUEUE_INITIAL_VALUE((rw).read_wait), \
+    .write_wait = WAIT_QUEUE_INITIAL_VALUE((rw).write_wait), \
+}
+
+/* Rules for rwlocks:
+ * - rwlocks are only safe to use from thread context.
+ * - rwlocks are non-recursive, a reader must not acquire the lock again
+ *   while a writer may be waiting.
+ * - Waiting writers are preferred: once a writer waits, new readers wait
+ *   behind it.
+ */
+
+void rwlock_init(rwlock_t *);
+void rwlock_destroy(rwlock_t *);
+status_t rwlock_acquire_read_timeout(rwlock_t *, lk_time_t);
+status_t rwlock_acquire_write_timeout(rwlock_t *, lk_time_t);
+void rwlock_release_read(rwlock_t *);
+void rwlock_release_write(rwlock_t *);
+
+static inline status_t rwlock_acquire_read(rwlock_t *rw)
+{
+    return rwlock_acquire_read_timeout(rw, INFINITE_TIME);
+}
+
+static inline status_t rwlock_acquire_write(rwlock_t *rw)
+{
+    return rwlock_acquire_write_timeout(rw, INFINITE_TIME);
+}
+
+__END_CDECLS;
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2026 Google Inc. All rights reserved
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <kernel/spinlock.h>
+
+__BEGIN_CDECLS;
+
+/*
+ * Sequence lock, for small data that is read much more often than written.
+ *
+ * Readers never write to the lock, so they do not bounce its cache line
+ * between cpus, but retry if a writer updated the data while they copied it.
+ * The data must therefore be copied out and only used once
+ * seqlock_read_retry() returns false, and must not contain pointers that a
+ * writer may free.
+ *
+ *     do {
+ *         seq = seqlock_read_begin(&lock);
+ *         copy = data;
+ *     } while (seqlock_read_retry(&lock, seq));
+ *
+ * Writers are serialized by a spin lock, taken with interrupts disabled so
+ * a reader never waits for a preempted writer. Both sides may be used from
+ * interrupt context, but a reader must not interrupt a writer on its own cpu.
+ */
+typedef struct seqlock {
+    uint32_t seq; /* odd while a writer updates the data */
+    spin_lock_t lock;
+} seqlock_t;
+
+#define SEQLOCK_INITIAL_VALUE(sl) \
+{ \
+    .seq = 0, \
+    .lock = SPIN_LOCK_INITIAL_VALUE, \
+}
+
+static inline void seqlock_init(seqlock_t *sl)
+{
+    *sl = (seqlock_t)SEQLOCK_INITIAL_VALUE(*sl);
+}
+
+static inline uint32_t seqlock_read_begin(const seqlock_t *sl)
+{
+    uint32_t seq;
+
+    while ((seq = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE)) & 1)
+        ;
+    return seq;
+}
+
+/* returns true if the data read since seqlock_read_begin() must be read again */
+static inline bool seqlock_read_retry(const seqlock_t *sl, uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&sl->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static inline void seqlock_write_begin(seqlock_t *sl,
+                                       spin_lock_saved_state_t *statep)
+{
+    spin_lock_irqsave(&sl->lock, *statep);
+    __atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqlock_write_end(seqlock_t *sl,
+                                     spin_lock_saved_state_t state)
+{
+    __atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELEASE);
+    spin_unlock_irqrestore(&sl->lock, state);
+}
+
+__END_CDECLS;
@@ -30,8 +30,10 @@
 #include <arch/defines.h>
 #include <arch/ops.h>
 #include <arch/thread.h>
+#include <kernel/percpu.h>
 #include <kernel/wait.h>
 #include <kernel/spinlock.h>
+#include <kernel/timer.h>
 #include <stdatomic.h>
 #include <debug.h>
 
@@ -59,6 +61,30 @@ enum thread_state {
 
 typedef int (*thread_start_routine)(void *arg);
 
+/* set of cpus, bit n for cpu n */
+typedef uint32_t mp_cpu_mask_t;
+
+#define MP_CPU_MASK_ALL (UINT32_MAX)
+
+#if THREAD_STATS
+#define THREAD_HIST_BUCKETS 16
+
+/*
+ * log2 histogram of durations. Bucket 0 counts everything below 2^11 ns, bucket
+ * n > 0 counts [2^(n+10), 2^(n+11)) ns and the last bucket everything above.
+ */
+struct thread_hist {
+    uint32_t count[THREAD_HIST_BUCKETS];
+    lk_time_ns_t max;
+};
+
+struct thread_sched_hist {
+    struct thread_hist wakeup_latency; /* woken until running */
+    struct thread_hist run_slice; /* running until switched out */
+    struct thread_hist runnable_wait; /* ready until running, woken or preempted */
+};
+#endif
+
 /* thread local storage */
 enum thread_tls_list {
 #ifdef WITH_LIB_TRUSTY
@@ -81,9 +107,41 @@ enum thread_tls_list {
 #define THREAD_FLAG_DEBUG_STACK_BOUNDS_CHECK  (1U<<5)
 #define THREAD_FLAG_EXIT_ON_PANIC             (1U<<6)
 #define THREAD_FLAG_FREE_SHADOW_STACK         (1U<<7)
+#define THREAD_FLAG_DEADLINE                  (1U<<8)
 
 #define THREAD_MAGIC (0x74687264) // 'thrd'
 
+/*
+ * Earliest deadline first parameters and state of a thread, see
+ * thread_set_deadline(). Protected by the thread lock.
+ */
+struct thread_deadline {
+    lk_time_ns_t runtime; /* budget per period */
+    lk_time_ns_t deadline; /* relative to the start of each period */
+    lk_time_ns_t period;
+    uint32_t bw; /* runtime / deadline, reserved on cpu */
+    int cpu; /* cpu the thread was admitted on */
+
+    lk_time_ns_t abs_deadline; /* deadline of the current period */
+    lk_time_ns_t budget; /* runtime left in the current period */
+    lk_time_ns_t start; /* when it last started running or was charged */
+    bool throttled; /* out of budget until the next period starts */
+    timer_t replenish_timer;
+};
+
+/*
+ * Cpu quota of a thread, see thread_set_cpu_quota(). Protected by the thread
+ * lock.
+ */
+struct thread_quota {
+    lk_time_ns_t runtime; /* cpu time per period, 0 if unlimited */
+    lk_time_ns_t period;
+    lk_time_ns_t period_end; /* end of the current period */
+    lk_time_ns_t used; /* cpu time used in the current period */
+    lk_time_ns_t start; /* when it last started running or was charged */
+    bool throttled; /* parked until period_end */
+};
+
 typedef struct thread {
     /* stack stuff, don't move, used by assembly code to validate stack */
     void *stack;
@@ -100,12 +158,16 @@ typedef struct thread {
     /* active bits */
     struct list_node queue_node;
     int priority;
+    int base_priority; /* priority before inheritance from mutex waiters */
     enum thread_state state;
     int remaining_quantum;
     unsigned int flags;
 #if WITH_SMP
     int curr_cpu;
     int pinned_cpu; /* only run on pinned_cpu if >= 0 */
+    mp_cpu_mask_t cpu_affinity; /* cpus it may run on if not pinned */
+    int last_cpu; /* cpu it last ran on, -1 if it never ran */
+    int rq_cpu; /* cpu whose run queue holds the thread while ready */
 #endif
 #if WITH_KERNEL_VM
     vmm_aspace_t *aspace;
@@ -114,6 +176,25 @@ typedef struct thread {
     /* if blocked, a pointer to the wait queue */
     struct wait_queue *blocking_wait_queue;
     status_t wait_queue_block_ret;
+    timer_t wait_timer; /* timeout of the current wait queue block */
+
+    /* priority inheritance, protected by the thread lock */
+    struct mutex *blocking_mutex; /* mutex this thread is blocked on */
+    struct list_node pi_mutexes; /* held mutexes with waiters */
+
+    /* earliest deadline first class, if THREAD_FLAG_DEADLINE is set */
+    struct thread_deadline dl;
+
+    /* cpu time limit, if runtime is not 0 */
+    struct thread_quota quota;
+
+#if THREAD_STATS
+    /* scheduler statistics, protected by the thread lock */
+    lk_time_ns_t stats_ready_time; /* when it last became ready, 0 if not ready */
+    lk_time_ns_t stats_run_time; /* when it last started running */
+    bool stats_woken; /* became ready by being woken rather than preempted */
+    struct thread_sched_hist sched_hist;
+#endif
 
     /* architecture stuff */
     struct arch_thread arch;
@@ -135,13 +216,18 @@ typedef struct thread {
 #if WITH_SMP
 #define thread_curr_cpu(t) ((t)->curr_cpu)
 #define thread_pinned_cpu(t) ((t)->pinned_cpu)
+#define thread_cpu_affinity(t) ((t)->cpu_affinity)
 #define thread_set_curr_cpu(t,c) ((t)->curr_cpu = (c))
 #else
 #define thread_curr_cpu(t) (0)
 #define thread_pinned_cpu(t) (-1)
+#define thread_cpu_affinity(t) (MP_CPU_MASK_ALL)
 #define thread_set_curr_cpu(t,c) do {} while(0)
 #endif
 
+/* longest period accepted by thread_set_deadline() */
+#define THREAD_DEADLINE_MAX_PERIOD (1000ULL * 1000 * 1000)
+
 /* thread priority */
 #define NUM_PRIORITIES 32
 #define LOWEST_PRIORITY 0
@@ -187,6 +273,17 @@ void thread_set_name(const char *name);
  */
 void thread_set_priority(int priority);
 
+/**
+ * thread_set_effective_priority() - change the priority a thread runs at
+ * @t:        Thread to update.
+ * @priority: New priority.
+ *
+ * Used for priority inheritance: the base priority set by
+ * thread_set_priority() is left alone. Moves @t within the run queues if it
+ * is ready. Must be called with the thread lock held.
+ */
+void thread_set_effective_priority(thread_t *t, int priority);
+
 /**
  * thread_set_pinned_cpu() - Pin thread to a given CPU.
  * @t:             Thread to pin
@@ -197,6 +294,21 @@ void thread_set_priority(int priority);
  */
 void thread_set_pinned_cpu(thread_t* t, int cpu);
 
+/**
+ * thread_set_cpu_affinity() - Restrict a thread to a set of CPUs.
+ * @t:             Thread to restrict
+ * @mask:          cpus the thread may run on, %MP_CPU_MASK_ALL for any.
+ *                 Must contain at least one cpu.
+ *
+ * The scheduler balances the thread among the cpus in @mask. A cpu set with
+ * thread_set_pinned_cpu() takes precedence over the mask until the thread
+ * is unpinned.
+ *
+ * Context:        This function shall be invoked without
+ *                 holding the thread lock.
+ */
+void thread_set_cpu_affinity(thread_t *t, mp_cpu_mask_t mask);
+
 thread_t *thread_create(const char *name, thread_start_routine entry, void *arg, int priority, size_t stack_size);
 thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine entry, void *arg, int priority, void *stack, size_t stack_size, size_t shadow_stack_size);
 status_t thread_resume(thread_t *);
@@ -211,13 +323,65 @@ status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout);
 status_t thread_detach_and_resume(thread_t *t);
 status_t thread_set_real_time(thread_t *t);
 
+/**
+ * thread_set_deadline() - Move a thread to the earliest deadline first class.
+ * @t:        Thread to update. Must be the current thread or a thread that
+ *            was not resumed yet.
+ * @runtime:  Cpu time the thread may use in each period, 0 to move the thread
+ *            back to normal priority scheduling.
+ * @deadline: Time from the start of each period by which @runtime must have
+ *            been provided.
+ * @period:   Time between the starts of two periods, at most
+ *            %THREAD_DEADLINE_MAX_PERIOD.
+ *
+ * A ready deadline thread runs ahead of all priority scheduled threads on its
+ * cpu, earliest absolute deadline first. A thread that uses up @runtime
+ * within a period is throttled until the next period starts.
+ *
+ * The thread is bound to one of the cpus it may run on, and @runtime /
+ * @deadline of that cpu is reserved for it. Affinity and pinning changes are
+ * ignored while the thread is in the class.
+ *
+ * Context:   This function shall be invoked without holding the thread lock.
+ *
+ * Return: %NO_ERROR on success, %ERR_INVALID_ARGS if the parameters are
+ * inconsistent, %ERR_BAD_STATE if @t is running on another cpu or blocked and
+ * %ERR_NO_RESOURCES if none of its cpus has enough bandwidth left.
+ */
+status_t thread_set_deadline(thread_t *t, lk_time_ns_t runtime,
+                             lk_time_ns_t deadline, lk_time_ns_t period);
+
+/**
+ * thread_set_cpu_quota() - Limit the cpu time a thread gets.
+ * @t:       Thread to limit.
+ * @runtime: Cpu time @t may use in each period, 0 to remove the limit.
+ * @period:  Length of a period.
+ *
+ * A thread that used up @runtime in the current period is parked until the
+ * period ends, whatever its priority, so lower priority threads get to run.
+ * Usage is checked from the scheduler tick, so a thread may overrun its
+ * quota by up to a tick. Threads in the earliest deadline first class are
+ * limited by their own runtime instead.
+ *
+ * Context:  This function shall be invoked without holding the thread lock.
+ *
+ * Return: %NO_ERROR on success, %ERR_INVALID_ARGS if @runtime is larger than
+ * @period.
+ */
+status_t thread_set_cpu_quota(thread_t *t, lk_time_ns_t runtime,
+                              lk_time_ns_t period);
+
 void dump_thread(thread_t *t);
 void arch_dump_thread(thread_t *t);
 void dump_all_threads(void);
+#if THREAD_STATS
+void dump_all_threads_sched_hist(void);
+#endif
 
 /* scheduler routines */
 void thread_yield(void); /* give up the cpu voluntarily */
 void thread_preempt(void); /* get preempted (inserted into head of run queue) */
+void thread_preempt_lock_held(void); /* same, with the thread lock already held */
 void thread_block(void); /* block on something and reschedule */
 void thread_unblock(thread_t *t, bool resched); /* go back in the run queue */
 
@@ -249,6 +413,16 @@ static inline void thread_unlock_prepare(void) {
                           memory_order_relaxed);
 }
 
+#if WITH_SMP
+/*
+ * Send the reschedule ipis mp_reschedule() queued while the thread lock was
+ * held. Called with interrupts disabled, right after releasing the lock.
+ */
+void mp_reschedule_flush(void);
+#else
+static inline void mp_reschedule_flush(void) {}
+#endif
+
 #define THREAD_LOCK(state) \
     spin_lock_saved_state_t state; \
     spin_lock_irqsave(&thread_lock, state); \
@@ -256,7 +430,9 @@ static inline void thread_unlock_prepare(void) {
 
 #define THREAD_UNLOCK(state) \
     thread_unlock_prepare(); \
-    spin_unlock_irqrestore(&thread_lock, state)
+    spin_unlock(&thread_lock); \
+    mp_reschedule_flush(); \
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS)
 
 static inline void thread_lock_ints_disabled(void) {
     DEBUG_ASSERT(arch_ints_disabled());
@@ -267,6 +443,7 @@ static inline void thread_lock_ints_disabled(void) {
 static inline void thread_unlock_ints_disabled(void) {
     thread_unlock_prepare();
     spin_unlock(&thread_lock);
+    mp_reschedule_flush();
 }
 
 static inline bool thread_lock_held(void)
@@ -357,19 +534,36 @@ struct thread_stats {
     ulong interrupts; /* platform code increment this */
     ulong timer_ints; /* timer code increment this */
     ulong timers; /* timer code increment this */
+    ulong mutex_spin_acquires; /* mutex code increment this */
+    ulong mutex_blocks; /* mutex code increment this */
+    ulong deadline_throttles; /* deadline threads that used up their budget */
+    ulong quota_throttles; /* threads parked after using up their cpu quota */
 
 #if WITH_SMP
     ulong reschedule_ipis;
+    ulong reschedule_ipis_sent; /* reschedule ipis sent to other cpus */
+    ulong reschedule_ipis_suppressed; /* not sent, target had one pending */
+    ulong steals; /* ready threads taken from another cpu's run queue */
+    ulong migrations; /* threads switched to that last ran on another cpu */
+    ulong cluster_migrations; /* same, when that cpu is in another cluster */
+    ulong balance_runs; /* load balancer runs */
+    ulong balance_moves; /* ready threads pushed to a less loaded cpu */
 #endif
+
+    struct thread_sched_hist sched_hist; /* of threads switched to on this cpu */
 };
 
-extern struct thread_stats thread_stats[SMP_MAX_CPUS];
+DECLARE_PER_CPU(struct thread_stats, thread_stats);
+
+void thread_sched_hist_dump(const struct thread_sched_hist *hist);
 
-#define THREAD_STATS_INC(name) do { thread_stats[arch_curr_cpu_num()].name++; } while(0)
+#define THREAD_STATS_INC(name) do { this_cpu(thread_stats).name++; } while(0)
+#define THREAD_STATS_ADD(name, val) do { this_cpu(thread_stats).name += (val); } while(0)
 
 #else
 
 #define THREAD_STATS_INC(name) do { } while (0)
+#define THREAD_STATS_ADD(name, val) do { } while (0)
 
 #endif
 
@@ -24,7 +24,7 @@
 #define __KERNEL_TIMER_H
 
 #include <compiler.h>
-#include <list.h>
+#include <lib/binary_search_tree.h>
 #include <sys/types.h>
 
 __BEGIN_CDECLS;
@@ -41,9 +41,10 @@ typedef struct timer {
     int magic;
     uint cpu;
     bool running;
-    struct list_node node;
+    struct bst_node node; /* in the per-cpu queue, sorted by scheduled_time */
 
     lk_time_ns_t scheduled_time;
+    lk_time_ns_t slack; /* how late the callback may run */
     lk_time_ns_t periodic_time;
 
     timer_callback callback;
@@ -55,8 +56,9 @@ typedef struct timer {
     .magic = TIMER_MAGIC, \
     .cpu = ~0U, \
     .running = false, \
-    .node = LIST_INITIAL_CLEARED_VALUE, \
+    .node = BST_NODE_INITIAL_VALUE, \
     .scheduled_time = 0, \
+    .slack = 0, \
     .periodic_time = 0, \
     .callback = NULL, \
     .arg = NULL, \
@@ -70,11 +72,15 @@ typedef struct timer {
  *   timer_cancel_sync instead of timer_cancel to make sure the timer callback
  *   is not still running when the call returns.
  * - Timers may be canceled or reprogrammed from within their callback
+ * - Oneshot timers may be given slack, allowing them to run late so they can
+ *   share an interrupt with other timers
  * - Timers currently are dispatched from a 10ms periodic tick
 */
 void timer_initialize(timer_t *);
 void timer_set_oneshot_ns(timer_t *, lk_time_ns_t delay, timer_callback,
                           void *arg);
+void timer_set_oneshot_ns_slack(timer_t *, lk_time_ns_t delay,
+                                lk_time_ns_t slack, timer_callback, void *arg);
 void timer_set_periodic_ns(timer_t *, lk_time_ns_t period, timer_callback,
                            void *arg);
 
@@ -85,6 +91,16 @@ void timer_set_periodic_ns(timer_t *, lk_time_ns_t period, timer_callback,
  */
 void timer_cancel_etc(timer_t *timer, bool wait);
 
+/**
+ * timer_try_cancel - Cancel timer unless its callback is running
+ * @timer:  Timer to cancel.
+ *
+ * Can be called from any cpu, with interrupts disabled. Returns %false, and
+ * leaves the timer alone, if its callback is running. Otherwise the callback
+ * will not run once this call returns.
+ */
+bool timer_try_cancel(timer_t *timer);
+
 /**
  * timer_cancel - Cancel timer without waiting for callback to finish
  * @timer:  Timer to cancel.
@@ -29,23 +29,36 @@
 #include <arch/defines.h>
 #include <arch/ops.h>
 #include <arch/thread.h>
+#include <kernel/spinlock.h>
 
 __BEGIN_CDECLS;
 
 /* wait queue stuff */
 #define WAIT_QUEUE_MAGIC (0x77616974) // 'wait'
 
+/*
+ * The list and count are protected by the thread lock. The embedded lock is
+ * not used by the wait queue code itself: objects built on a wait queue
+ * (events, semaphores, mutexes) use it to protect their own state so their
+ * uncontended paths do not need the thread lock. Blocking on or waking a wait
+ * queue still takes the global thread lock, so contended objects serialize
+ * on it even when they are unrelated.
+ *
+ * Lock order: object lock (e.g. wait->lock), then thread lock, then timer lock.
+ */
 typedef struct wait_queue {
     int magic;
     struct list_node list;
     int count;
+    spin_lock_t lock;
 } wait_queue_t;
 
 #define WAIT_QUEUE_INITIAL_VALUE(q) \
 { \
     .magic = WAIT_QUEUE_MAGIC, \
     .list = LIST_INITIAL_VALUE((q).list), \
-    .count = 0 \
+    .count = 0, \
+    .lock = SPIN_LOCK_INITIAL_VALUE, \
 }
 
 /* wait queue primitive */
@@ -75,6 +88,22 @@ status_t wait_queue_block(wait_queue_t *, lk_time_t timeout);
 int wait_queue_wake_one(wait_queue_t *, bool reschedule, status_t wait_queue_error);
 int wait_queue_wake_all(wait_queue_t *, bool reschedule, status_t wait_queue_error);
 
+/*
+ * variants of the above for objects whose state is protected by their own
+ * spinlock rather than by the thread lock. the caller holds @lock and then the
+ * thread lock. @lock is always released, after the current thread has been
+ * queued (block) or the woken threads made ready (wake), and before the
+ * current thread is switched out. the thread lock is still held on return.
+ *
+ * since threads only join a wait queue with the object lock held, a waker
+ * holding just the object lock that sees wait->count == 0 knows there is
+ * nobody to wake and can skip the thread lock entirely.
+ */
+status_t wait_queue_block_unlock(wait_queue_t *, lk_time_t timeout, spin_lock_t *lock);
+int wait_queue_wake_one_unlock(wait_queue_t *, bool reschedule, status_t wait_queue_error, spin_lock_t *lock);
+int wait_queue_wake_all_unlock(wait_queue_t *, bool reschedule, status_t wait_queue_error, spin_lock_t *lock);
+void wait_queue_destroy_unlock(wait_queue_t *, bool reschedule, spin_lock_t *lock);
+
 /*
  * remove the thread from whatever wait queue it's in.
  * return an error if the thread is not currently blocked (or is the current thread)
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2026 Google Inc. All rights reserved
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS;
+
+struct mutex;
+
+/*
+ * Wait on address.
+ *
+ * Lets a synchronization object built from atomic operations on a 32 bit
+ * word sleep only when it is contended, without embedding a wait queue.
+ * Waiters are kept in a hash table of queues keyed by the address of the word,
+ * so any word can be waited on and an object needs no initialization or
+ * destruction beyond its own state.
+ *
+ * wait_on_address() blocks only if the word still holds the value the caller
+ * expects when the thread is queued, and wake_address() takes the same queue
+ * lock, so a waker that changes the word before calling wake_address() never
+ * misses a waiter that saw the old value.
+ *
+ * requeue_address() moves waiters to a mutex's wait queue instead of waking
+ * them, so an object that wakes threads only to have them take a mutex, like
+ * a condition variable, does not wake them all at once to fight over it.
+ *
+ * These functions are only safe to use from thread context.
+ */
+
+/* returned by wait_on_address() to a thread moved by requeue_address() */
+#define WAIT_ADDRESS_REQUEUED (1)
+
+/**
+ * wait_on_address() - Block until woken if *@addr == @expected.
+ * @addr:     Word to wait on.
+ * @expected: Value *@addr must hold for the thread to block.
+ * @timeout:  Maximum time to wait in ms, or INFINITE_TIME.
+ *
+ * Return: %NO_ERROR if woken by wake_address(), %WAIT_ADDRESS_REQUEUED if
+ * moved to a mutex by requeue_address(), %ERR_BAD_STATE if *@addr did not hold
+ * @expected, or %ERR_TIMED_OUT. Like any wait, a %NO_ERROR return does not
+ * guarantee that *@addr changed, callers must check it again.
+ */
+status_t wait_on_address(volatile uint32_t *addr, uint32_t expected,
+                         lk_time_t timeout);
+
+/**
+ * wake_address() - Wake threads waiting on an address.
+ * @addr:  Word passed to wait_on_address() by the threads to wake.
+ * @count: Maximum number of threads to wake, in the order they started
+ *         waiting. UINT32_MAX wakes them all.
+ *
+ * The woken threads are made ready, the caller is not rescheduled.
+ *
+ * Return: the number of threads woken.
+ */
+int wake_address(volatile uint32_t *addr, uint32_t count);
+
+/**
+ * requeue_address() - Move threads waiting on an address to a mutex.
+ * @addr:  Word passed to wait_on_address() by the threads to move.
+ * @m:     Mutex to move them to.
+ * @count: Maximum number of threads to move, in the order they started
+ *         waiting. UINT32_MAX moves them all.
+ *
+ * The moved threads block on @m as if they had called mutex_acquire(). Their
+ * wait_on_address() returns %WAIT_ADDRESS_REQUEUED once the mutex wakes them,
+ * or their wait times out, and they must then call mutex_acquire_requeued().
+ *
+ * Return: the number of threads moved.
+ */
+int requeue_address(volatile uint32_t *addr, struct mutex *m, uint32_t count);
+
+void wait_address_init(void);
+
+__END_CDECLS;
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2026 Google Inc. All rights reserved
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief  Condition variable functions
+ *
+ * @defgroup cond Condition variable
+ *
+ * A waiter reads seq, releases the mutex and sleeps in wait_on_address() only
+ * if seq has not changed since, so a signal sent between the release and the
+ * block is not lost. The wait queues live in the wait on address hash table,
+ * so a cond_t carries no wait queue of its own.
+ *
+ * Signal and broadcast do not wake waiters. They move them to the mutex's
+ * wait queue with requeue_address(), where they wait for the mutex to be
+ * released like any thread blocked in mutex_acquire(). A broadcast therefore
+ * wakes one waiter per release of the mutex, rather than all of them at once
+ * to fight over it.
+ *
+ * A signal finds the mutex to requeue to in the cond_t. Waiters store it
+ * before reading seq and signals bump seq before loading it, with a full
+ * barrier in between on both sides, so a signal that a waiter did not see
+ * when reading seq always sees the waiter's mutex.
+ *
+ * @{
+ */
+
+#include <kernel/cond.h>
+#include <debug.h>
+#include <assert.h>
+#include <err.h>
+#include <kernel/thread.h>
+#include <kernel/wait_address.h>
+
+/**
+ * @brief  Initialize a cond_t
+ */
+void cond_init(cond_t *c)
+{
+    *c = (cond_t)COND_INITIAL_VALUE(*c);
+}
+
+/**
+ * @brief  Destroy a cond_t
+ *
+ * Threads still waiting are woken and return NO_ERROR, with their mutex held.
+ */
+void cond_destroy(cond_t *c)
+{
+    DEBUG_ASSERT(c->magic == COND_MAGIC);
+
+    c->magic = 0;
+    __atomic_add_fetch(&c->seq, 1, __ATOMIC_SEQ_CST);
+    wake_address(&c->seq, UINT32_MAX);
+}
+
+/**
+ * @brief  Wait for a condition variable to be signaled
+ *
+ * Releases @m, which the caller must hold, waits up to @timeout ms for @c to
+ * be signaled, and acquires @m again. The mutex is held on return, whether or
+ * not the wait timed out.
+ *
+ * @return  NO_ERROR if signaled, ERR_TIMED_OUT on timeout, other values on
+ * error.
+ */
+status_t cond_wait_timeout(cond_t *c, mutex_t *m, lk_time_t timeout)
+{
+    uint32_t seq;
+    status_t ret;
+
+    DEBUG_ASSERT(c->magic == COND_MAGIC);
+    DEBUG_ASSERT(is_mutex_held(m));
+
+    __atomic_store_n(&c->mutex, m, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+
+    mutex_release(m);
+
+    ret = wait_on_address(&c->seq, seq, timeout);
+    if (ret == WAIT_ADDRESS_REQUEUED) {
+        /* signaled, even if we timed out waiting for the mutex */
+        status_t err = mutex_acquire_requeued(m);
+        return err < NO_ERROR ? err : NO_ERROR;
+    }
+
+    mutex_acquire(m);
+
+    /* ERR_BAD_STATE: signaled since we released the mutex */
+    return ret == ERR_BAD_STATE ? NO_ERROR : ret;
+}
+
+static void cond_wake(cond_t *c, uint32_t count)
+{
+    mutex_t *m;
+
+    DEBUG_ASSERT(c->magic == COND_MAGIC);
+
+    __atomic_add_fetch(&c->seq, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    m = __atomic_load_n(&c->mutex, __ATOMIC_RELAXED);
+
+    /* no mutex, nobody has ever waited */
+    if (m)
+        requeue_address(&c->seq, m, count);
+}
+
+/**
+ * @brief  Signal a condition variable
+ *
+ * Moves the longest waiting thread, if any, to the wait queue of its mutex.
+ */
+void cond_signal(cond_t *c)
+{
+    cond_wake(c, 1);
+}
+
+/**
+ * @brief  Signal a condition variable to all waiters
+ *
+ * Moves all waiting threads to the wait queue of their mutex.
+ */
+void cond_broadcast(cond_t *c)
+{
+    cond_wake(c, UINT32_MAX);
+}
+
+/* @} */
@@ -39,6 +39,7 @@
 #include <kernel/mp.h>
 #include <err.h>
 #include <platform.h>
+#include <string.h>
 
 #if WITH_LIB_CONSOLE
 #include <lib/console.h>
@@ -46,6 +47,7 @@
 static int cmd_threads(int argc, const cmd_args *argv);
 static int cmd_threadstats(int argc, const cmd_args *argv);
 static int cmd_threadload(int argc, const cmd_args *argv);
+static int cmd_schedhist(int argc, const cmd_args *argv);
 static int cmd_kevlog(int argc, const cmd_args *argv);
 
 STATIC_COMMAND_START
@@ -55,6 +57,7 @@ STATIC_COMMAND_MASKED("threads", "list kernel threads", &cmd_threads, CMD_AVAIL_
 #if THREAD_STATS
 STATIC_COMMAND("threadstats", "thread level statistics", &cmd_threadstats)
 STATIC_COMMAND("threadload", "toggle thread load display", &cmd_threadload)
+STATIC_COMMAND("schedhist", "scheduler latency histograms", &cmd_schedhist)
 #endif
 #if WITH_KERNEL_EVLOG
 STATIC_COMMAND_MASKED("kevlog", "dump kernel event log", &cmd_kevlog, CMD_AVAIL_ALWAYS)
@@ -78,19 +81,77 @@ static int cmd_threadstats(int argc, const cmd_args *argv)
         if (!mp_is_cpu_active(i))
             continue;
 
+        struct thread_stats *stats = &per_cpu(thread_stats, i);
+
         printf("thread stats (cpu %d):\n", i);
-        printf("\ttotal idle time: %lld\n", thread_stats[i].idle_time);
-        printf("\ttotal busy time: %lld\n", current_time_ns() - thread_stats[i].idle_time);
-        printf("\treschedules: %lu\n", thread_stats[i].reschedules);
+        printf("\ttotal idle time: %lld\n", stats->idle_time);
+        printf("\ttotal busy time: %lld\n", current_time_ns() - stats->idle_time);
+        printf("\treschedules: %lu\n", stats->reschedules);
 #if WITH_SMP
-        printf("\treschedule_ipis: %lu\n", thread_stats[i].reschedule_ipis);
+        printf("\treschedule_ipis: %lu\n", stats->reschedule_ipis);
+        printf("\treschedule_ipis sent: %lu\n", stats->reschedule_ipis_sent);
+        printf("\treschedule_ipis suppressed: %lu\n", stats->reschedule_ipis_suppressed);
+        printf("\tsteals: %lu\n", stats->steals);
+        printf("\tmigrations: %lu\n", stats->migrations);
+        printf("\tcluster migrations: %lu\n", stats->cluster_migrations);
+        printf("\tbalance runs: %lu\n", stats->balance_runs);
+        printf("\tbalance moves: %lu\n", stats->balance_moves);
 #endif
-        printf("\tcontext_switches: %lu\n", thread_stats[i].context_switches);
-        printf("\tpreempts: %lu\n", thread_stats[i].preempts);
-        printf("\tyields: %lu\n", thread_stats[i].yields);
-        printf("\tinterrupts: %lu\n", thread_stats[i].interrupts);
-        printf("\ttimer interrupts: %lu\n", thread_stats[i].timer_ints);
-        printf("\ttimers: %lu\n", thread_stats[i].timers);
+        printf("\tcontext_switches: %lu\n", stats->context_switches);
+        printf("\tpreempts: %lu\n", stats->preempts);
+        printf("\tyields: %lu\n", stats->yields);
+        printf("\tinterrupts: %lu\n", stats->interrupts);
+        printf("\ttimer interrupts: %lu\n", stats->timer_ints);
+        printf("\ttimers: %lu\n", stats->timers);
+        printf("\tmutex spin acquires: %lu\n", stats->mutex_spin_acquires);
+        printf("\tmutex blocks: %lu\n", stats->mutex_blocks);
+        printf("\tdeadline throttles: %lu\n", stats->deadline_throttles);
+        printf("\tquota throttles: %lu\n", stats->quota_throttles);
+    }
+
+    return 0;
+}
+
+static void thread_hist_dump(const char *name, const struct thread_hist *hist)
+{
+    uint64_t total = 0;
+
+    for (uint i = 0; i < THREAD_HIST_BUCKETS; i++)
+        total += hist->count[i];
+
+    printf("\t%s: count %llu, max %llu ns\n", name, total, hist->max);
+    for (uint i = 0; i < THREAD_HIST_BUCKETS; i++) {
+        if (!hist->count[i])
+            continue;
+        printf("\t\t>= %8llu ns: %u\n", i ? 1ULL << (i + 10) : 0ULL,
+               hist->count[i]);
+    }
+}
+
+void thread_sched_hist_dump(const struct thread_sched_hist *hist)
+{
+    thread_hist_dump("wakeup latency", &hist->wakeup_latency);
+    thread_hist_dump("runnable wait", &hist->runnable_wait);
+    thread_hist_dump("run slice", &hist->run_slice);
+}
+
+static int cmd_schedhist(int argc, const cmd_args *argv)
+{
+    if (argc > 1 && !strcmp(argv[1].str, "threads")) {
+        dump_all_threads_sched_hist();
+        return 0;
+    }
+    if (argc > 1) {
+        printf("usage: %s [threads]\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!mp_is_cpu_active(i))
+            continue;
+
+        printf("scheduler histograms (cpu %d):\n", i);
+        thread_sched_hist_dump(&per_cpu(thread_stats, i).sched_hist);
     }
 
     return 0;
@@ -106,12 +167,13 @@ static enum handler_return threadload(struct timer *t, lk_time_t now, void *arg)
         if (!mp_is_cpu_active(i))
             continue;
 
-        lk_time_ns_t idle_time = thread_stats[i].idle_time;
+        struct thread_stats *stats = &per_cpu(thread_stats, i);
+        lk_time_ns_t idle_time = stats->idle_time;
 
         /* if the cpu is currently idle, add the time since it went idle up until now to the idle counter */
         bool is_idle = !!mp_is_cpu_idle(i);
         if (is_idle) {
-            idle_time += current_time_ns() - thread_stats[i].last_idle_timestamp;
+            idle_time += current_time_ns() - stats->last_idle_timestamp;
         }
 
         lk_time_ns_t delta_time = idle_time - last_idle_time[i];
@@ -130,16 +192,16 @@ static enum handler_return threadload(struct timer *t, lk_time_t now, void *arg)
                "tmrs %lu\n",
                i,
                busypercent / 100, busypercent % 100,
-               thread_stats[i].context_switches - old_stats[i].context_switches,
-               thread_stats[i].preempts - old_stats[i].preempts,
+               stats->context_switches - old_stats[i].context_switches,
+               stats->preempts - old_stats[i].preempts,
 #if WITH_SMP
-               thread_stats[i].reschedule_ipis - old_stats[i].reschedule_ipis,
+               stats->reschedule_ipis - old_stats[i].reschedule_ipis,
 #endif
-               thread_stats[i].interrupts - old_stats[i].interrupts,
-               thread_stats[i].timer_ints - old_stats[i].timer_ints,
-               thread_stats[i].timers - old_stats[i].timers);
+               stats->interrupts - old_stats[i].interrupts,
+               stats->timer_ints - old_stats[i].timer_ints,
+               stats->timers - old_stats[i].timers);
 
-        old_stats[i] = thread_stats[i];
+        old_stats[i] = *stats;
         last_idle_time[i] = idle_time;
     }
 
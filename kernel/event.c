@@ -37,6 +37,21 @@
  * to continue immediately until the signal is manually cleared with
  * event_unsignal().
  *
+ * The event state is protected by the lock embedded in its wait queue. The
+ * thread lock is only taken, nested inside it, when a thread has to block or
+ * there are waiters to wake.
+ *
+ * A thread in event_wait_any() cannot be on the wait queues of all its
+ * events, so it links a struct event_any_node onto the any_waiters list of
+ * each event instead, and blocks on a private wait queue in the shared
+ * struct event_any_wait. The first event to claim the event_any_wait, by
+ * setting its index under the lock of its wait queue, wakes the thread.
+ * Events signaled after that leave it alone, so an autounsignal event is
+ * only consumed by the thread if it is the one that woke it.
+ *
+ * Lock order: event wait.lock, then event_any_wait wait.lock, then the thread
+ * lock.
+ *
  * @{
  */
 
@@ -46,6 +61,67 @@
 #include <err.h>
 #include <kernel/thread.h>
 
+/* on the stack of a thread in event_wait_any() */
+struct event_any_wait {
+    wait_queue_t wait; /* its lock protects index and status */
+    int index; /* of the event that claimed the wait, or -1 */
+    status_t status;
+};
+
+/* links an event_any_wait to one of its events */
+struct event_any_node {
+    struct list_node node;
+    struct event_any_wait *any;
+    uint index;
+};
+
+/*
+ * Claim @node's wait for its event and wake the waiting thread, unless
+ * another event claimed it first. Called with the event's lock held.
+ */
+static bool event_any_claim(struct event_any_node *node, status_t status)
+{
+    struct event_any_wait *any = node->any;
+    bool claimed = false;
+
+    spin_lock(&any->wait.lock);
+    if (any->index < 0) {
+        any->index = node->index;
+        any->status = status;
+        claimed = true;
+        /* the thread may still be registering with its other events */
+        if (any->wait.count) {
+            thread_lock_ints_disabled();
+            wait_queue_wake_one(&any->wait, false, NO_ERROR);
+            thread_unlock_ints_disabled();
+        }
+    }
+    spin_unlock(&any->wait.lock);
+
+    return claimed;
+}
+
+/*
+ * Wake the event_wait_any() callers waiting on @e, or only the first one not
+ * already claimed by another event if @all is false. Called with the event's
+ * lock held. Returns true if a caller was woken.
+ */
+static bool event_wake_any_waiters(event_t *e, bool all, status_t status)
+{
+    struct event_any_node *node;
+    bool woken = false;
+
+    list_for_every_entry(&e->any_waiters, node, struct event_any_node, node) {
+        if (event_any_claim(node, status)) {
+            woken = true;
+            if (!all)
+                break;
+        }
+    }
+
+    return woken;
+}
+
 /**
  * @brief  Initialize an event object
  *
@@ -71,14 +147,27 @@ void event_destroy(event_t *e)
 {
     DEBUG_ASSERT(e->magic == EVENT_MAGIC);
 
-    THREAD_LOCK(state);
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&e->wait.lock, state);
 
     e->magic = 0;
     e->signaled = false;
     e->flags = 0;
-    wait_queue_destroy(&e->wait, true);
 
-    THREAD_UNLOCK(state);
+    /*
+     * unlink the event_wait_any() callers before waking them, so they do not
+     * touch the event once it may have been freed
+     */
+    struct event_any_node *node;
+    while ((node = list_remove_head_type(&e->any_waiters,
+                                         struct event_any_node, node)))
+        event_any_claim(node, ERR_OBJECT_DESTROYED);
+
+    thread_lock_ints_disabled();
+    wait_queue_destroy_unlock(&e->wait, true, &e->wait.lock);
+    thread_unlock_ints_disabled();
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 }
 
 /**
@@ -102,7 +191,8 @@ status_t event_wait_timeout(event_t *e, lk_time_t timeout)
 
     DEBUG_ASSERT(e->magic == EVENT_MAGIC);
 
-    THREAD_LOCK(state);
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&e->wait.lock, state);
 
     if (e->signaled) {
         /* signaled, we're going to fall through */
@@ -110,12 +200,101 @@ status_t event_wait_timeout(event_t *e, lk_time_t timeout)
             /* autounsignal flag lets one thread fall through before unsignaling */
             e->signaled = false;
         }
+        spin_unlock_irqrestore(&e->wait.lock, state);
     } else {
         /* unsignaled, block here */
-        ret = wait_queue_block(&e->wait, timeout);
+        thread_lock_ints_disabled();
+        ret = wait_queue_block_unlock(&e->wait, timeout, &e->wait.lock);
+        thread_unlock_ints_disabled();
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+    }
+
+    return ret;
+}
+
+/**
+ * @brief  Wait for any of several events to be signaled
+ *
+ * Returns as soon as one of the events is signaled, which is consumed if it
+ * has EVENT_FLAG_AUTOUNSIGNAL. The other events are left alone. If several
+ * events are already signaled, the first one in @events is picked.
+ *
+ * @param events   Events to wait on, at most EVENT_WAIT_ANY_MAX
+ * @param count    Number of events
+ * @param timeout  Timeout value, in ms
+ * @param index    Set to the index in @events of the signaled event
+ *
+ * @return  0 on success, ERR_TIMED_OUT on timeout,
+ *         other values on other errors.
+ */
+status_t event_wait_any(event_t **events, uint count, lk_time_t timeout,
+                        uint *index)
+{
+    struct event_any_node nodes[EVENT_WAIT_ANY_MAX];
+    struct event_any_wait any;
+    spin_lock_saved_state_t state;
+    status_t ret = NO_ERROR;
+    uint registered;
+
+    if (!events || !count || count > EVENT_WAIT_ANY_MAX || !index)
+        return ERR_INVALID_ARGS;
+
+    wait_queue_init(&any.wait);
+    any.index = -1;
+    any.status = NO_ERROR;
+
+    for (registered = 0; registered < count; registered++) {
+        event_t *e = events[registered];
+        struct event_any_node *node = &nodes[registered];
+
+        DEBUG_ASSERT(e->magic == EVENT_MAGIC);
+
+        node->any = &any;
+        node->index = registered;
+
+        spin_lock_irqsave(&e->wait.lock, state);
+        if (e->signaled) {
+            /* don't consume it if an earlier event already woke us */
+            if (event_any_claim(node, NO_ERROR) &&
+                (e->flags & EVENT_FLAG_AUTOUNSIGNAL))
+                e->signaled = false;
+            spin_unlock_irqrestore(&e->wait.lock, state);
+            break;
+        }
+        list_add_tail(&e->any_waiters, &node->node);
+        spin_unlock_irqrestore(&e->wait.lock, state);
+    }
+
+    spin_lock_irqsave(&any.wait.lock, state);
+    if (any.index < 0) {
+        thread_lock_ints_disabled();
+        ret = wait_queue_block_unlock(&any.wait, timeout, &any.wait.lock);
+        thread_unlock_ints_disabled();
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+    } else {
+        spin_unlock_irqrestore(&any.wait.lock, state);
     }
 
-    THREAD_UNLOCK(state);
+    /*
+     * once off every list, no event can claim the wait anymore. an event
+     * destroyed while we waited already unlinked its node, and may be gone.
+     */
+    for (uint i = 0; i < registered; i++) {
+        event_t *e = events[i];
+
+        if (!list_in_list(&nodes[i].node))
+            continue;
+
+        spin_lock_irqsave(&e->wait.lock, state);
+        list_delete(&nodes[i].node);
+        spin_unlock_irqrestore(&e->wait.lock, state);
+    }
+
+    /* an event may have claimed the wait as we timed out */
+    if (any.index >= 0) {
+        *index = any.index;
+        return any.status;
+    }
 
     return ret;
 }
@@ -141,27 +320,56 @@ status_t event_signal(event_t *e, bool reschedule)
 {
     DEBUG_ASSERT(e->magic == EVENT_MAGIC);
 
-    THREAD_LOCK(state);
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&e->wait.lock, state);
 
-    if (!e->signaled) {
-        if (e->flags & EVENT_FLAG_AUTOUNSIGNAL) {
-            /* try to release one thread and leave unsignaled if successful */
-            if (wait_queue_wake_one(&e->wait, reschedule, NO_ERROR) <= 0) {
-                /*
-                 * if we didn't actually find a thread to wake up, go to
-                 * signaled state and let the next call to event_wait
-                 * unsignal the event.
-                 */
-                e->signaled = true;
-            }
-        } else {
-            /* release all threads and remain signaled */
+    if (e->signaled) {
+        spin_unlock_irqrestore(&e->wait.lock, state);
+        return NO_ERROR;
+    }
+
+    if (!list_is_empty(&e->any_waiters) &&
+        event_wake_any_waiters(e, !(e->flags & EVENT_FLAG_AUTOUNSIGNAL),
+                               NO_ERROR) &&
+        (e->flags & EVENT_FLAG_AUTOUNSIGNAL)) {
+        /* consumed by an event_wait_any() caller */
+        spin_unlock_irqrestore(&e->wait.lock, state);
+        return NO_ERROR;
+    }
+
+    if (!e->wait.count) {
+        /*
+         * nobody is waiting, and nobody can start waiting while we hold the
+         * wait queue lock, so there is no need to take the thread lock.
+         */
+        e->signaled = true;
+        spin_unlock_irqrestore(&e->wait.lock, state);
+        return NO_ERROR;
+    }
+
+    thread_lock_ints_disabled();
+
+    if (e->flags & EVENT_FLAG_AUTOUNSIGNAL) {
+        /*
+         * try to release one thread and leave unsignaled if successful.
+         * the waiters may all have timed out since we looked at the count,
+         * which is only stable now that we hold the thread lock. if there is
+         * no thread to wake up, go to signaled state and let the next call to
+         * event_wait unsignal the event.
+         */
+        if (!e->wait.count)
             e->signaled = true;
-            wait_queue_wake_all(&e->wait, reschedule, NO_ERROR);
-        }
+        wait_queue_wake_one_unlock(&e->wait, reschedule, NO_ERROR,
+                                   &e->wait.lock);
+    } else {
+        /* release all threads and remain signaled */
+        e->signaled = true;
+        wait_queue_wake_all_unlock(&e->wait, reschedule, NO_ERROR,
+                                   &e->wait.lock);
     }
 
-    THREAD_UNLOCK(state);
+    thread_unlock_ints_disabled();
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 
     return NO_ERROR;
 }
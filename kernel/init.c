@@ -27,6 +27,8 @@
 #include <kernel/timer.h>
 #include <kernel/mp.h>
 #include <kernel/port.h>
+#include <kernel/rcu.h>
+#include <kernel/wait_address.h>
 
 void kernel_init(void)
 {
@@ -45,6 +47,14 @@ void kernel_init(void)
     dprintf(SPEW, "initializing timers\n");
     timer_init();
 
+    // initialize rcu
+    dprintf(SPEW, "initializing rcu\n");
+    rcu_init();
+
+    // initialize the wait on address hash table
+    dprintf(SPEW, "initializing wait on address\n");
+    wait_address_init();
+
     // initialize ports
     dprintf(SPEW, "initializing ports\n");
     port_init();
@@ -28,6 +28,7 @@
 #include <assert.h>
 #include <trace.h>
 #include <arch/mp.h>
+#include <err.h>
 #include <kernel/spinlock.h>
 
 #define LOCAL_TRACE 0
@@ -36,10 +37,52 @@
 /* a global state structure, aligned on cpu cache line to minimize aliasing */
 struct mp_state mp __CPU_ALIGN;
 
+/* reschedule ipis queued by each cpu while it holds the thread lock */
+static struct {
+    mp_cpu_mask_t target;
+} __CPU_ALIGN mp_deferred_reschedule[SMP_MAX_CPUS];
+
+/*
+ * Lock free mailbox of function calls for each cpu. Any cpu pushes onto the
+ * stack with a compare and swap, the owner takes the whole stack at once from
+ * its generic ipi handler.
+ */
+static struct {
+    struct mp_call_node *head;
+} __CPU_ALIGN mp_call_mailbox[SMP_MAX_CPUS];
+
 void mp_init(void)
 {
 }
 
+/*
+ * Send reschedule ipis to @target, skipping cpus that still have one pending.
+ * Such a cpu has not entered mp_mbx_reschedule_irq() yet, so the reschedule
+ * that follows will take the thread lock after our caller released it and
+ * see whatever made it send the ipi.
+ */
+static void mp_send_reschedule(mp_cpu_mask_t target)
+{
+    mp_cpu_mask_t pending;
+
+    pending = atomic_or((volatile int *)&mp.reschedule_pending, target);
+
+    THREAD_STATS_ADD(reschedule_ipis_suppressed,
+                     __builtin_popcount(target & pending));
+    target &= ~pending;
+    if (!target)
+        return;
+
+    THREAD_STATS_ADD(reschedule_ipis_sent, __builtin_popcount(target));
+    arch_mp_send_ipi(target, MP_IPI_RESCHEDULE);
+}
+
+/*
+ * Ask the cpus in @target to reschedule. The scheduler calls this with the
+ * thread lock held, possibly several times for the same cpus, e.g. from
+ * wait_queue_wake_all(). Those requests are merged and sent once the lock
+ * is released, see mp_reschedule_flush().
+ */
 void mp_reschedule(mp_cpu_mask_t target, uint flags)
 {
     uint local_cpu = arch_curr_cpu_num();
@@ -57,7 +100,139 @@ void mp_reschedule(mp_cpu_mask_t target, uint flags)
 
     LTRACEF("local %d, post mask target now 0x%x\n", local_cpu, target);
 
-    arch_mp_send_ipi(target, MP_IPI_RESCHEDULE);
+    if (!target)
+        return;
+
+    if (thread_lock_held()) {
+        mp_deferred_reschedule[local_cpu].target |= target;
+        return;
+    }
+
+    mp_send_reschedule(target);
+}
+
+void mp_reschedule_flush(void)
+{
+    DEBUG_ASSERT(arch_ints_disabled());
+
+    uint cpu = arch_curr_cpu_num();
+    mp_cpu_mask_t target = mp_deferred_reschedule[cpu].target;
+
+    if (likely(!target))
+        return;
+
+    LTRACEF("cpu %u, target 0x%x\n", cpu, target);
+
+    mp_deferred_reschedule[cpu].target = 0;
+    mp_send_reschedule(target);
+}
+
+static void mp_call_run(mp_call_t *call)
+{
+    call->func(call->arg);
+
+    /* the caller may reuse @call as soon as this reaches 0 */
+    __atomic_sub_fetch(&call->pending, 1, __ATOMIC_RELEASE);
+}
+
+static void mp_call_mailbox_drain(uint cpu)
+{
+    struct mp_call_node *node;
+    struct mp_call_node *next;
+    struct mp_call_node *fifo = NULL;
+
+    DEBUG_ASSERT(arch_ints_disabled());
+
+    node = __atomic_exchange_n(&mp_call_mailbox[cpu].head, NULL,
+                               __ATOMIC_ACQUIRE);
+
+    /* the mailbox is a stack, run the calls in the order they were posted */
+    while (node) {
+        next = node->next;
+        node->next = fifo;
+        fifo = node;
+        node = next;
+    }
+
+    while (fifo) {
+        next = fifo->next;
+        mp_call_run(fifo->call);
+        fifo = next;
+    }
+}
+
+static void mp_call_post(mp_call_t *call, mp_cpu_mask_t target,
+                         mp_call_func_t func, void *arg)
+{
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    uint local_cpu = arch_curr_cpu_num();
+    mp_cpu_mask_t remote;
+
+    target &= mp.active_cpus;
+    remote = target & ~(1U << local_cpu);
+
+    LTRACEF("local %u, target 0x%x, func %p, arg %p\n", local_cpu, target,
+            func, arg);
+
+    call->func = func;
+    call->arg = arg;
+    call->pending = __builtin_popcount(target);
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct mp_call_node *node = &call->node[cpu];
+        struct mp_call_node *head;
+
+        if (!(remote & (1U << cpu)))
+            continue;
+
+        node->call = call;
+        head = __atomic_load_n(&mp_call_mailbox[cpu].head, __ATOMIC_RELAXED);
+        do {
+            node->next = head;
+        } while (!__atomic_compare_exchange_n(&mp_call_mailbox[cpu].head,
+                                              &head, node, true,
+                                              __ATOMIC_RELEASE,
+                                              __ATOMIC_RELAXED));
+    }
+
+    if (remote)
+        arch_mp_send_ipi(remote, MP_IPI_GENERIC);
+
+    if (target & (1U << local_cpu))
+        mp_call_run(call);
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+void mp_sync_exec(mp_cpu_mask_t target, mp_call_func_t func, void *arg)
+{
+    mp_call_t call;
+
+    DEBUG_ASSERT(!thread_lock_held());
+
+    mp_call_post(&call, target, func, arg);
+
+    while (!mp_call_done(&call)) {
+        /*
+         * Another cpu may be waiting for us to run its call while our own
+         * generic ipi is masked.
+         */
+        if (arch_ints_disabled())
+            mp_call_mailbox_drain(arch_curr_cpu_num());
+    }
+}
+
+status_t mp_async_exec(mp_call_t *call, mp_cpu_mask_t target,
+                       mp_call_func_t func, void *arg)
+{
+    if (!mp_call_done(call))
+        return ERR_BUSY;
+
+    mp_call_post(call, target, func, arg);
+
+    return NO_ERROR;
 }
 
 void mp_set_curr_cpu_active(bool active)
@@ -65,6 +240,17 @@ void mp_set_curr_cpu_active(bool active)
     atomic_or((volatile int *)&mp.active_cpus, 1U << arch_curr_cpu_num());
 }
 
+enum handler_return mp_mbx_generic_irq(void)
+{
+    uint cpu = arch_curr_cpu_num();
+
+    LTRACEF("cpu %u\n", cpu);
+
+    mp_call_mailbox_drain(cpu);
+
+    return INT_NO_RESCHEDULE;
+}
+
 enum handler_return mp_mbx_reschedule_irq(void)
 {
     uint cpu = arch_curr_cpu_num();
@@ -73,6 +259,9 @@ enum handler_return mp_mbx_reschedule_irq(void)
 
     THREAD_STATS_INC(reschedule_ipis);
 
+    /* let the next mp_reschedule() targeting us send a new ipi */
+    atomic_and((volatile int *)&mp.reschedule_pending, ~(1U << cpu));
+
     return (mp.active_cpus & (1U << cpu)) ? INT_RESCHEDULE : INT_NO_RESCHEDULE;
 }
 #endif
@@ -27,6 +27,38 @@
  * @brief  Mutex functions
  *
  * @defgroup mutex Mutex
+ *
+ * The holder field is the lock word. An uncontended acquire is a single
+ * compare-and-swap of holder from NULL to the current thread, and an
+ * uncontended release is a store of NULL followed by a load of count.
+ *
+ * count is the number of threads that went down the slow path. They
+ * increment it under the lock embedded in the mutex's wait queue before
+ * retrying the compare-and-swap and blocking. A releasing thread that sees a
+ * non-zero count after clearing holder takes that lock and wakes a waiter.
+ * Both sides use sequentially consistent accesses, so either the releaser
+ * sees the count or the waiter's retry sees the mutex free. Woken threads
+ * compete with newly arriving ones for the mutex rather than having it handed
+ * to them.
+ *
+ * On SMP, a thread that finds the mutex held by a thread running on another
+ * cpu spins for a while before blocking, since the holder is likely to
+ * release it soon and blocking costs two context switches.
+ *
+ * Mutexes implement priority inheritance. A thread about to block raises the
+ * holder's priority to its own, following the chain if the holder is itself
+ * blocked on a mutex. The contended mutex is linked on the holder's pi_mutexes
+ * list, so that on release the holder can drop back to the highest priority
+ * still inherited from the other mutexes it holds. A release clears holder
+ * before taking the locks, so a new holder may be boosted before the old one
+ * unlinks the mutex. pi_owner records whose list the mutex is on, a boost
+ * moves it to the new holder's list and the old holder leaves it alone.
+ *
+ * Condition variables move their waiters onto a mutex's wait queue with
+ * mutex_requeue() rather than waking them. A requeued thread is counted and
+ * boosts the holder as if it had blocked in mutex_acquire(), and finishes the
+ * acquire in mutex_acquire_requeued() once woken.
+ *
  * @{
  */
 
@@ -35,6 +67,7 @@
 #include <assert.h>
 #include <err.h>
 #include <kernel/thread.h>
+#include <platform.h>
 
 /**
  * @brief  Initialize a mutex_t
@@ -44,6 +77,27 @@ void mutex_init(mutex_t *m)
     *m = (mutex_t)MUTEX_INITIAL_VALUE(*m);
 }
 
+/* link @m on the pi_mutexes list of @holder, called with the thread lock held */
+static void mutex_pi_link(mutex_t *m, thread_t *holder)
+{
+    if (m->pi_owner == holder)
+        return;
+
+    if (m->pi_owner)
+        list_delete(&m->pi_node);
+    list_add_tail(&holder->pi_mutexes, &m->pi_node);
+    m->pi_owner = holder;
+}
+
+/* unlink @m from the list it is on, called with the thread lock held */
+static void mutex_pi_unlink(mutex_t *m)
+{
+    if (m->pi_owner) {
+        list_delete(&m->pi_node);
+        m->pi_owner = NULL;
+    }
+}
+
 /**
  * @brief  Destroy a mutex_t
  *
@@ -60,11 +114,245 @@ void mutex_destroy(mutex_t *m)
               get_current_thread(), get_current_thread()->name, m, m->holder, m->holder->name);
 #endif
 
-    THREAD_LOCK(state);
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&m->wait.lock, state);
     m->magic = 0;
     m->count = 0;
-    wait_queue_destroy(&m->wait, true);
-    THREAD_UNLOCK(state);
+    thread_lock_ints_disabled();
+    mutex_pi_unlink(m);
+    wait_queue_destroy_unlock(&m->wait, true, &m->wait.lock);
+    thread_unlock_ints_disabled();
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+static inline bool mutex_try_acquire(mutex_t *m, thread_t *current_thread)
+{
+    thread_t *expected = NULL;
+
+    return __atomic_compare_exchange_n(&m->holder, &expected, current_thread,
+                                       false, __ATOMIC_SEQ_CST,
+                                       __ATOMIC_RELAXED);
+}
+
+/* maximum length of a chain of blocked holders to boost */
+#define MUTEX_PI_MAX_DEPTH 16
+
+/* highest priority of the threads blocked on @m, or -1 if there are none */
+static int mutex_top_waiter_priority(mutex_t *m)
+{
+    thread_t *t;
+    int priority = -1;
+
+    list_for_every_entry(&m->wait.list, t, thread_t, queue_node) {
+        priority = MAX(priority, t->priority);
+    }
+
+    return priority;
+}
+
+/**
+ * @brief  Priority a thread inherits from waiters on the mutexes it holds
+ *
+ * Must be called with the thread lock held.
+ *
+ * @return  The highest priority of those waiters, or -1 if there are none.
+ */
+int mutex_inherited_priority(thread_t *t)
+{
+    mutex_t *m;
+    int priority = -1;
+
+    DEBUG_ASSERT(thread_lock_held());
+
+    list_for_every_entry(&t->pi_mutexes, m, mutex_t, pi_node) {
+        priority = MAX(priority, mutex_top_waiter_priority(m));
+    }
+
+    return priority;
+}
+
+/*
+ * Called with the thread lock held by a thread of @priority about to block on
+ * @m, held by @holder. The holder cannot finish releasing @m while we hold the
+ * thread lock, and neither can the holder of any mutex further down the chain,
+ * since each of those has a blocked waiter and must take the slow path.
+ */
+static void mutex_pi_boost(mutex_t *m, thread_t *holder, int priority)
+{
+    for (uint depth = 0; depth < MUTEX_PI_MAX_DEPTH; depth++) {
+        mutex_pi_link(m, holder);
+
+        if (holder->priority >= priority)
+            return;
+
+        thread_set_effective_priority(holder, priority);
+
+        m = holder->blocking_mutex;
+        if (!m)
+            return;
+
+        holder = __atomic_load_n(&m->holder, __ATOMIC_RELAXED);
+        if (!holder)
+            return;
+    }
+}
+
+/*
+ * Called with the lock of @m held by a waiter that timed out, and is no
+ * longer on the wait queue. Drop what the holder inherited from it, and
+ * unlink @m from the holder's list if nobody else waits, since the holder
+ * may now release it on the fast path.
+ */
+static void mutex_pi_waiter_timed_out(mutex_t *m)
+{
+    thread_lock_ints_disabled();
+
+    thread_t *owner = m->pi_owner;
+    if (owner) {
+        if (!m->wait.count)
+            mutex_pi_unlink(m);
+
+        int priority = MAX(owner->base_priority,
+                           mutex_inherited_priority(owner));
+        if (priority < owner->priority)
+            thread_set_effective_priority(owner, priority);
+    }
+
+    thread_unlock_ints_disabled();
+}
+
+#if WITH_SMP
+
+/* maximum number of times to poll the holder before giving up and blocking */
+#ifndef MUTEX_SPIN_COUNT
+#define MUTEX_SPIN_COUNT 1000
+#endif
+
+static inline bool mutex_holder_running(thread_t *holder)
+{
+    return __atomic_load_n(&holder->state, __ATOMIC_RELAXED) == THREAD_RUNNING &&
+           __atomic_load_n(&holder->curr_cpu, __ATOMIC_RELAXED) >= 0;
+}
+
+/*
+ * Spin while the mutex is held by a thread running on another cpu.
+ *
+ * The holder's state is read without the thread lock. It may release the
+ * mutex, exit and be freed while we look at it, so holder is re-read after
+ * every check: a stale read can only cost one extra iteration.
+ */
+static bool mutex_spin(mutex_t *m, thread_t *current_thread)
+{
+    for (uint i = 0; i < MUTEX_SPIN_COUNT; i++) {
+        thread_t *holder = __atomic_load_n(&m->holder, __ATOMIC_RELAXED);
+
+        if (!holder) {
+            if (mutex_try_acquire(m, current_thread))
+                return true;
+            continue;
+        }
+
+        if (!mutex_holder_running(holder) &&
+            __atomic_load_n(&m->holder, __ATOMIC_RELAXED) == holder) {
+            /* the holder blocked or was preempted, spinning is pointless */
+            return false;
+        }
+    }
+
+    return false;
+}
+
+#else
+
+static inline bool mutex_spin(mutex_t *m, thread_t *current_thread)
+{
+    return false;
+}
+
+#endif
+
+/*
+ * @counted is set for a thread that mutex_requeue() already counted in
+ * m->count, which is woken from the wait queue rather than arriving.
+ */
+static status_t mutex_acquire_slow(mutex_t *m, lk_time_t timeout, bool counted)
+{
+    thread_t *current_thread = get_current_thread();
+    lk_time_t start;
+    lk_time_t remaining = timeout;
+    status_t ret;
+
+    /* a zero timeout asks for a try-lock, so don't spin for it */
+    if (!counted && timeout != 0 && mutex_spin(m, current_thread)) {
+        THREAD_STATS_INC(mutex_spin_acquires);
+        return NO_ERROR;
+    }
+
+    start = current_time();
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&m->wait.lock, state);
+
+    if (!counted)
+        __atomic_add_fetch(&m->count, 1, __ATOMIC_SEQ_CST);
+
+    for (;;) {
+        if (mutex_try_acquire(m, current_thread)) {
+            ret = NO_ERROR;
+            break;
+        }
+
+        if (remaining == 0) {
+            ret = ERR_TIMED_OUT;
+            break;
+        }
+
+        thread_t *holder = __atomic_load_n(&m->holder, __ATOMIC_RELAXED);
+        if (!holder) {
+            /* released since the compare-and-swap, try again */
+            continue;
+        }
+
+        THREAD_STATS_INC(mutex_blocks);
+        thread_lock_ints_disabled();
+        mutex_pi_boost(m, holder, current_thread->priority);
+        current_thread->blocking_mutex = m;
+        ret = wait_queue_block_unlock(&m->wait, remaining, &m->wait.lock);
+        current_thread->blocking_mutex = NULL;
+        thread_unlock_ints_disabled();
+
+        if (unlikely(ret < NO_ERROR && ret != ERR_TIMED_OUT)) {
+            /*
+             * there was a general error, the mutex may have been destroyed
+             * out from underneath us, so just exit (which is really an
+             * invalid state anyway)
+             */
+            arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+            return ret;
+        }
+
+        spin_lock(&m->wait.lock);
+
+        if (ret == ERR_TIMED_OUT) {
+            /* one last try, the mutex may have been released as we timed out */
+            if (mutex_try_acquire(m, current_thread))
+                ret = NO_ERROR;
+            else
+                mutex_pi_waiter_timed_out(m);
+            break;
+        }
+
+        /* woken up, but another thread may beat us to the mutex */
+        if (timeout != INFINITE_TIME) {
+            lk_time_t elapsed = current_time() - start;
+            remaining = elapsed < timeout ? timeout - elapsed : 0;
+        }
+    }
+
+    __atomic_sub_fetch(&m->count, 1, __ATOMIC_SEQ_CST);
+
+    spin_unlock_irqrestore(&m->wait.lock, state);
+    return ret;
 }
 
 /**
@@ -87,33 +375,117 @@ status_t mutex_acquire_timeout(mutex_t *m, lk_time_t timeout)
               get_current_thread(), get_current_thread()->name, m);
 #endif
 
-    THREAD_LOCK(state);
-
-    status_t ret = NO_ERROR;
-    if (unlikely(++m->count > 1)) {
-        ret = wait_queue_block(&m->wait, timeout);
-        if (unlikely(ret < NO_ERROR)) {
-            /* if the acquisition timed out, back out the acquire and exit */
-            if (likely(ret == ERR_TIMED_OUT)) {
-                /*
-                 * race: the mutex may have been destroyed after the timeout,
-                 * but before we got scheduled again which makes messing with the
-                 * count variable dangerous.
-                 */
-                m->count--;
-            }
-            /* if there was a general error, it may have been destroyed out from
-             * underneath us, so just exit (which is really an invalid state anyway)
-             */
-            goto err;
-        }
+    if (likely(mutex_try_acquire(m, get_current_thread())))
+        return NO_ERROR;
+
+    return mutex_acquire_slow(m, timeout, false);
+}
+
+/**
+ * @brief  Finish acquiring a mutex after mutex_requeue()
+ *
+ * Called by a thread that mutex_requeue() moved to the mutex's wait queue,
+ * once it has been woken up or timed out, with blocking_mutex cleared.
+ *
+ * @return  NO_ERROR, or an error if the mutex was destroyed.
+ */
+status_t mutex_acquire_requeued(mutex_t *m)
+{
+    DEBUG_ASSERT(m->magic == MUTEX_MAGIC);
+
+    return mutex_acquire_slow(m, INFINITE_TIME, true);
+}
+
+/**
+ * @brief  Move threads from a wait queue to the wait queue of a mutex
+ *
+ * The moved threads have blocking_mutex set to @m. They are counted and
+ * boost the holder as if they had blocked in mutex_acquire(), and must call
+ * mutex_acquire_requeued() once they return from wait_queue_block().
+ *
+ * Must be called with interrupts disabled and the lock of @wait held, which
+ * must be taken before the mutex's own lock.
+ *
+ * @param m      Mutex to move the threads to
+ * @param wait   Wait queue the threads are blocked on
+ * @param count  Maximum number of threads to move, from the head of @wait
+ *
+ * @return  The number of threads moved.
+ */
+int mutex_requeue(mutex_t *m, wait_queue_t *wait, uint count)
+{
+    thread_t *t;
+    thread_t *holder;
+    int moved = 0;
+
+    DEBUG_ASSERT(m->magic == MUTEX_MAGIC);
+    DEBUG_ASSERT(arch_ints_disabled());
+
+    spin_lock(&m->wait.lock);
+    thread_lock_ints_disabled();
+
+    while ((uint)moved < count &&
+           (t = list_remove_head_type(&wait->list, thread_t, queue_node))) {
+        wait->count--;
+        list_add_tail(&m->wait.list, &t->queue_node);
+        m->wait.count++;
+        t->blocking_wait_queue = &m->wait;
+        t->blocking_mutex = m;
+        moved++;
+
+        __atomic_add_fetch(&m->count, 1, __ATOMIC_SEQ_CST);
+        holder = __atomic_load_n(&m->holder, __ATOMIC_SEQ_CST);
+        if (holder)
+            mutex_pi_boost(m, holder, t->priority);
     }
 
-    m->holder = get_current_thread();
+    /*
+     * a thread that released the mutex before seeing the count will not wake
+     * anyone, so do it for it. as in mutex_acquire(), either the release sees
+     * the count or we see the mutex free.
+     */
+    if (moved && !__atomic_load_n(&m->holder, __ATOMIC_SEQ_CST))
+        wait_queue_wake_one(&m->wait, false, NO_ERROR);
 
-err:
-    THREAD_UNLOCK(state);
-    return ret;
+    thread_unlock_ints_disabled();
+    spin_unlock(&m->wait.lock);
+
+    return moved;
+}
+
+static void mutex_release_slow(mutex_t *m)
+{
+    thread_t *current_thread = get_current_thread();
+    bool unboosted = false;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&m->wait.lock, state);
+    thread_lock_ints_disabled();
+
+    /* a new holder may already have been boosted through @m and own it */
+    if (m->pi_owner == current_thread)
+        mutex_pi_unlink(m);
+
+    if (current_thread->priority != current_thread->base_priority) {
+        /* drop the priority inherited through this mutex */
+        int priority = MAX(current_thread->base_priority,
+                           mutex_inherited_priority(current_thread));
+        unboosted = priority < current_thread->priority;
+        thread_set_effective_priority(current_thread, priority);
+    }
+
+    /*
+     * release a thread. if there is none, the slow path threads are not
+     * blocked yet and will retry.
+     */
+    if (!wait_queue_wake_one_unlock(&m->wait, true, NO_ERROR, &m->wait.lock) &&
+        unboosted) {
+        /* let any thread we were holding off run */
+        thread_preempt_lock_held();
+    }
+
+    thread_unlock_ints_disabled();
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 }
 
 /**
@@ -130,16 +502,10 @@ status_t mutex_release(mutex_t *m)
     }
 #endif
 
-    THREAD_LOCK(state);
-
-    m->holder = 0;
+    __atomic_store_n(&m->holder, NULL, __ATOMIC_SEQ_CST);
 
-    if (unlikely(--m->count >= 1)) {
-        /* release a thread */
-        wait_queue_wake_one(&m->wait, true, NO_ERROR);
-    }
+    if (unlikely(__atomic_load_n(&m->count, __ATOMIC_SEQ_CST) > 0))
+        mutex_release_slow(m);
 
-    THREAD_UNLOCK(state);
     return NO_ERROR;
 }
-
@@ -36,6 +36,7 @@
 #include <err.h>
 #include <kernel/thread.h>
 #include <kernel/port.h>
+#include <kernel/rcu.h>
 
 // write ports can be in two states, open and closed, which have a
 // different magic number.
@@ -68,6 +69,7 @@ typedef struct {
     struct list_node rp_list;
     port_mode_t mode;
     char name[PORT_NAME_LEN];
+    struct rcu_head rcu;
 } write_port_t;
 
 typedef struct {
@@ -88,8 +90,22 @@ typedef struct {
 } read_port_t;
 
 
+// named write ports. lookups only hold a rcu read lock, so destroyed ports
+// are unlinked with list_delete_rcu() and freed after a grace period, and
+// lookups skip ports whose magic has been cleared.
 static struct list_node write_port_list;
 
+// protects the port lists, buffers and magic values. it is taken before
+// the thread lock, which is only needed around the wait queue operations.
+static spin_lock_t port_lock = SPIN_LOCK_INITIAL_VALUE;
+
+#define PORT_LOCK(state) \
+    spin_lock_saved_state_t state; \
+    spin_lock_irqsave(&port_lock, state)
+
+#define PORT_UNLOCK(state) \
+    spin_unlock_irqrestore(&port_lock, state)
+
 
 static port_buf_t *make_buf(uint pk_count)
 {
@@ -131,6 +147,11 @@ static status_t buf_read(port_buf_t *buf, port_result_t *pr)
     return NO_ERROR;
 }
 
+static void write_port_free(struct rcu_head *head)
+{
+    free(containerof(head, write_port_t, rcu));
+}
+
 // must be called before any use of ports.
 void port_init(void)
 {
@@ -153,22 +174,20 @@ status_t port_create(const char *name, port_mode_t mode, port_t *port)
 
     // lookup for existing port, return that if found.
     write_port_t *wp = NULL;
-    THREAD_LOCK(state1);
-    list_for_every_entry(&write_port_list, wp, write_port_t, node) {
-        if (strcmp(wp->name, name) == 0) {
+    spin_lock_saved_state_t rcu_state;
+    rcu_read_lock(&rcu_state);
+    list_for_every_entry_rcu(&write_port_list, wp, write_port_t, node) {
+        int magic = wp->magic;
+        if (magic && strcmp(wp->name, name) == 0) {
+            rcu_read_unlock(rcu_state);
             // can't return closed ports.
-            if (wp->magic == WRITEPORT_MAGIC_X)
-                wp = NULL;
-            THREAD_UNLOCK(state1);
-            if (wp) {
-                *port = (void *) wp;
-                return ERR_ALREADY_EXISTS;
-            } else {
+            if (magic == WRITEPORT_MAGIC_X)
                 return ERR_BUSY;
-            }
+            *port = (void *) wp;
+            return ERR_ALREADY_EXISTS;
         }
     }
-    THREAD_UNLOCK(state1);
+    rcu_read_unlock(rcu_state);
 
     // not found, create the write port and the circular buffer.
     wp = calloc(1, sizeof(write_port_t));
@@ -189,9 +208,9 @@ status_t port_create(const char *name, port_mode_t mode, port_t *port)
 
     // todo: race condtion! a port with the same name could have been created
     // by another thread at is point.
-    THREAD_LOCK(state2);
-    list_add_tail(&write_port_list, &wp->node);
-    THREAD_UNLOCK(state2);
+    PORT_LOCK(state);
+    list_add_tail_rcu(&write_port_list, &wp->node);
+    PORT_UNLOCK(state);
 
     *port = (void *)wp;
     return NO_ERROR;
@@ -223,38 +242,45 @@ status_t port_open(const char *name, void *ctx, port_t *port)
     // find the named write port and associate it with read port.
     status_t rc = ERR_NOT_FOUND;
 
-    THREAD_LOCK(state);
+    spin_lock_saved_state_t rcu_state;
+    rcu_read_lock(&rcu_state);
     write_port_t *wp = NULL;
-    list_for_every_entry(&write_port_list, wp, write_port_t, node) {
-        if (strcmp(wp->name, name) == 0) {
-            // found; add read port to write port list.
-            rp->wport = wp;
-            if (wp->buf) {
-                // this is the first read port; transfer the circular buffer.
-                list_add_tail(&wp->rp_list, &rp->w_node);
-                rp->buf = wp->buf;
-                wp->buf = NULL;
-                rc = NO_ERROR;
-            } else if (buf) {
-                // not first read port.
-                if (wp->mode & PORT_MODE_UNICAST) {
-                    // cannot add a second listener.
-                    rc = ERR_NOT_ALLOWED;
-                    break;
-                }
+    list_for_every_entry_rcu(&write_port_list, wp, write_port_t, node) {
+        if (wp->magic && strcmp(wp->name, name) == 0)
+            break;
+        wp = NULL;
+    }
+
+    PORT_LOCK(state);
+    // the port might have been destroyed since the lookup.
+    if (wp && wp->magic) {
+        // found; add read port to write port list.
+        rp->wport = wp;
+        if (wp->buf) {
+            // this is the first read port; transfer the circular buffer.
+            list_add_tail(&wp->rp_list, &rp->w_node);
+            rp->buf = wp->buf;
+            wp->buf = NULL;
+            rc = NO_ERROR;
+        } else if (buf) {
+            // not first read port.
+            if (wp->mode & PORT_MODE_UNICAST) {
+                // cannot add a second listener.
+                rc = ERR_NOT_ALLOWED;
+            } else {
                 // use the new (small) circular buffer.
                 list_add_tail(&wp->rp_list, &rp->w_node);
                 rp->buf = buf;
                 buf = NULL;
                 rc = NO_ERROR;
-            } else {
-                // |buf| allocation failed and the buffer was needed.
-                rc = ERR_NO_MEMORY;
             }
-            break;
+        } else {
+            // |buf| allocation failed and the buffer was needed.
+            rc = ERR_NO_MEMORY;
         }
     }
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
+    rcu_read_unlock(rcu_state);
 
     if (buf)
         free(buf);
@@ -290,7 +316,7 @@ status_t port_group(port_t *ports, size_t count, port_t *group)
 
     status_t rc = NO_ERROR;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     for (size_t ix = 0; ix != count; ix++) {
         read_port_t *rp = (read_port_t *)ports[ix];
         if ((rp->magic != READPORT_MAGIC) || rp->gport) {
@@ -306,7 +332,7 @@ status_t port_group(port_t *ports, size_t count, port_t *group)
         rp->gport = pg;
         list_add_tail(&pg->rp_list, &rp->g_node);
     }
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
     if (rc == NO_ERROR) {
         *group = (port_t *)pg;
@@ -331,7 +357,7 @@ status_t port_group_add(port_t group, port_t port)
         return ERR_BAD_HANDLE;
 
     status_t rc = NO_ERROR;
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
 
     if (list_length(&pg->rp_list) == MAX_PORT_GROUP_COUNT) {
         rc = ERR_TOO_BIG;
@@ -342,11 +368,13 @@ status_t port_group_add(port_t group, port_t port)
         // If the new read port being added has messages available, try to wake
         // any readers that might be present.
         if (!buf_is_empty(rp->buf)) {
+            thread_lock_ints_disabled();
             wait_queue_wake_one(&pg->wait, false, NO_ERROR);
+            thread_unlock_ints_disabled();
         }
     }
 
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
     return rc;
 }
@@ -365,7 +393,7 @@ status_t port_group_remove(port_t group, port_t port)
     if (rp->magic != READPORT_MAGIC || rp->gport != pg)
         return ERR_BAD_HANDLE;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
 
     bool found = false;
     read_port_t *current_rp;
@@ -380,7 +408,7 @@ status_t port_group_remove(port_t group, port_t port)
 
     list_delete(&rp->g_node);
 
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
     return NO_ERROR;
 }
@@ -391,10 +419,10 @@ status_t port_write(port_t port, const port_packet_t *pk, size_t count)
         return ERR_INVALID_ARGS;
 
     write_port_t *wp = (write_port_t *)port;
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     if (wp->magic != WRITEPORT_MAGIC_W) {
         // wrong port type.
-        THREAD_UNLOCK(state);
+        PORT_UNLOCK(state);
         return ERR_BAD_HANDLE;
     }
 
@@ -408,6 +436,7 @@ status_t port_write(port_t port, const port_packet_t *pk, size_t count)
         // there are read ports. for each, write and attempt to wake a thread
         // from the port group or from the read port itself.
         read_port_t *rp;
+        thread_lock_ints_disabled();
         list_for_every_entry(&wp->rp_list, rp, read_port_t, w_node) {
             if (buf_write(rp->buf, pk, count) < 0) {
                 // buffer full.
@@ -425,9 +454,10 @@ status_t port_write(port_t port, const port_packet_t *pk, size_t count)
 
             awake_count += awaken;
         }
+        thread_unlock_ints_disabled();
     }
 
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
 #if RESCHEDULE_POLICY
     if (awake_count)
@@ -449,7 +479,10 @@ static inline status_t read_no_lock(read_port_t *rp, lk_time_t timeout, port_res
     if (!timeout)
         return ERR_TIMED_OUT;
 
-    status_t wr = wait_queue_block(&rp->wait, timeout);
+    thread_lock_ints_disabled();
+    status_t wr = wait_queue_block_unlock(&rp->wait, timeout, &port_lock);
+    thread_unlock_ints_disabled();
+    spin_lock(&port_lock);
     if (wr != NO_ERROR)
         return wr;
     // recursive tail call is usually optimized away with a goto.
@@ -464,7 +497,7 @@ status_t port_read(port_t port, lk_time_t timeout, port_result_t *result)
     status_t rc = ERR_GENERIC;
     read_port_t *rp = (read_port_t *)port;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     if (rp->magic == READPORT_MAGIC) {
         // dealing with a single port.
         rc = read_no_lock(rp, timeout, result);
@@ -480,7 +513,10 @@ status_t port_read(port_t port, lk_time_t timeout, port_result_t *result)
                     goto read_exit;
             }
             // no data, block on the group waitqueue.
-            rc = wait_queue_block(&pg->wait, timeout);
+            thread_lock_ints_disabled();
+            rc = wait_queue_block_unlock(&pg->wait, timeout, &port_lock);
+            thread_unlock_ints_disabled();
+            spin_lock(&port_lock);
         } while (rc == NO_ERROR);
     } else {
         // wrong port type.
@@ -488,7 +524,7 @@ status_t port_read(port_t port, lk_time_t timeout, port_result_t *result)
     }
 
 read_exit:
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
     return rc;
 }
 
@@ -500,14 +536,14 @@ status_t port_destroy(port_t port)
     write_port_t *wp = (write_port_t *) port;
     port_buf_t *buf = NULL;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     if (wp->magic != WRITEPORT_MAGIC_X) {
         // wrong port type.
-        THREAD_UNLOCK(state);
+        PORT_UNLOCK(state);
         return ERR_BAD_HANDLE;
     }
     // remove self from global named ports list.
-    list_delete(&wp->node);
+    list_delete_rcu(&wp->node);
 
     if (wp->buf) {
         // we have no readers.
@@ -515,6 +551,7 @@ status_t port_destroy(port_t port)
     } else {
         // for each reader:
         read_port_t *rp;
+        thread_lock_ints_disabled();
         list_for_every_entry(&wp->rp_list, rp, read_port_t, w_node) {
             // wake the read and group ports.
             wait_queue_wake_all(&rp->wait, false, ERR_CANCELLED);
@@ -524,13 +561,15 @@ status_t port_destroy(port_t port)
             // remove self from reader ports.
             rp->wport = NULL;
         }
+        thread_unlock_ints_disabled();
     }
 
     wp->magic = 0;
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
     free(buf);
-    free(wp);
+    // lookups might still be looking at |wp|.
+    call_rcu(&wp->rcu, write_port_free);
     return NO_ERROR;
 }
 
@@ -542,7 +581,7 @@ status_t port_close(port_t port)
     read_port_t *rp = (read_port_t *) port;
     port_buf_t *buf = NULL;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     if (rp->magic == READPORT_MAGIC) {
         // dealing with a read port.
         if (rp->wport) {
@@ -560,14 +599,18 @@ status_t port_close(port_t port)
             list_delete(&rp->g_node);
         }
         // wake up waiters, the return code is ERR_OBJECT_DESTROYED.
-        wait_queue_destroy(&rp->wait, true);
+        thread_lock_ints_disabled();
+        wait_queue_destroy(&rp->wait, false);
+        thread_unlock_ints_disabled();
         rp->magic = 0;
 
     } else if (rp->magic == PORTGROUP_MAGIC) {
         // dealing with a port group.
         port_group_t *pg = (port_group_t *) port;
         // wake up waiters.
-        wait_queue_destroy(&pg->wait, true);
+        thread_lock_ints_disabled();
+        wait_queue_destroy(&pg->wait, false);
+        thread_unlock_ints_disabled();
         // remove self from reader ports.
         rp = NULL;
         list_for_every_entry(&pg->rp_list, rp, read_port_t, g_node) {
@@ -580,15 +623,15 @@ status_t port_close(port_t port)
         write_port_t *wp = (write_port_t *) port;
         // mark it as closed. Now it can be read but not written to.
         wp->magic = WRITEPORT_MAGIC_X;
-        THREAD_UNLOCK(state);
+        PORT_UNLOCK(state);
         return NO_ERROR;
 
     } else {
-        THREAD_UNLOCK(state);
+        PORT_UNLOCK(state);
         return ERR_BAD_HANDLE;
     }
 
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
     free(buf);
     free(port);
@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2026 Google Inc. All rights reserved
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief  Read-copy-update
+ *
+ * @defgroup rcu Read-copy-update
+ *
+ * Callbacks move from rcu_next_list to rcu_wait_list when a grace period
+ * starts, and from rcu_wait_list to rcu_done_list when it ends, from where
+ * the rcu dpc calls them. Only one grace period runs at a time, callbacks
+ * queued while it runs wait for the next one.
+ *
+ * A grace period starts with a bit set in rcu_gp_pending for every active cpu
+ * that is not idle, other than the starting cpu which is known to be outside
+ * of a read side critical section. A cpu clears its bit when it enters the
+ * scheduler, and the cpu clearing the last bit ends the grace period from its
+ * rcu_timer, since thread_resched() holds the thread lock which nests inside
+ * rcu_lock. The rcu_timer of the starting cpu also polls the grace period
+ * every RCU_GP_FORCE_NS, and sends an interrupt to the cpus that have not
+ * entered the scheduler in that time, which clear their bit from it.
+ *
+ * Lock order: rcu_lock, then thread_lock.
+ *
+ * @{
+ */
+
+#include <kernel/rcu.h>
+#include <debug.h>
+#include <assert.h>
+#include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/percpu.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <lib/dpc.h>
+#include <platform.h>
+
+static spin_lock_t rcu_lock = SPIN_LOCK_INITIAL_VALUE;
+
+/* callbacks waiting for the next grace period, protected by rcu_lock */
+static struct list_node rcu_next_list = LIST_INITIAL_VALUE(rcu_next_list);
+/* callbacks waiting for the current grace period */
+static struct list_node rcu_wait_list = LIST_INITIAL_VALUE(rcu_wait_list);
+/* callbacks to call from rcu_dpc */
+static struct list_node rcu_done_list = LIST_INITIAL_VALUE(rcu_done_list);
+
+static struct dpc rcu_dpc;
+
+#if WITH_SMP
+/* how long to wait for a cpu to enter the scheduler before interrupting it */
+#define RCU_GP_FORCE_NS (10ULL * 1000 * 1000)
+
+static bool rcu_gp_active; /* protected by rcu_lock, as are the next two */
+static uint rcu_gp_cpu;
+static lk_time_ns_t rcu_gp_start;
+static mp_cpu_mask_t rcu_gp_pending; /* updated atomically */
+
+static DEFINE_PER_CPU(timer_t, rcu_timer);
+static mp_call_t rcu_force_call = MP_CALL_INITIAL_VALUE(rcu_force_call);
+
+static enum handler_return rcu_timer_callback(struct timer *t,
+                                              lk_time_ns_t now, void *arg);
+
+/* returns true if @cpu was the last cpu the grace period waited for */
+static bool rcu_cpu_quiescent(uint cpu)
+{
+    mp_cpu_mask_t bit = 1U << cpu;
+
+    /* avoid the atomic update on every context switch */
+    if (!(__atomic_load_n(&rcu_gp_pending, __ATOMIC_RELAXED) & bit))
+        return false;
+
+    return __atomic_and_fetch(&rcu_gp_pending, ~bit, __ATOMIC_ACQ_REL) == 0;
+}
+
+static void rcu_gp_start_locked(void)
+{
+    uint cpu = arch_curr_cpu_num();
+    mp_cpu_mask_t pending;
+    timer_t *timer;
+
+    DEBUG_ASSERT(!rcu_gp_active);
+
+    if (list_is_empty(&rcu_next_list))
+        return;
+
+    list_splice_tail(&rcu_wait_list, &rcu_next_list);
+
+    thread_lock_ints_disabled();
+    pending = mp.active_cpus & ~mp_get_idle_mask() & ~(1U << cpu);
+    __atomic_store_n(&rcu_gp_pending, pending, __ATOMIC_SEQ_CST);
+    thread_unlock_ints_disabled();
+
+    if (!pending) {
+        /* no other cpu can be in a read side critical section */
+        list_splice_tail(&rcu_done_list, &rcu_wait_list);
+        dpc_enqueue_work(NULL, &rcu_dpc, false);
+        return;
+    }
+
+    rcu_gp_active = true;
+    rcu_gp_cpu = cpu;
+    rcu_gp_start = current_time_ns();
+
+    timer = &this_cpu(rcu_timer);
+    timer_cancel(timer);
+    timer_set_oneshot_ns(timer, RCU_GP_FORCE_NS, rcu_timer_callback, NULL);
+}
+
+/* ends the current grace period, if every cpu has been quiescent */
+static void rcu_gp_try_end_locked(void)
+{
+    if (!rcu_gp_active || __atomic_load_n(&rcu_gp_pending, __ATOMIC_ACQUIRE))
+        return;
+
+    list_splice_tail(&rcu_done_list, &rcu_wait_list);
+    dpc_enqueue_work(NULL, &rcu_dpc, false);
+    rcu_gp_active = false;
+
+    rcu_gp_start_locked();
+}
+
+/* runs from an interrupt, so this cpu is not in a read side critical section */
+static void rcu_force_quiescent_state(void *arg)
+{
+    if (rcu_cpu_quiescent(arch_curr_cpu_num())) {
+        spin_lock(&rcu_lock);
+        rcu_gp_try_end_locked();
+        spin_unlock(&rcu_lock);
+    }
+}
+
+static enum handler_return rcu_timer_callback(struct timer *t,
+                                              lk_time_ns_t now, void *arg)
+{
+    uint cpu = arch_curr_cpu_num();
+    mp_cpu_mask_t pending;
+
+    spin_lock(&rcu_lock);
+
+    if (!rcu_gp_active)
+        goto done;
+
+    rcu_cpu_quiescent(cpu);
+
+    /* cpus that went offline will not report in */
+    pending = __atomic_and_fetch(&rcu_gp_pending, mp.active_cpus,
+                                 __ATOMIC_ACQ_REL);
+    if (!pending) {
+        rcu_gp_try_end_locked();
+        goto done;
+    }
+
+    /* only the timer of the cpu that started the grace period polls it */
+    if (cpu != rcu_gp_cpu)
+        goto done;
+
+    if (now - rcu_gp_start >= RCU_GP_FORCE_NS)
+        mp_async_exec(&rcu_force_call, pending, rcu_force_quiescent_state,
+                      NULL);
+
+    timer_set_oneshot_ns(t, RCU_GP_FORCE_NS, rcu_timer_callback, NULL);
+
+done:
+    spin_unlock(&rcu_lock);
+    return INT_NO_RESCHEDULE;
+}
+
+void rcu_note_context_switch(uint cpu)
+{
+    DEBUG_ASSERT(thread_lock_held());
+
+    if (rcu_cpu_quiescent(cpu)) {
+        timer_t *timer = &per_cpu(rcu_timer, cpu);
+
+        timer_cancel(timer);
+        timer_set_oneshot_ns(timer, 0, rcu_timer_callback, NULL);
+    }
+}
+#endif
+
+static void rcu_dpc_callback(struct dpc *work)
+{
+    struct list_node list = LIST_INITIAL_VALUE(list);
+    struct rcu_head *head;
+    spin_lock_saved_state_t state;
+
+    spin_lock_irqsave(&rcu_lock, state);
+    list_splice_tail(&list, &rcu_done_list);
+    spin_unlock_irqrestore(&rcu_lock, state);
+
+    while ((head = list_remove_head_type(&list, struct rcu_head, node)))
+        head->func(head);
+}
+
+/**
+ * @brief  Call a function once a grace period has passed
+ *
+ * @param head  Node embedded in the object to reclaim, passed to @func.
+ * @param func  Callback, called from the dpc thread.
+ *
+ * Must not be called before the dpc thread has been started.
+ */
+void call_rcu(struct rcu_head *head, rcu_callback_t func)
+{
+    spin_lock_saved_state_t state;
+
+    head->func = func;
+
+    spin_lock_irqsave(&rcu_lock, state);
+#if WITH_SMP
+    list_add_tail(&rcu_next_list, &head->node);
+    if (!rcu_gp_active)
+        rcu_gp_start_locked();
+#else
+    /* the only cpu is not in a read side critical section */
+    list_add_tail(&rcu_done_list, &head->node);
+    dpc_enqueue_work(NULL, &rcu_dpc, false);
+#endif
+    spin_unlock_irqrestore(&rcu_lock, state);
+}
+
+struct rcu_synchronize_waiter {
+    struct rcu_head rcu;
+    event_t event;
+};
+
+static void rcu_synchronize_callback(struct rcu_head *head)
+{
+    struct rcu_synchronize_waiter *waiter =
+            containerof(head, struct rcu_synchronize_waiter, rcu);
+
+    event_signal(&waiter->event, true);
+}
+
+/**
+ * @brief  Wait for a grace period
+ *
+ * Returns once every read side critical section that started before the call
+ * has ended, and every callback queued with call_rcu() before the call has
+ * been called.
+ */
+void rcu_synchronize(void)
+{
+    struct rcu_synchronize_waiter waiter;
+
+    DEBUG_ASSERT(!arch_ints_disabled());
+
+    event_init(&waiter.event, false, 0);
+    call_rcu(&waiter.rcu, rcu_synchronize_callback);
+    event_wait(&waiter.event);
+    event_destroy(&waiter.event);
+}
+
+void rcu_init(void)
+{
+    dpc_work_init(&rcu_dpc, rcu_dpc_callback, 0);
+
+#if WITH_SMP
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        timer_initialize(&per_cpu(rcu_timer, i));
+#endif
+}
+
+/* @} */
@@ -3,18 +3,24 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 MODULE := $(LOCAL_DIR)
 
 MODULE_DEPS := \
+	lib/binary_search_tree \
 	lib/libc \
 	lib/debug \
+	lib/dpc \
 	lib/heap \
 	trusty/kernel/lib/rand
 
 MODULE_SRCS := \
+	$(LOCAL_DIR)/cond.c \
 	$(LOCAL_DIR)/debug.c \
 	$(LOCAL_DIR)/event.c \
 	$(LOCAL_DIR)/init.c \
 	$(LOCAL_DIR)/mutex.c \
+	$(LOCAL_DIR)/rcu.c \
+	$(LOCAL_DIR)/rwlock.c \
 	$(LOCAL_DIR)/thread.c \
 	$(LOCAL_DIR)/timer.c \
+	$(LOCAL_DIR)/wait_address.c \
 	$(LOCAL_DIR)/semaphore.c \
 	$(LOCAL_DIR)/mp.c \
 	$(LOCAL_DIR)/port.c
@@ -0,0 +1,329 @@
+/*
+ * Copyright (c) 2026 Google Inc. All rights reserved
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief  Reader-writer lock functions
+ *
+ * @defgroup rwlock Reader-writer lock
+ *
+ * The state field is the lock word. It holds the number of readers holding
+ * the lock, or RWLOCK_WRITER if a writer holds it. Without waiters, readers
+ * acquire and release the lock with a compare-and-swap of the reader count,
+ * and writers with a compare-and-swap between 0 and RWLOCK_WRITER.
+ *
+ * The slow path is protected by the lock embedded in the read_wait queue.
+ * A thread on the slow path first sets RWLOCK_WAITERS, which makes every
+ * fast path compare-and-swap fail, so the state only changes under that lock
+ * until the flag is cleared again. The flag stays set while readers_waiting
+ * or writers_waiting is non-zero.
+ *
+ * The lock is handed over to waiters on release: the releasing thread updates
+ * the state on behalf of the threads it wakes. Waiting writers are preferred
+ * over waiting readers, and readers arriving while a writer waits block
+ * behind it.
+ *
+ * @{
+ */
+
+#include <kernel/rwlock.h>
+#include <debug.h>
+#include <assert.h>
+#include <err.h>
+#include <kernel/thread.h>
+
+/**
+ * @brief  Initialize a rwlock_t
+ */
+void rwlock_init(rwlock_t *rw)
+{
+    *rw = (rwlock_t)RWLOCK_INITIAL_VALUE(*rw);
+}
+
+/**
+ * @brief  Destroy a rwlock_t
+ *
+ * Threads still waiting for the lock are woken with ERR_OBJECT_DESTROYED.
+ * The rwlock_t object itself is not freed.
+ */
+void rwlock_destroy(rwlock_t *rw)
+{
+    DEBUG_ASSERT(rw->magic == RWLOCK_MAGIC);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&rw->read_wait.lock, state);
+    rw->magic = 0;
+    rw->state = 0;
+    rw->readers_waiting = 0;
+    rw->writers_waiting = 0;
+    thread_lock_ints_disabled();
+    wait_queue_destroy(&rw->write_wait, false);
+    wait_queue_destroy_unlock(&rw->read_wait, true, &rw->read_wait.lock);
+    thread_unlock_ints_disabled();
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+static inline uint32_t rwlock_waiters_flag(rwlock_t *rw)
+{
+    return rw->readers_waiting || rw->writers_waiting ? RWLOCK_WAITERS : 0;
+}
+
+/*
+ * Store a new state, with RWLOCK_WAITERS recomputed from the waiter counts.
+ * Called with the slow path lock held and RWLOCK_WAITERS set.
+ */
+static inline void rwlock_set_state(rwlock_t *rw, uint32_t state)
+{
+    DEBUG_ASSERT(rw->state & RWLOCK_WAITERS);
+
+    state = (state & ~RWLOCK_WAITERS) | rwlock_waiters_flag(rw);
+    __atomic_store_n(&rw->state, state, __ATOMIC_RELEASE);
+}
+
+/* set RWLOCK_WAITERS, after which the state only changes under the lock */
+static inline uint32_t rwlock_lock_state(rwlock_t *rw)
+{
+    DEBUG_ASSERT(spin_lock_held(&rw->read_wait.lock));
+
+    return __atomic_or_fetch(&rw->state, RWLOCK_WAITERS, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Wake @count readers waiting on @rw and add them to the reader count in
+ * @state. Called with the slow path lock and the thread lock held, releases
+ * the slow path lock.
+ */
+static void rwlock_wake_readers_unlock(rwlock_t *rw, uint32_t state,
+                                       uint count)
+{
+    DEBUG_ASSERT(!(state & RWLOCK_WRITER));
+    DEBUG_ASSERT(count <= rw->readers_waiting);
+
+    rw->readers_waiting -= count;
+    rwlock_set_state(rw, state + count);
+    wait_queue_wake_all_unlock(&rw->read_wait, false, NO_ERROR,
+                               &rw->read_wait.lock);
+}
+
+/*
+ * Hand the lock, no longer held by anyone, to the waiting threads. Called with
+ * the slow path lock held and RWLOCK_WAITERS set, releases that lock.
+ *
+ * The queue counts, rather than readers_waiting and writers_waiting, decide
+ * who gets the lock. A waiter that timed out has already left its queue, but
+ * only drops its waiting count once it gets the slow path lock back.
+ */
+static void rwlock_wake_unlock(rwlock_t *rw)
+{
+    DEBUG_ASSERT(!(rw->state & (RWLOCK_WRITER | RWLOCK_READERS_MASK)));
+
+    thread_lock_ints_disabled();
+    if (rw->write_wait.count) {
+        rw->writers_waiting--;
+        rwlock_set_state(rw, RWLOCK_WRITER);
+        wait_queue_wake_one_unlock(&rw->write_wait, false, NO_ERROR,
+                                   &rw->read_wait.lock);
+    } else if (rw->read_wait.count) {
+        rwlock_wake_readers_unlock(rw, 0, rw->read_wait.count);
+    } else {
+        rwlock_set_state(rw, 0);
+        spin_unlock(&rw->read_wait.lock);
+    }
+    thread_unlock_ints_disabled();
+}
+
+/**
+ * @brief  Acquire a rwlock for reading, with a timeout
+ *
+ * @param rw       The rwlock to acquire
+ * @param timeout  The maximum time, in ms, to wait. 0 only tries to acquire
+ *                 the lock.
+ *
+ * @return NO_ERROR once the lock is held, ERR_TIMED_OUT on timeout, or
+ * ERR_OBJECT_DESTROYED if the rwlock was destroyed while waiting.
+ */
+status_t rwlock_acquire_read_timeout(rwlock_t *rw, lk_time_t timeout)
+{
+    DEBUG_ASSERT(rw->magic == RWLOCK_MAGIC);
+
+    uint32_t old = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+    while (!(old & (RWLOCK_WRITER | RWLOCK_WAITERS))) {
+        if (__atomic_compare_exchange_n(&rw->state, &old, old + 1, true,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return NO_ERROR;
+    }
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&rw->read_wait.lock, state);
+
+    old = rwlock_lock_state(rw);
+    if (!(old & RWLOCK_WRITER) && !rw->writers_waiting) {
+        rwlock_set_state(rw, old + 1);
+        spin_unlock_irqrestore(&rw->read_wait.lock, state);
+        return NO_ERROR;
+    }
+    if (timeout == 0) {
+        rwlock_set_state(rw, old);
+        spin_unlock_irqrestore(&rw->read_wait.lock, state);
+        return ERR_TIMED_OUT;
+    }
+
+    rw->readers_waiting++;
+    thread_lock_ints_disabled();
+    status_t ret = wait_queue_block_unlock(&rw->read_wait, timeout,
+                                           &rw->read_wait.lock);
+    thread_unlock_ints_disabled();
+
+    if (ret == ERR_TIMED_OUT) {
+        spin_lock(&rw->read_wait.lock);
+        rw->readers_waiting--;
+        rwlock_set_state(rw, rw->state);
+        spin_unlock(&rw->read_wait.lock);
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+    return ret;
+}
+
+/**
+ * @brief  Acquire a rwlock for writing, with a timeout
+ *
+ * @param rw       The rwlock to acquire
+ * @param timeout  The maximum time, in ms, to wait. 0 only tries to acquire
+ *                 the lock.
+ *
+ * @return NO_ERROR once the lock is held, ERR_TIMED_OUT on timeout, or
+ * ERR_OBJECT_DESTROYED if the rwlock was destroyed while waiting.
+ */
+status_t rwlock_acquire_write_timeout(rwlock_t *rw, lk_time_t timeout)
+{
+    DEBUG_ASSERT(rw->magic == RWLOCK_MAGIC);
+
+    uint32_t old = 0;
+    if (__atomic_compare_exchange_n(&rw->state, &old, RWLOCK_WRITER, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return NO_ERROR;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&rw->read_wait.lock, state);
+
+    old = rwlock_lock_state(rw);
+    if (!(old & (RWLOCK_WRITER | RWLOCK_READERS_MASK))) {
+        rwlock_set_state(rw, RWLOCK_WRITER);
+        spin_unlock_irqrestore(&rw->read_wait.lock, state);
+        return NO_ERROR;
+    }
+    if (timeout == 0) {
+        rwlock_set_state(rw, old);
+        spin_unlock_irqrestore(&rw->read_wait.lock, state);
+        return ERR_TIMED_OUT;
+    }
+
+    rw->writers_waiting++;
+    thread_lock_ints_disabled();
+    status_t ret = wait_queue_block_unlock(&rw->write_wait, timeout,
+                                           &rw->read_wait.lock);
+    thread_unlock_ints_disabled();
+
+    if (ret == ERR_TIMED_OUT) {
+        spin_lock(&rw->read_wait.lock);
+        rw->writers_waiting--;
+        old = rw->state;
+        /*
+         * Readers may have queued behind us while the lock was held by other
+         * readers. Let them in now that no writer waits in front of them.
+         */
+        if (!(old & RWLOCK_WRITER) && !rw->writers_waiting) {
+            thread_lock_ints_disabled();
+            if (rw->read_wait.count) {
+                rwlock_wake_readers_unlock(rw, old, rw->read_wait.count);
+            } else {
+                rwlock_set_state(rw, old);
+                spin_unlock(&rw->read_wait.lock);
+            }
+            thread_unlock_ints_disabled();
+        } else {
+            rwlock_set_state(rw, old);
+            spin_unlock(&rw->read_wait.lock);
+        }
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+    return ret;
+}
+
+/**
+ * @brief  Release a rwlock held for reading
+ */
+void rwlock_release_read(rwlock_t *rw)
+{
+    DEBUG_ASSERT(rw->magic == RWLOCK_MAGIC);
+
+    uint32_t old = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+    while (!(old & RWLOCK_WAITERS)) {
+        DEBUG_ASSERT(!(old & RWLOCK_WRITER) && (old & RWLOCK_READERS_MASK));
+        if (__atomic_compare_exchange_n(&rw->state, &old, old - 1, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return;
+    }
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&rw->read_wait.lock, state);
+
+    old = rwlock_lock_state(rw);
+    DEBUG_ASSERT(!(old & RWLOCK_WRITER) && (old & RWLOCK_READERS_MASK));
+    if ((old & RWLOCK_READERS_MASK) == 1) {
+        __atomic_store_n(&rw->state, RWLOCK_WAITERS, __ATOMIC_RELEASE);
+        rwlock_wake_unlock(rw);
+    } else {
+        rwlock_set_state(rw, old - 1);
+        spin_unlock(&rw->read_wait.lock);
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+/**
+ * @brief  Release a rwlock held for writing
+ */
+void rwlock_release_write(rwlock_t *rw)
+{
+    DEBUG_ASSERT(rw->magic == RWLOCK_MAGIC);
+
+    uint32_t old = RWLOCK_WRITER;
+    if (__atomic_compare_exchange_n(&rw->state, &old, 0, false,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        return;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&rw->read_wait.lock, state);
+
+    old = rwlock_lock_state(rw);
+    DEBUG_ASSERT(old & RWLOCK_WRITER);
+    __atomic_store_n(&rw->state, RWLOCK_WAITERS, __ATOMIC_RELEASE);
+    rwlock_wake_unlock(rw);
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+/* @} */
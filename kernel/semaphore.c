@@ -24,76 +24,106 @@ void sem_init(semaphore_t *sem, unsigned int value)
     *sem = (semaphore_t)SEMAPHORE_INITIAL_VALUE(*sem, value);
 }
 
+/*
+ * The count is protected by the lock embedded in the semaphore's wait queue.
+ * The thread lock is only taken, nested inside it, when a thread has to block
+ * or there is a waiter to wake.
+ */
+
 void sem_destroy(semaphore_t *sem)
 {
-    THREAD_LOCK(state);
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&sem->wait.lock, state);
     sem->count = 0;
-    wait_queue_destroy(&sem->wait, true);
-    THREAD_UNLOCK(state);
+    thread_lock_ints_disabled();
+    wait_queue_destroy_unlock(&sem->wait, true, &sem->wait.lock);
+    thread_unlock_ints_disabled();
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 }
 
 int sem_post(semaphore_t *sem, bool resched)
 {
     int ret = 0;
 
-    THREAD_LOCK(state);
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&sem->wait.lock, state);
 
     /*
      * If the count is or was negative then a thread is waiting for a resource, otherwise
      * it's safe to just increase the count available with no downsides
      */
-    if (unlikely(++sem->count <= 0))
-        ret = wait_queue_wake_one(&sem->wait, resched, NO_ERROR);
+    if (unlikely(++sem->count <= 0)) {
+        thread_lock_ints_disabled();
+        ret = wait_queue_wake_one_unlock(&sem->wait, resched, NO_ERROR,
+                                         &sem->wait.lock);
+        thread_unlock_ints_disabled();
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+    } else {
+        spin_unlock_irqrestore(&sem->wait.lock, state);
+    }
 
-    THREAD_UNLOCK(state);
+    return ret;
+}
 
+static status_t sem_block(semaphore_t *sem, lk_time_t timeout,
+                          spin_lock_saved_state_t state)
+{
+    status_t ret;
+
+    thread_lock_ints_disabled();
+    ret = wait_queue_block_unlock(&sem->wait, timeout, &sem->wait.lock);
+    thread_unlock_ints_disabled();
+
+    if (ret == ERR_TIMED_OUT) {
+        /* give back the resource we were waiting for */
+        spin_lock(&sem->wait.lock);
+        sem->count++;
+        spin_unlock(&sem->wait.lock);
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
     return ret;
 }
 
 status_t sem_wait(semaphore_t *sem)
 {
-    status_t ret = NO_ERROR;
-    THREAD_LOCK(state);
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&sem->wait.lock, state);
 
     /*
      * If there are no resources available then we need to
      * sit in the wait queue until sem_post adds some.
      */
     if (unlikely(--sem->count < 0))
-        ret = wait_queue_block(&sem->wait, INFINITE_TIME);
+        return sem_block(sem, INFINITE_TIME, state);
 
-    THREAD_UNLOCK(state);
-    return ret;
+    spin_unlock_irqrestore(&sem->wait.lock, state);
+    return NO_ERROR;
 }
 
 status_t sem_trywait(semaphore_t *sem)
 {
     status_t ret = NO_ERROR;
-    THREAD_LOCK(state);
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&sem->wait.lock, state);
 
     if (unlikely(sem->count <= 0))
         ret = ERR_NOT_READY;
     else
         sem->count--;
 
-    THREAD_UNLOCK(state);
+    spin_unlock_irqrestore(&sem->wait.lock, state);
     return ret;
 }
 
 status_t sem_timedwait(semaphore_t *sem, lk_time_t timeout)
 {
-    status_t ret = NO_ERROR;
-    THREAD_LOCK(state);
-
-    if (unlikely(--sem->count < 0)) {
-        ret = wait_queue_block(&sem->wait, timeout);
-        if (ret < NO_ERROR) {
-            if (ret == ERR_TIMED_OUT) {
-                sem->count++;
-            }
-        }
-    }
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&sem->wait.lock, state);
 
-    THREAD_UNLOCK(state);
-    return ret;
+    if (unlikely(--sem->count < 0))
+        return sem_block(sem, timeout, state);
+
+    spin_unlock_irqrestore(&sem->wait.lock, state);
+    return NO_ERROR;
 }
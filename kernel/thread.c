@@ -42,6 +42,8 @@
 #include <kernel/timer.h>
 #include <kernel/debug.h>
 #include <kernel/mp.h>
+#include <kernel/mutex.h>
+#include <kernel/rcu.h>
 #include <platform.h>
 #include <target.h>
 #include <lib/heap.h>
@@ -50,7 +52,7 @@
 #endif
 
 #if THREAD_STATS
-struct thread_stats thread_stats[SMP_MAX_CPUS];
+DEFINE_PER_CPU_DECLARED(struct thread_stats, thread_stats);
 #endif
 
 #define STACK_DEBUG_BYTE (0x99)
@@ -63,20 +65,71 @@ struct thread_stats thread_stats[SMP_MAX_CPUS];
 /* global thread list */
 static struct list_node thread_list;
 
-/* master thread spinlock */
+/*
+ * Master thread spinlock. Still global: it protects every run queue, the list
+ * and count of every wait queue and the state of every thread, so blocking,
+ * waking and stealing serialize on it across cpus. Only the state of objects
+ * built on wait queues moved to their own locks (see wait.h). The lock is
+ * handed across context switches to the new thread (see initial_thread_func)
+ * and taken directly around wait_queue_block() outside this file, so per-cpu
+ * run queue locks would need both reworked.
+ */
 spin_lock_t thread_lock = SPIN_LOCK_INITIAL_VALUE;
 
 atomic_uint thread_lock_owner = SMP_MAX_CPUS;
 
-/* the run queue */
-static struct list_node run_queue[NUM_PRIORITIES];
-static uint32_t run_queue_bitmap;
+/*
+ * The per-cpu run queues, protected by the global thread lock. A ready thread
+ * lives on exactly one of these, the one of its pinned cpu if it has one.
+ * Each queue has its own priority bitmap so a cpu picking its next thread only
+ * looks at its own cache line, and at run_queue_waiting_cpus to find other
+ * queues worth stealing from (see get_top_thread()).
+ */
+struct run_queue {
+    struct list_node queue[NUM_PRIORITIES];
+    uint32_t bitmap;
+    struct list_node deadline_queue; /* deadline threads, earliest first */
+    struct list_node throttled_queue; /* threads out of cpu quota */
+    uint count; /* number of threads queued, for load balancing */
+};
+
+static DEFINE_PER_CPU(struct run_queue, run_queues);
+
+#if WITH_SMP
+/*
+ * Cpus with a non-empty run queue bitmap, protected by the thread lock. Only
+ * written when a bitmap becomes empty or non-empty, so cpus scheduling from
+ * their own queue keep reading a clean cache line.
+ */
+static mp_cpu_mask_t run_queue_waiting_cpus;
+#endif
 
 /* make sure the bitmap is large enough to cover our number of priorities */
-STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue_bitmap) * 8);
+STATIC_ASSERT(NUM_PRIORITIES <= sizeof(((struct run_queue *)0)->bitmap) * 8);
 
 /* Priority of current thread running on cpu, or last signalled */
-static int cpu_priority[SMP_MAX_CPUS];
+static DEFINE_PER_CPU(int, cpu_priority);
+
+/*
+ * Deadline threads run ahead of every priority, they show up in cpu_priority
+ * above the highest one.
+ */
+#define DEADLINE_CPU_PRIORITY NUM_PRIORITIES
+
+/*
+ * Bandwidth reserved by deadline threads on each cpu, as a fraction of
+ * 1 << THREAD_DEADLINE_BW_SHIFT. Admission control keeps it below
+ * THREAD_DEADLINE_MAX_UTIL percent, leaving the rest to priority scheduled
+ * threads.
+ */
+#ifndef THREAD_DEADLINE_MAX_UTIL
+#define THREAD_DEADLINE_MAX_UTIL 90
+#endif
+#define THREAD_DEADLINE_BW_SHIFT 20
+#define THREAD_DEADLINE_MAX_BW \
+    (((uint64_t)THREAD_DEADLINE_MAX_UTIL << THREAD_DEADLINE_BW_SHIFT) / 100)
+
+static uint32_t deadline_cpu_bw[SMP_MAX_CPUS];
 
 /* the idle thread(s) (statically allocated) */
 #if WITH_SMP
@@ -97,29 +150,263 @@ static void thread_resched(void);
 static void idle_thread_routine(void) __NO_RETURN;
 static enum handler_return thread_timer_callback(struct timer *t,
                                                  lk_time_ns_t now, void *arg);
+static void thread_mp_reschedule(thread_t *current_thread, thread_t *t);
+#if WITH_SMP
+static void thread_cpu_constraints_changed(thread_t *t);
+#endif
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-/* preemption timer */
-static timer_t preempt_timer[SMP_MAX_CPUS];
+/*
+ * preemption timer, only armed while a thread that can preempt the current one
+ * is waiting in the cpu's run queue (see thread_update_preempt_timer())
+ */
+static DEFINE_PER_CPU(timer_t, preempt_timer);
+static DEFINE_PER_CPU(bool, preempt_timer_armed);
+/* when a running deadline thread runs out of budget, 0 for the periodic tick */
+static DEFINE_PER_CPU(lk_time_ns_t, preempt_timer_budget_end);
+
+static void thread_update_preempt_timer(uint cpu, thread_t *current_thread);
+#endif
+
+#if WITH_SMP
+/*
+ * Load balancer tunables. A cpu with threads waiting in its run queue runs the
+ * balancer every THREAD_BALANCE_INTERVAL_MS. Waiting threads are only moved to
+ * a cpu whose load is at least THREAD_BALANCE_IMBALANCE lower, and at most
+ * THREAD_BALANCE_MAX_MOVES of them per run.
+ */
+#ifndef THREAD_BALANCE_INTERVAL_MS
+#define THREAD_BALANCE_INTERVAL_MS 20
+#endif
+#ifndef THREAD_BALANCE_IMBALANCE
+#define THREAD_BALANCE_IMBALANCE 2
+#endif
+#ifndef THREAD_BALANCE_MAX_MOVES
+#define THREAD_BALANCE_MAX_MOVES 4
 #endif
 
+/* load balancer timer, only armed while the cpu's run queue is not empty */
+static DEFINE_PER_CPU(timer_t, balance_timer);
+static DEFINE_PER_CPU(bool, balance_timer_armed);
+
+static void thread_start_balance_timer(uint cpu);
+#endif
+
+/*
+ * Cpu quota timer, armed while threads are parked on the cpu's throttled queue
+ * for the end of the earliest of their periods, 0 if not armed.
+ */
+static DEFINE_PER_CPU(timer_t, quota_timer);
+static DEFINE_PER_CPU(lk_time_ns_t, quota_timer_expiry);
+
+static enum handler_return thread_quota_timer_callback(struct timer *t,
+                                                       lk_time_ns_t now,
+                                                       void *arg);
+
 #define US2NS(us) ((us) * 1000ULL)
 #define MS2NS(ms) (US2NS(ms) * 1000ULL)
 
+/* cpus in the same cluster share a cache */
+#ifdef SMP_CPU_CLUSTER_SHIFT
+#define cpu_cluster(cpu) ((uint)(cpu) >> SMP_CPU_CLUSTER_SHIFT)
+#else
+#define cpu_cluster(cpu) (0U)
+#endif
+
+#if WITH_SMP
+#define thread_rq_cpu(t) ((uint)(t)->rq_cpu)
+#define thread_set_rq_cpu(t,c) ((t)->rq_cpu = (c))
+#else
+#define thread_rq_cpu(t) (0U)
+#define thread_set_rq_cpu(t,c) do {} while(0)
+#endif
+
+static uint thread_select_run_queue(thread_t *t);
+
+static bool thread_is_deadline(thread_t *t)
+{
+    return !!(t->flags & THREAD_FLAG_DEADLINE);
+}
+
+/* the priority @t shows up as in cpu_priority while it runs or is signalled */
+static int thread_cpu_priority(thread_t *t)
+{
+    return thread_is_deadline(t) ? DEADLINE_CPU_PRIORITY : t->priority;
+}
+
+#if WITH_SMP
+/*
+ * cpus @t may currently run on. A deadline thread stays on the cpu it was
+ * admitted on, otherwise a pinned cpu overrides the affinity mask.
+ */
+static mp_cpu_mask_t thread_allowed_cpus(thread_t *t)
+{
+    if (thread_is_deadline(t))
+        return 1U << t->dl.cpu;
+    if (t->pinned_cpu >= 0)
+        return 1U << t->pinned_cpu;
+    return t->cpu_affinity;
+}
+
+static bool thread_can_run_on(thread_t *t, uint cpu)
+{
+    return thread_allowed_cpus(t) & (1U << cpu);
+}
+#endif
+
 /* run queue manipulation */
-static void insert_in_run_queue_head(thread_t *t)
+static int run_queue_top_priority(struct run_queue *rq)
 {
-    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+    if (!rq->bitmap)
+        return -1;
+    return sizeof(rq->bitmap) * 8 - 1 - __builtin_clz(rq->bitmap);
+}
+
+/* mark the queue of @priority threads of @rq, the run queue of @cpu, non-empty */
+static void run_queue_set_priority(struct run_queue *rq, uint cpu, int priority)
+{
+#if WITH_SMP
+    if (!rq->bitmap)
+        run_queue_waiting_cpus |= 1U << cpu;
+#endif
+    rq->bitmap |= (1U<<priority);
+}
+
+static void run_queue_delete(struct run_queue *rq, thread_t *t)
+{
+    list_delete(&t->queue_node);
+    if (t->quota.throttled)
+        return;
+    if (!thread_is_deadline(t) && list_is_empty(&rq->queue[t->priority])) {
+        rq->bitmap &= ~(1U<<t->priority);
+#if WITH_SMP
+        if (!rq->bitmap)
+            run_queue_waiting_cpus &= ~(1U << thread_rq_cpu(t));
+#endif
+    }
+    rq->count--;
+}
+
+/* queue deadline thread @t behind the threads with the same or an earlier deadline */
+static void run_queue_insert_deadline(struct run_queue *rq, thread_t *t)
+{
+    thread_t *entry;
+
+    list_for_every_entry(&rq->deadline_queue, entry, thread_t, queue_node) {
+        if (entry->dl.abs_deadline > t->dl.abs_deadline) {
+            list_add_before(&entry->queue_node, &t->queue_node);
+            return;
+        }
+    }
+    list_add_tail(&rq->deadline_queue, &t->queue_node);
+}
+
+/* earliest deadline thread in @rq that has budget left */
+static thread_t *run_queue_peek_deadline(struct run_queue *rq)
+{
+    thread_t *t;
+
+    list_for_every_entry(&rq->deadline_queue, t, thread_t, queue_node) {
+        if (!t->dl.throttled)
+            return t;
+    }
+    return NULL;
+}
+
+/*
+ * @t becomes ready after it blocked or slept. Start a new period, unless the
+ * budget it has left can still be used before its current deadline without
+ * exceeding its bandwidth.
+ */
+static void thread_deadline_wakeup(thread_t *t, lk_time_ns_t now)
+{
+    struct thread_deadline *dl = &t->dl;
+
+    if (dl->throttled)
+        return;
+
+    if (now < dl->abs_deadline &&
+        dl->budget * dl->deadline <= (dl->abs_deadline - now) * dl->runtime)
+        return;
+
+    dl->abs_deadline = now + dl->deadline;
+    dl->budget = dl->runtime;
+}
+
+/* deadline threads have their own budget, a cpu quota does not apply to them */
+static bool thread_has_quota(thread_t *t)
+{
+    return t->quota.runtime && !thread_is_deadline(t);
+}
+
+/* start a new quota period for @t if the current one is over */
+static void thread_quota_roll(thread_t *t, lk_time_ns_t now)
+{
+    struct thread_quota *q = &t->quota;
+
+    if (now < q->period_end)
+        return;
+
+    q->period_end += ((now - q->period_end) / q->period + 1) * q->period;
+    q->used = 0;
+}
+
+/* charge running thread @t for its cpu time, return true if its quota is used up */
+static bool thread_quota_charge(thread_t *t, lk_time_ns_t now)
+{
+    struct thread_quota *q = &t->quota;
+
+    thread_quota_roll(t, now);
+    q->used += now - q->start;
+    q->start = now;
+
+    return q->used >= q->runtime;
+}
+
+/*
+ * If @t has used up its cpu quota, park it on the local throttled queue
+ * instead of a run queue until its period ends, and return true. Parked
+ * threads are not visible to get_top_thread() or to other cpus looking for
+ * work.
+ */
+static bool thread_quota_park(thread_t *t)
+{
+    struct thread_quota *q = &t->quota;
+    uint cpu = arch_curr_cpu_num();
+
     DEBUG_ASSERT(t->state == THREAD_READY);
     DEBUG_ASSERT(!list_in_list(&t->queue_node));
-    DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(thread_lock_held());
 
-    list_add_head(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1U<<t->priority);
+    if (!thread_has_quota(t))
+        return false;
+
+    if (!q->throttled) {
+        thread_quota_roll(t, current_time_ns());
+        if (q->used < q->runtime)
+            return false;
+        THREAD_STATS_INC(quota_throttles);
+        q->throttled = true;
+    }
+
+    thread_set_rq_cpu(t, cpu);
+    list_add_tail(&per_cpu(run_queues, cpu).throttled_queue, &t->queue_node);
+
+    if (!per_cpu(quota_timer_expiry, cpu) ||
+        q->period_end < per_cpu(quota_timer_expiry, cpu)) {
+        lk_time_ns_t now = current_time_ns();
+
+        if (per_cpu(quota_timer_expiry, cpu))
+            timer_cancel(&per_cpu(quota_timer, cpu));
+        timer_set_oneshot_ns(&per_cpu(quota_timer, cpu),
+                             q->period_end > now ? q->period_end - now : 0,
+                             thread_quota_timer_callback, NULL);
+        per_cpu(quota_timer_expiry, cpu) = q->period_end;
+    }
+    return true;
 }
 
-static void insert_in_run_queue_tail(thread_t *t)
+static struct run_queue *insert_in_run_queue_prepare(thread_t *t)
 {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(t->state == THREAD_READY);
@@ -127,14 +414,99 @@ static void insert_in_run_queue_tail(thread_t *t)
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(thread_lock_held());
 
-    list_add_tail(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+    uint cpu = thread_select_run_queue(t);
+    thread_set_rq_cpu(t, cpu);
+
+    if (thread_is_deadline(t) && t != get_current_thread())
+        thread_deadline_wakeup(t, current_time_ns());
+
+#if THREAD_STATS
+    /* a thread moved between queues keeps waiting since it first got ready */
+    if (!t->stats_ready_time) {
+        t->stats_ready_time = current_time_ns();
+        t->stats_woken = t != get_current_thread();
+    }
+#endif
+
+    return &per_cpu(run_queues, cpu);
+}
+
+/*
+ * A thread was added to @rq. If it competes with the thread running on this
+ * cpu, make sure the preemption timer is running. A thread queued on another
+ * cpu that can preempt that cpu's thread gets there via thread_mp_reschedule().
+ */
+static void insert_in_run_queue_finish(struct run_queue *rq, thread_t *t)
+{
+    uint cpu = arch_curr_cpu_num();
+    thread_t *current_thread = get_current_thread();
+
+    rq->count++;
+
+    if (rq != &per_cpu(run_queues, cpu) || t == current_thread)
+        return;
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    if (t->priority >= current_thread->priority || thread_is_deadline(t))
+        thread_update_preempt_timer(cpu, current_thread);
+#endif
+#if WITH_SMP
+    thread_start_balance_timer(cpu);
+#endif
+}
+
+static void insert_in_run_queue_head(thread_t *t)
+{
+    if (thread_quota_park(t))
+        return;
+
+    struct run_queue *rq = insert_in_run_queue_prepare(t);
+
+    if (thread_is_deadline(t)) {
+        run_queue_insert_deadline(rq, t);
+    } else {
+        list_add_head(&rq->queue[t->priority], &t->queue_node);
+        run_queue_set_priority(rq, thread_rq_cpu(t), t->priority);
+    }
+    insert_in_run_queue_finish(rq, t);
+}
+
+static void insert_in_run_queue_tail(thread_t *t)
+{
+    if (thread_quota_park(t))
+        return;
+
+    struct run_queue *rq = insert_in_run_queue_prepare(t);
+
+    if (thread_is_deadline(t)) {
+        run_queue_insert_deadline(rq, t);
+    } else {
+        list_add_tail(&rq->queue[t->priority], &t->queue_node);
+        run_queue_set_priority(rq, thread_rq_cpu(t), t->priority);
+    }
+    insert_in_run_queue_finish(rq, t);
+}
+
+static void remove_from_run_queue(thread_t *t)
+{
+    DEBUG_ASSERT(t->state == THREAD_READY);
+    DEBUG_ASSERT(list_in_list(&t->queue_node));
+    DEBUG_ASSERT(thread_lock_held());
+
+    run_queue_delete(&per_cpu(run_queues, thread_rq_cpu(t)), t);
 }
 
 static void init_thread_struct(thread_t *t, const char *name)
 {
     memset(t, 0, sizeof(thread_t));
     t->magic = THREAD_MAGIC;
+    list_initialize(&t->pi_mutexes);
+    timer_initialize(&t->dl.replenish_timer);
+    timer_initialize(&t->wait_timer);
+#if WITH_SMP
+    t->cpu_affinity = MP_CPU_MASK_ALL;
+    t->last_cpu = -1;
+#endif
     thread_set_pinned_cpu(t, -1);
     strlcpy(t->name, name, sizeof(t->name));
 }
@@ -213,6 +585,7 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
     t->entry = entry;
     t->arg = arg;
     t->priority = priority;
+    t->base_priority = priority;
     t->state = THREAD_SUSPENDED;
     t->blocking_wait_queue = NULL;
     t->wait_queue_block_ret = NO_ERROR;
@@ -305,13 +678,13 @@ status_t thread_set_real_time(thread_t *t)
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
 
     THREAD_LOCK(state);
+    t->flags |= THREAD_FLAG_REAL_TIME;
 #if PLATFORM_HAS_DYNAMIC_TIMER
     if (t == get_current_thread()) {
         /* if we're currently running, cancel the preemption timer. */
-        timer_cancel(&preempt_timer[arch_curr_cpu_num()]);
+        thread_update_preempt_timer(arch_curr_cpu_num(), t);
     }
 #endif
-    t->flags |= THREAD_FLAG_REAL_TIME;
     THREAD_UNLOCK(state);
 
     return NO_ERROR;
@@ -332,42 +705,397 @@ static bool thread_is_real_time_or_idle(thread_t *t)
     return !!(t->flags & (THREAD_FLAG_REAL_TIME | THREAD_FLAG_IDLE));
 }
 
+/* timer callback starting the next period of a throttled deadline thread */
+static enum handler_return thread_deadline_replenish(timer_t *timer,
+                                                     lk_time_ns_t now,
+                                                     void *arg)
+{
+    thread_t *t = (thread_t *)arg;
+    enum handler_return ret = INT_NO_RESCHEDULE;
+
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+
+    THREAD_LOCK(state);
+    if (thread_is_deadline(t) && t->dl.throttled) {
+        t->dl.throttled = false;
+        t->dl.abs_deadline += t->dl.period;
+        t->dl.budget = t->dl.runtime;
+        if (t->state == THREAD_READY) {
+            /* requeue at its new deadline */
+            remove_from_run_queue(t);
+            insert_in_run_queue_head(t);
+            thread_mp_reschedule(get_current_thread(), t);
+            ret = INT_RESCHEDULE;
+        }
+    }
+    THREAD_UNLOCK(state);
+
+    return ret;
+}
+
+/*
+ * Charge deadline thread @t for the time it ran since it was last charged.
+ * A thread that used up its budget is throttled until its next period starts.
+ * Called from thread_resched() on the cpu @t ran on, so the replenish timer
+ * always runs on the thread's cpu.
+ */
+static void thread_deadline_charge(thread_t *t, lk_time_ns_t now)
+{
+    struct thread_deadline *dl = &t->dl;
+    lk_time_ns_t ran = now - dl->start;
+    lk_time_ns_t next_period;
+
+    DEBUG_ASSERT(thread_lock_held());
+
+    dl->start = now;
+    if (ran < dl->budget) {
+        dl->budget -= ran;
+        return;
+    }
+
+    dl->budget = 0;
+    next_period = dl->abs_deadline - dl->deadline + dl->period;
+    if (next_period <= now) {
+        /* the period is already over, start a new one right away */
+        dl->abs_deadline = now + dl->deadline;
+        dl->budget = dl->runtime;
+        return;
+    }
+
+    THREAD_STATS_INC(deadline_throttles);
+    dl->throttled = true;
+    timer_set_oneshot_ns(&dl->replenish_timer, next_period - now,
+                         thread_deadline_replenish, t);
+}
+
+/* pick a cpu @t may run on with @bw left, the least loaded one first */
+static int thread_deadline_select_cpu(thread_t *t, uint32_t bw)
+{
+#if WITH_SMP
+    mp_cpu_mask_t allowed = t->pinned_cpu >= 0 ? 1U << t->pinned_cpu :
+                                                 t->cpu_affinity;
+    int best_cpu = -1;
+
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!(allowed & (1U << i)) || !mp_is_cpu_active(i) ||
+            deadline_cpu_bw[i] + bw > THREAD_DEADLINE_MAX_BW)
+            continue;
+        if (best_cpu < 0 || deadline_cpu_bw[i] < deadline_cpu_bw[best_cpu])
+            best_cpu = i;
+    }
+    return best_cpu;
+#else
+    return deadline_cpu_bw[0] + bw <= THREAD_DEADLINE_MAX_BW ? 0 : -1;
+#endif
+}
+
+/**
+ * thread_set_deadline() - Move a thread to the earliest deadline first class.
+ * @t:        Thread to update.
+ * @runtime:  Cpu time per period, 0 to leave the class.
+ * @deadline: Deadline relative to the start of each period.
+ * @period:   Period.
+ *
+ * Return: %NO_ERROR on success, or an error code if @t could not be admitted.
+ */
+status_t thread_set_deadline(thread_t *t, lk_time_ns_t runtime,
+                             lk_time_ns_t deadline, lk_time_ns_t period)
+{
+    status_t ret = NO_ERROR;
+    thread_t *current_thread = get_current_thread();
+    uint32_t bw = 0;
+
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+    DEBUG_ASSERT(!thread_lock_held());
+
+    if (runtime && (runtime > deadline || deadline > period ||
+                    period > THREAD_DEADLINE_MAX_PERIOD))
+        return ERR_INVALID_ARGS;
+
+    if (thread_is_idle(t))
+        return ERR_INVALID_ARGS;
+
+    /* a replenish callback that already ran may not have returned yet */
+    if (t == current_thread && thread_is_deadline(t))
+        timer_cancel_sync(&t->dl.replenish_timer);
+
+    if (runtime)
+        bw = (runtime << THREAD_DEADLINE_BW_SHIFT) / deadline;
+
+    THREAD_LOCK(state);
+
+    if (t != current_thread && t->state != THREAD_SUSPENDED) {
+        ret = ERR_BAD_STATE;
+        goto done;
+    }
+
+    if (thread_is_deadline(t))
+        deadline_cpu_bw[t->dl.cpu] -= t->dl.bw;
+
+    if (runtime) {
+        int cpu = thread_deadline_select_cpu(t, bw);
+        if (cpu < 0) {
+            if (thread_is_deadline(t))
+                deadline_cpu_bw[t->dl.cpu] += t->dl.bw;
+            ret = ERR_NO_RESOURCES;
+            goto done;
+        }
+        deadline_cpu_bw[cpu] += bw;
+
+        t->dl.runtime = runtime;
+        t->dl.deadline = deadline;
+        t->dl.period = period;
+        t->dl.bw = bw;
+        t->dl.cpu = cpu;
+        t->dl.throttled = false;
+        if (t == current_thread) {
+            lk_time_ns_t now = current_time_ns();
+            t->dl.start = now;
+            t->dl.abs_deadline = now + deadline;
+            t->dl.budget = runtime;
+        } else {
+            /* a new period starts when the thread is resumed */
+            t->dl.abs_deadline = 0;
+            t->dl.budget = 0;
+        }
+        t->flags |= THREAD_FLAG_DEADLINE;
+    } else {
+        t->flags &= ~THREAD_FLAG_DEADLINE;
+        t->dl.throttled = false;
+    }
+
+    if (t == current_thread) {
+        this_cpu(cpu_priority) = thread_cpu_priority(t);
+#if PLATFORM_HAS_DYNAMIC_TIMER
+        thread_update_preempt_timer(arch_curr_cpu_num(), t);
+#endif
+#if WITH_SMP
+        /* move to the cpu we were admitted on */
+        thread_cpu_constraints_changed(t);
+#endif
+    }
+
+done:
+    THREAD_UNLOCK(state);
+
+    return ret;
+}
+
+/* timer callback moving threads whose quota period ended back to the run queues */
+static enum handler_return thread_quota_timer_callback(timer_t *timer,
+                                                       lk_time_ns_t now,
+                                                       void *arg)
+{
+    uint cpu = arch_curr_cpu_num();
+    struct run_queue *rq = &per_cpu(run_queues, cpu);
+    enum handler_return ret = INT_NO_RESCHEDULE;
+    lk_time_ns_t next_expiry = 0;
+    thread_t *t, *temp;
+
+    THREAD_LOCK(state);
+    per_cpu(quota_timer_expiry, cpu) = 0;
+    now = current_time_ns();
+
+    list_for_every_entry_safe(&rq->throttled_queue, t, temp, thread_t, queue_node) {
+        if (now < t->quota.period_end) {
+            if (!next_expiry || t->quota.period_end < next_expiry)
+                next_expiry = t->quota.period_end;
+            continue;
+        }
+
+        list_delete(&t->queue_node);
+        t->quota.throttled = false;
+        insert_in_run_queue_head(t);
+        thread_mp_reschedule(get_current_thread(), t);
+        ret = INT_RESCHEDULE;
+    }
+
+    if (next_expiry && !per_cpu(quota_timer_expiry, cpu)) {
+        timer_set_oneshot_ns(&per_cpu(quota_timer, cpu), next_expiry - now,
+                             thread_quota_timer_callback, NULL);
+        per_cpu(quota_timer_expiry, cpu) = next_expiry;
+    }
+    THREAD_UNLOCK(state);
+
+    return ret;
+}
+
+/**
+ * thread_set_cpu_quota() - Limit the cpu time of a thread.
+ * @t:       Thread to limit.
+ * @runtime: Cpu time per period, 0 to remove the limit.
+ * @period:  Period.
+ *
+ * Return: %NO_ERROR on success, %ERR_INVALID_ARGS if the parameters are
+ * inconsistent.
+ */
+status_t thread_set_cpu_quota(thread_t *t, lk_time_ns_t runtime,
+                              lk_time_ns_t period)
+{
+    thread_t *current_thread = get_current_thread();
+    bool unpark = false;
+
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+    DEBUG_ASSERT(!thread_lock_held());
+
+    if (runtime && (!period || runtime > period))
+        return ERR_INVALID_ARGS;
+
+    if (thread_is_idle(t))
+        return ERR_INVALID_ARGS;
+
+    THREAD_LOCK(state);
+
+    if (t->quota.throttled) {
+        remove_from_run_queue(t);
+        t->quota.throttled = false;
+        unpark = true;
+    }
+
+    lk_time_ns_t now = current_time_ns();
+    t->quota.runtime = runtime;
+    t->quota.period = period;
+    t->quota.period_end = now + period;
+    t->quota.used = 0;
+    t->quota.start = now;
+
+    if (unpark) {
+        insert_in_run_queue_head(t);
+        thread_mp_reschedule(current_thread, t);
+    }
+
+    if (t == current_thread) {
+#if PLATFORM_HAS_DYNAMIC_TIMER
+        /* the tick enforces the quota */
+        thread_update_preempt_timer(arch_curr_cpu_num(), t);
+#endif
+    } else if (t->state == THREAD_RUNNING) {
+#if WITH_SMP
+        /* let its cpu start the tick */
+        mp_reschedule(1UL << (uint)t->curr_cpu, 0);
+#endif
+    }
+
+    THREAD_UNLOCK(state);
+
+    return NO_ERROR;
+}
+
+/*
+ * Pick the run queue a thread that is becoming ready should be placed on.
+ *
+ * Pinned threads always go to their pinned cpu and the current thread stays on
+ * the local cpu if its affinity allows. Other threads, among the active cpus in
+ * their affinity mask, prefer in order:
+ * - the cpu they last ran on, if it is idle or running lower priority work,
+ *   since their data is most likely still in its cache,
+ * - an idle cpu in the same cluster as that cpu, which shares its cache,
+ * - the cpu with the lowest priority work if they would preempt it.
+ * Otherwise they stay local, if allowed, where any cpu that runs out of work
+ * can steal them.
+ */
+static uint thread_select_run_queue(thread_t *t)
+{
+#if WITH_SMP
+    uint cpu = arch_curr_cpu_num();
+    mp_cpu_mask_t allowed = thread_allowed_cpus(t);
+    bool local_allowed = allowed & (1U << cpu);
+    uint best_cpu = ~0U;
+    int best_cpu_priority = INT_MAX;
+
+    if (thread_is_deadline(t))
+        return (uint)t->dl.cpu;
+
+    if (t->pinned_cpu >= 0)
+        return (uint)t->pinned_cpu;
+
+    if (local_allowed && t == get_current_thread())
+        return cpu;
+
+    int last_cpu = t->last_cpu;
+    if (last_cpu >= 0 && (allowed & (1U << last_cpu)) &&
+        mp_is_cpu_active(last_cpu)) {
+        if (per_cpu(cpu_priority, last_cpu) < t->priority)
+            return last_cpu;
+
+        for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+            if (!mp_is_cpu_active(i) || !(allowed & (1U << i)) ||
+                cpu_cluster(i) != cpu_cluster(last_cpu))
+                continue;
+
+            /* skip idle cpus already signalled to run something else */
+            if (mp_is_cpu_idle(i) && per_cpu(cpu_priority, i) < t->priority)
+                return i;
+        }
+    }
+
+    if (local_allowed) {
+        best_cpu = cpu;
+        best_cpu_priority = per_cpu(cpu_priority, cpu);
+    }
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!mp_is_cpu_active(i) || !(allowed & (1U << i)))
+            continue;
+
+        if (per_cpu(cpu_priority, i) < best_cpu_priority) {
+            best_cpu = i;
+            best_cpu_priority = per_cpu(cpu_priority, i);
+        }
+    }
+
+    if (best_cpu == ~0U) {
+        /* none of its cpus are up yet, wait on the first one */
+        DEBUG_ASSERT(allowed);
+        return __builtin_ctz(allowed);
+    }
+
+    if (t->priority > best_cpu_priority || !local_allowed)
+        return best_cpu;
+
+    return cpu;
+#else
+    return 0;
+#endif
+}
+
 static mp_cpu_mask_t thread_get_mp_reschedule_target(thread_t *current_thread, thread_t *t)
 {
 #if WITH_SMP
     uint cpu = arch_curr_cpu_num();
     uint target_cpu;
 
-    if (t->pinned_cpu != -1 && current_thread->pinned_cpu == t->pinned_cpu)
+    /* only a thread sitting in a run queue can need another cpu to run it */
+    if (t->state != THREAD_READY)
         return 0;
 
-    if (t->pinned_cpu == -1 || (uint)t->pinned_cpu == cpu)
+    target_cpu = thread_rq_cpu(t);
+    DEBUG_ASSERT(thread_can_run_on(t, target_cpu));
+    if (target_cpu == cpu)
         return 0;
 
-    target_cpu = (uint)t->pinned_cpu;
-
-    if (t->priority < cpu_priority[target_cpu]) {
+    if (thread_cpu_priority(t) < per_cpu(cpu_priority, target_cpu)) {
         /*
-         * The thread is pinned to a cpu that is already running, or has already
+         * The thread is queued on a cpu that is already running, or has already
          * been signalled to run, a higher priority thread. No ipi is needed.
          */
 #if DEBUG_THREAD_CPU_WAKE
         dprintf(ALWAYS, "%s: cpu %d, don't wake cpu %d, priority %d for priority %d thread (current priority %d)\n",
-            __func__, cpu, target_cpu, cpu_priority[target_cpu], t->priority, current_thread->priority);
+            __func__, cpu, target_cpu, per_cpu(cpu_priority, target_cpu), t->priority, current_thread->priority);
 #endif
         return 0;
     }
 
 #if DEBUG_THREAD_CPU_WAKE
     dprintf(ALWAYS, "%s: cpu %d, wake cpu %d, priority %d for priority %d thread (current priority %d)\n",
-        __func__, cpu, target_cpu, cpu_priority[target_cpu], t->priority, current_thread->priority);
+        __func__, cpu, target_cpu, per_cpu(cpu_priority, target_cpu), t->priority, current_thread->priority);
 #endif
     /*
      * Pretend the target CPU is already running the thread so we don't send it
      * another ipi for a lower priority thread. This is most important if that
      * thread can run on another CPU instead.
      */
-    cpu_priority[target_cpu] = t->priority;
+    per_cpu(cpu_priority, target_cpu) = thread_cpu_priority(t);
 
     return 1UL << target_cpu;
 #else
@@ -549,6 +1277,10 @@ void thread_exit(int retcode)
 
 //  dprintf("thread_exit: current %p\n", current_thread);
 
+    /* release the bandwidth reserved for us */
+    if (thread_is_deadline(current_thread))
+        thread_set_deadline(current_thread, 0, 0, 0);
+
     THREAD_LOCK(state);
 
     /* enter the dead state */
@@ -579,48 +1311,141 @@ __WEAK void platform_idle(void)
     arch_idle();
 }
 
+#if THREAD_STATS
+static void thread_hist_add(struct thread_hist *hist, lk_time_ns_t duration)
+{
+    uint bucket = 0;
+
+    if (duration >> 11)
+        bucket = MIN(63 - __builtin_clzll(duration) - 10, THREAD_HIST_BUCKETS - 1);
+    hist->count[bucket]++;
+    if (duration > hist->max)
+        hist->max = duration;
+}
+
+/* account the time @oldthread ran and @newthread waited to @cpu and the threads */
+static void thread_sched_hist_switch(uint cpu, thread_t *oldthread,
+                                     thread_t *newthread, lk_time_ns_t now)
+{
+    struct thread_sched_hist *cpu_hist = &per_cpu(thread_stats, cpu).sched_hist;
+
+    if (!thread_is_idle(oldthread)) {
+        lk_time_ns_t slice = now - oldthread->stats_run_time;
+        thread_hist_add(&cpu_hist->run_slice, slice);
+        thread_hist_add(&oldthread->sched_hist.run_slice, slice);
+    }
+
+    if (thread_is_idle(newthread))
+        return;
+
+    newthread->stats_run_time = now;
+    if (newthread->stats_ready_time) {
+        lk_time_ns_t wait = now - newthread->stats_ready_time;
+        thread_hist_add(&cpu_hist->runnable_wait, wait);
+        thread_hist_add(&newthread->sched_hist.runnable_wait, wait);
+        if (newthread->stats_woken) {
+            thread_hist_add(&cpu_hist->wakeup_latency, wait);
+            thread_hist_add(&newthread->sched_hist.wakeup_latency, wait);
+        }
+        newthread->stats_ready_time = 0;
+    }
+}
+#endif
+
 static void idle_thread_routine(void)
 {
     for (;;)
         platform_idle();
 }
 
-static thread_t *get_top_thread(int cpu, bool unlink)
+/*
+ * Return the highest priority thread of at least @min_priority in @rq that may
+ * run on @cpu, or that is not pinned to a single cpu if @cpu is -1.
+ */
+static thread_t *run_queue_peek(struct run_queue *rq, int cpu, int min_priority)
 {
-    thread_t *newthread;
-    uint32_t local_run_queue_bitmap = run_queue_bitmap;
+    thread_t *t;
+    uint32_t bitmap = rq->bitmap;
 
-    while (local_run_queue_bitmap) {
+    while (bitmap) {
         /* find the first (remaining) queue with a thread in it */
-        uint next_queue = sizeof(run_queue_bitmap) * 8 - 1 - __builtin_clz(local_run_queue_bitmap);
+        int next_queue = sizeof(bitmap) * 8 - 1 - __builtin_clz(bitmap);
 
-        list_for_every_entry(&run_queue[next_queue], newthread, thread_t, queue_node) {
+        if (next_queue < min_priority)
+            break;
+
+        list_for_every_entry(&rq->queue[next_queue], t, thread_t, queue_node) {
 #if WITH_SMP
-            if (newthread->pinned_cpu < 0 || newthread->pinned_cpu == cpu)
+            if (cpu < 0 ? t->pinned_cpu < 0 : thread_can_run_on(t, cpu))
 #endif
-            {
-                if (unlink) {
-                    list_delete(&newthread->queue_node);
+                return t;
+        }
 
-                    if (list_is_empty(&run_queue[next_queue]))
-                        run_queue_bitmap &= ~(1U<<next_queue);
-                }
+        bitmap &= ~(1U<<next_queue);
+    }
 
-                return newthread;
-            }
+    return NULL;
+}
+
+/*
+ * Pick the next thread for @cpu and unlink it from its run queue.
+ *
+ * Deadline threads queued on @cpu with budget left come first, in deadline
+ * order. Then the local priority queues are checked. Only the cpus in
+ * run_queue_waiting_cpus have threads to steal, so other queues are not
+ * touched. Another cpu's queue is only walked if its bitmap shows higher
+ * priority work than the local queue has, in which case the best unpinned
+ * thread found there is stolen.
+ */
+static thread_t *get_top_thread(uint cpu)
+{
+    struct run_queue *rq = &per_cpu(run_queues, cpu);
+    thread_t *newthread = run_queue_peek_deadline(rq);
+
+    /* deadline threads are bound to their cpu and run ahead of everything */
+    if (newthread) {
+        run_queue_delete(rq, newthread);
+        return newthread;
+    }
+
+    newthread = run_queue_peek(rq, (int)cpu, 0);
+
+#if WITH_SMP
+    struct run_queue *steal_rq = NULL;
+    int best_priority = newthread ? newthread->priority : -1;
+
+    mp_cpu_mask_t waiting = run_queue_waiting_cpus & ~(1U << cpu);
+
+    while (waiting) {
+        uint i = __builtin_ctz(waiting);
+        struct run_queue *remote_rq = &per_cpu(run_queues, i);
+        thread_t *t;
+
+        waiting &= waiting - 1;
+        if (run_queue_top_priority(remote_rq) <= best_priority)
+            continue;
+
+        t = run_queue_peek(remote_rq, (int)cpu, best_priority + 1);
+        if (t) {
+            newthread = t;
+            best_priority = t->priority;
+            steal_rq = remote_rq;
         }
+    }
 
-        local_run_queue_bitmap &= ~(1U<<next_queue);
+    if (steal_rq) {
+        THREAD_STATS_INC(steals);
+        rq = steal_rq;
     }
+#endif
 
-    /* No threads to run */
-    if (cpu < 0) {
-        /* no CPU has been selected, so we don't have an idle thread */
-        return NULL;
-    } else {
-        /* select the idle thread for this cpu */
-        return idle_thread(cpu);
+    if (newthread) {
+        run_queue_delete(rq, newthread);
+        return newthread;
     }
+
+    /* No threads to run, select the idle thread for this cpu */
+    return idle_thread(cpu);
 }
 
 /**
@@ -649,14 +1474,14 @@ static thread_t *get_top_thread(int cpu, bool unlink)
  * current_thread set to the ready thread.
  * - If the thread is sleeping when its pinned cpu is updated,
  * thread_sleep_handler() is invoked on the cpu the thread went to sleep on.
- * thread_sleep_handler() needs to invoke thread_pinned_cond_mp_reschedule()
- * to trigger the IPI on the new pinned cpu.
+ * thread_sleep_handler() invokes thread_mp_reschedule() to trigger the IPI
+ * on the cpu whose run queue the thread was placed on.
  */
 static void thread_pinned_cond_mp_reschedule(thread_t* current_thread,
                                              thread_t* thread,
                                              uint cpu) {
 #if WITH_SMP
-    if (unlikely((thread->pinned_cpu > -1) && (thread->pinned_cpu != (int)cpu))) {
+    if (unlikely(!thread_can_run_on(thread, cpu))) {
         DEBUG_ASSERT(thread->curr_cpu == (int)cpu || thread->curr_cpu == -1);
 #if DEBUG_THREAD_CPU_PIN
         dprintf(ALWAYS,
@@ -675,22 +1500,27 @@ static void thread_cond_mp_reschedule(thread_t *current_thread, const char *call
     int i;
     uint best_cpu = ~0U;
     int best_cpu_priority = INT_MAX;
-    thread_t *t = get_top_thread(-1, false);
+    thread_t *t = run_queue_peek(&this_cpu(run_queues), -1, 0);
 
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(thread_lock_held());
 
+    if (!t)
+        return;
+
+    mp_cpu_mask_t allowed = thread_allowed_cpus(t);
+
     for (i = 0; i < SMP_MAX_CPUS; i++) {
-        if (!mp_is_cpu_active(i))
+        if (!mp_is_cpu_active(i) || !(allowed & (1U << i)))
             continue;
 
-        if (cpu_priority[i] < best_cpu_priority) {
+        if (per_cpu(cpu_priority, i) < best_cpu_priority) {
             best_cpu = i;
-            best_cpu_priority = cpu_priority[i];
+            best_cpu_priority = per_cpu(cpu_priority, i);
         }
     }
 
-    if (!t || (t->priority <= best_cpu_priority))
+    if (best_cpu == ~0U || t->priority <= best_cpu_priority)
         return;
 
 #if DEBUG_THREAD_CPU_WAKE
@@ -699,7 +1529,7 @@ static void thread_cond_mp_reschedule(thread_t *current_thread, const char *call
             t->priority, t->name,
             current_thread->priority, current_thread->name);
 #endif
-    cpu_priority[best_cpu] = t->priority;
+    per_cpu(cpu_priority, best_cpu) = t->priority;
     mp_reschedule(1UL << best_cpu, 0);
 #endif
 }
@@ -728,7 +1558,22 @@ void thread_resched(void)
 
     THREAD_STATS_INC(reschedules);
 
-    newthread = get_top_thread(cpu, true);
+    /* a thread entering the scheduler is not in a rcu read side section */
+    rcu_note_context_switch(cpu);
+
+    if (thread_is_deadline(current_thread))
+        thread_deadline_charge(current_thread, current_time_ns());
+
+    if (thread_has_quota(current_thread) &&
+        thread_quota_charge(current_thread, current_time_ns()) &&
+        current_thread->state == THREAD_READY &&
+        !current_thread->quota.throttled) {
+        /* out of quota, requeueing parks it until its next period starts */
+        remove_from_run_queue(current_thread);
+        insert_in_run_queue_tail(current_thread);
+    }
+
+    newthread = get_top_thread(cpu);
 
     /*
      * The current_thread is switched out from a given cpu,
@@ -740,11 +1585,15 @@ void thread_resched(void)
     DEBUG_ASSERT(newthread);
 
     newthread->state = THREAD_RUNNING;
+    if (thread_is_deadline(newthread) && newthread != current_thread)
+        newthread->dl.start = current_time_ns();
+    if (thread_has_quota(newthread) && newthread != current_thread)
+        newthread->quota.start = current_time_ns();
 
     oldthread = current_thread;
 
     if (newthread == oldthread) {
-        if (cpu_priority[cpu] != oldthread->priority) {
+        if (per_cpu(cpu_priority, cpu) != thread_cpu_priority(oldthread)) {
             /*
              * When we try to wake up a CPU to run a specific thread, we record
              * the priority of that thread so we don't request the same CPU
@@ -755,10 +1604,21 @@ void thread_resched(void)
              */
 #if DEBUG_THREAD_CPU_WAKE
             dprintf(ALWAYS, "%s: cpu %d, reset cpu priority %d -> %d\n",
-                __func__, cpu, cpu_priority[cpu], newthread->priority);
+                __func__, cpu, per_cpu(cpu_priority, cpu), newthread->priority);
 #endif
-            cpu_priority[cpu] = newthread->priority;
+            per_cpu(cpu_priority, cpu) = thread_cpu_priority(newthread);
         }
+#if THREAD_STATS
+        /* picked ourselves again, our slice goes on */
+        newthread->stats_ready_time = 0;
+#endif
+#if PLATFORM_HAS_DYNAMIC_TIMER
+        /* the run queue may have changed while we were out of it */
+        thread_update_preempt_timer(cpu, newthread);
+#endif
+#if WITH_SMP
+        thread_start_balance_timer(cpu);
+#endif
         return;
     }
 
@@ -771,6 +1631,17 @@ void thread_resched(void)
     thread_set_curr_cpu(oldthread, -1);
     thread_set_curr_cpu(newthread, cpu);
 
+#if WITH_SMP
+    if (newthread->last_cpu != (int)cpu) {
+        if (newthread->last_cpu >= 0) {
+            THREAD_STATS_INC(migrations);
+            if (cpu_cluster(newthread->last_cpu) != cpu_cluster(cpu))
+                THREAD_STATS_INC(cluster_migrations);
+        }
+        newthread->last_cpu = cpu;
+    }
+#endif
+
 #if WITH_SMP
     if (thread_is_idle(newthread)) {
         mp_set_cpu_idle(cpu);
@@ -788,46 +1659,33 @@ void thread_resched(void)
 #if THREAD_STATS
     THREAD_STATS_INC(context_switches);
 
+    struct thread_stats *stats = &per_cpu(thread_stats, cpu);
+    lk_time_ns_t now = current_time_ns();
     if (thread_is_idle(oldthread)) {
-        lk_time_ns_t now = current_time_ns();
-        thread_stats[cpu].idle_time += now - thread_stats[cpu].last_idle_timestamp;
+        stats->idle_time += now - stats->last_idle_timestamp;
     }
     if (thread_is_idle(newthread)) {
-        thread_stats[cpu].last_idle_timestamp = current_time_ns();
+        stats->last_idle_timestamp = now;
     }
+    thread_sched_hist_switch(cpu, oldthread, newthread, now);
 #endif
 
     KEVLOG_THREAD_SWITCH(oldthread, newthread);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    if (thread_is_real_time_or_idle(newthread)) {
+    if (thread_is_real_time_or_idle(newthread))
         thread_cond_mp_reschedule(newthread, __func__);
-        if (!thread_is_real_time_or_idle(oldthread)) {
-            /* if we're switching from a non real time to a real time, cancel
-             * the preemption timer. */
-#if DEBUG_THREAD_CONTEXT_SWITCH
-            dprintf(ALWAYS, "arch_context_switch: stop preempt, cpu %d, old %p (%s), new %p (%s)\n",
-                    cpu, oldthread, oldthread->name, newthread, newthread->name);
-#endif
-            timer_cancel(&preempt_timer[cpu]);
-        }
-    } else if (thread_is_real_time_or_idle(oldthread)) {
-        /* if we're switching from a real time (or idle thread) to a regular one,
-         * set up a periodic timer to run our preemption tick. */
-#if DEBUG_THREAD_CONTEXT_SWITCH
-        dprintf(ALWAYS, "arch_context_switch: start preempt, cpu %d, old %p (%s), new %p (%s)\n",
-                cpu, oldthread, oldthread->name, newthread, newthread->name);
+    thread_update_preempt_timer(cpu, newthread);
 #endif
-        timer_set_periodic_ns(&preempt_timer[cpu], MS2NS(10),
-                              thread_timer_callback, NULL);
-    }
+#if WITH_SMP
+    thread_start_balance_timer(cpu);
 #endif
 
     /* set some optional target debug leds */
     target_set_debug_led(0, !thread_is_idle(newthread));
 
     /* do the switch */
-    cpu_priority[cpu] = newthread->priority;
+    per_cpu(cpu_priority, cpu) = thread_cpu_priority(newthread);
     set_current_thread(newthread);
 
 #if DEBUG_THREAD_CONTEXT_SWITCH
@@ -943,48 +1801,245 @@ void thread_preempt(void)
     thread_preempt_inner(false);
 }
 
-void thread_preempt_lock_held(void)
+void thread_preempt_lock_held(void)
+{
+    DEBUG_ASSERT(thread_lock_held());
+    thread_preempt_inner(true);
+}
+
+/**
+ * @brief  Suspend thread until woken.
+ *
+ * This function schedules another thread to execute.  This function does not
+ * return until the thread is made runable again by some other module.
+ *
+ * You probably don't want to call this function directly; it's meant to be called
+ * from other modules, such as mutex, which will presumably set the thread's
+ * state to blocked and add it to some queue or another.
+ */
+void thread_block(void)
+{
+    __UNUSED thread_t *current_thread = get_current_thread();
+
+    DEBUG_ASSERT(current_thread->magic == THREAD_MAGIC);
+    DEBUG_ASSERT(current_thread->state == THREAD_BLOCKED);
+    DEBUG_ASSERT(thread_lock_held());
+    DEBUG_ASSERT(!thread_is_idle(current_thread));
+
+    /* we are blocking on something. the blocking code should have already stuck us on a queue */
+    thread_resched();
+}
+
+void thread_unblock(thread_t *t, bool resched)
+{
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+    DEBUG_ASSERT(t->state == THREAD_BLOCKED);
+    DEBUG_ASSERT(thread_lock_held());
+    DEBUG_ASSERT(!thread_is_idle(t));
+
+    t->state = THREAD_READY;
+    insert_in_run_queue_head(t);
+    thread_mp_reschedule(get_current_thread(), t);
+    if (resched)
+        thread_resched();
+}
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/*
+ * The preemption tick is only needed while a thread that may preempt
+ * @current_thread, one of at least its priority, is waiting in the local run
+ * queue, or a deadline thread with budget left is. Real time and idle threads
+ * are otherwise never preempted by the tick. Lower
+ * priority threads queued here are left to cpus that run out of work to steal
+ * and to the load balancer.
+ */
+static bool thread_need_preempt_timer(uint cpu, thread_t *current_thread)
+{
+    /* deadline threads waiting here preempt everything else */
+    if (run_queue_peek_deadline(&per_cpu(run_queues, cpu)))
+        return !thread_is_idle(current_thread);
+
+    /* the tick enforces the cpu quota */
+    if (thread_has_quota(current_thread))
+        return true;
+
+    if (thread_is_real_time_or_idle(current_thread))
+        return false;
+
+    return run_queue_top_priority(&per_cpu(run_queues, cpu)) >= current_thread->priority;
+}
+
+/*
+ * Start or stop the preemption timer of the local cpu to match its run queue.
+ * This lets a cpu running a single thread skip the tick entirely.
+ *
+ * While a deadline thread runs, the timer instead fires once when its budget
+ * runs out.
+ */
+static void thread_update_preempt_timer(uint cpu, thread_t *current_thread)
+{
+    DEBUG_ASSERT(thread_lock_held());
+    DEBUG_ASSERT(cpu == arch_curr_cpu_num());
+
+    if (thread_is_deadline(current_thread)) {
+        lk_time_ns_t budget_end = current_thread->dl.start +
+                                  current_thread->dl.budget;
+        lk_time_ns_t now = current_time_ns();
+
+        if (per_cpu(preempt_timer_armed, cpu) &&
+            per_cpu(preempt_timer_budget_end, cpu) == budget_end)
+            return;
+
+        if (per_cpu(preempt_timer_armed, cpu))
+            timer_cancel(&per_cpu(preempt_timer, cpu));
+        timer_set_oneshot_ns(&per_cpu(preempt_timer, cpu),
+                             budget_end > now ? budget_end - now : 0,
+                             thread_timer_callback, NULL);
+        per_cpu(preempt_timer_armed, cpu) = true;
+        per_cpu(preempt_timer_budget_end, cpu) = budget_end;
+        return;
+    }
+
+    bool need_timer = thread_need_preempt_timer(cpu, current_thread);
+
+    if (need_timer == per_cpu(preempt_timer_armed, cpu) &&
+        !per_cpu(preempt_timer_budget_end, cpu))
+        return;
+
+#if DEBUG_THREAD_CONTEXT_SWITCH
+    dprintf(ALWAYS, "%s: %s preempt, cpu %d, current %p (%s)\n", __func__,
+            need_timer ? "start" : "stop", cpu, current_thread,
+            current_thread->name);
+#endif
+    if (per_cpu(preempt_timer_armed, cpu))
+        timer_cancel(&per_cpu(preempt_timer, cpu));
+    if (need_timer) {
+        timer_set_periodic_ns(&per_cpu(preempt_timer, cpu), MS2NS(10),
+                              thread_timer_callback, NULL);
+    }
+    per_cpu(preempt_timer_armed, cpu) = need_timer;
+    per_cpu(preempt_timer_budget_end, cpu) = 0;
+}
+#endif
+
+#if WITH_SMP
+/* runnable threads on @cpu, waiting or running */
+static uint thread_cpu_load(uint cpu)
 {
-    DEBUG_ASSERT(thread_lock_held());
-    thread_preempt_inner(true);
+    return per_cpu(run_queues, cpu).count + !mp_is_cpu_idle(cpu);
 }
 
-/**
- * @brief  Suspend thread until woken.
- *
- * This function schedules another thread to execute.  This function does not
- * return until the thread is made runable again by some other module.
+/*
+ * Push threads waiting on @cpu to the least loaded cpus they may run on, as
+ * long as that evens out the load. Wakeup placement and stealing by cpus that
+ * run out of work only look at priorities at the moment a thread becomes ready
+ * or a cpu goes idle, so a set of long running threads can still pile up on
+ * one cpu while another has less to do.
  *
- * You probably don't want to call this function directly; it's meant to be called
- * from other modules, such as mutex, which will presumably set the thread's
- * state to blocked and add it to some queue or another.
+ * The lowest priority threads are moved first since they would wait longest
+ * here. A thread that can preempt what is running on its new cpu gets there
+ * right away through thread_mp_reschedule().
  */
-void thread_block(void)
+static void thread_balance(uint cpu)
 {
-    __UNUSED thread_t *current_thread = get_current_thread();
+    struct run_queue *rq = &per_cpu(run_queues, cpu);
+    thread_t *current_thread = get_current_thread();
+    uint load[SMP_MAX_CPUS];
+    uint moves = 0;
 
-    DEBUG_ASSERT(current_thread->magic == THREAD_MAGIC);
-    DEBUG_ASSERT(current_thread->state == THREAD_BLOCKED);
     DEBUG_ASSERT(thread_lock_held());
-    DEBUG_ASSERT(!thread_is_idle(current_thread));
 
-    /* we are blocking on something. the blocking code should have already stuck us on a queue */
-    thread_resched();
+    THREAD_STATS_INC(balance_runs);
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        load[i] = mp_is_cpu_active(i) ? thread_cpu_load(i) : ~0U;
+
+    for (int pri = 0; pri < NUM_PRIORITIES; pri++) {
+        thread_t *t, *temp;
+
+        if (!(rq->bitmap & (1U << pri)))
+            continue;
+
+        list_for_every_entry_safe(&rq->queue[pri], t, temp, thread_t, queue_node) {
+            mp_cpu_mask_t allowed = thread_allowed_cpus(t);
+            uint target = ~0U;
+
+            if (moves >= THREAD_BALANCE_MAX_MOVES)
+                return;
+
+            if (t->pinned_cpu >= 0)
+                continue;
+
+            for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+                if (i == cpu || !(allowed & (1U << i)) || load[i] == ~0U)
+                    continue;
+                if (target == ~0U || load[i] < load[target])
+                    target = i;
+            }
+
+            if (target == ~0U ||
+                load[cpu] < load[target] + THREAD_BALANCE_IMBALANCE)
+                continue;
+
+#if DEBUG_THREAD_CPU_WAKE
+            dprintf(ALWAYS, "%s: cpu %d, move priority %d thread (%s) to cpu %d, load %u -> %u\n",
+                    __func__, cpu, t->priority, t->name, target, load[cpu],
+                    load[target]);
+#endif
+            struct run_queue *target_rq = &per_cpu(run_queues, target);
+
+            run_queue_delete(rq, t);
+            thread_set_rq_cpu(t, target);
+            list_add_tail(&target_rq->queue[pri], &t->queue_node);
+            run_queue_set_priority(target_rq, target, pri);
+            target_rq->count++;
+
+            load[cpu]--;
+            load[target]++;
+            moves++;
+            THREAD_STATS_INC(balance_moves);
+
+            thread_mp_reschedule(current_thread, t);
+        }
+    }
 }
 
-void thread_unblock(thread_t *t, bool resched)
+static enum handler_return thread_balance_callback(struct timer *t,
+                                                   lk_time_ns_t now, void *arg)
+{
+    uint cpu = arch_curr_cpu_num();
+
+    THREAD_LOCK(state);
+    thread_balance(cpu);
+    if (!per_cpu(run_queues, cpu).count) {
+        timer_cancel(&per_cpu(balance_timer, cpu));
+        per_cpu(balance_timer_armed, cpu) = false;
+    }
+    THREAD_UNLOCK(state);
+
+    return INT_NO_RESCHEDULE;
+}
+
+/*
+ * Start the load balancer of the local cpu if it has threads waiting. The
+ * balancer stops itself once it finds the run queue empty, so a cpu switching
+ * back and forth between one and two runnable threads does not keep arming
+ * and cancelling it.
+ */
+static void thread_start_balance_timer(uint cpu)
 {
-    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
-    DEBUG_ASSERT(t->state == THREAD_BLOCKED);
     DEBUG_ASSERT(thread_lock_held());
-    DEBUG_ASSERT(!thread_is_idle(t));
+    DEBUG_ASSERT(cpu == arch_curr_cpu_num());
 
-    t->state = THREAD_READY;
-    insert_in_run_queue_head(t);
-    thread_mp_reschedule(get_current_thread(), t);
-    if (resched)
-        thread_resched();
+    if (per_cpu(balance_timer_armed, cpu) || !per_cpu(run_queues, cpu).count)
+        return;
+
+    timer_set_periodic_ns(&per_cpu(balance_timer, cpu),
+                          MS2NS(THREAD_BALANCE_INTERVAL_MS),
+                          thread_balance_callback, NULL);
+    per_cpu(balance_timer_armed, cpu) = true;
 }
+#endif
 
 enum handler_return thread_timer_tick(void)
 {
@@ -1001,8 +2056,38 @@ static enum handler_return thread_timer_callback(struct timer *t, lk_time_ns_t n
 
     THREAD_LOCK(state);
     thread_cond_mp_reschedule(current_thread, __func__);
+    if (thread_is_deadline(current_thread)) {
+        /* the budget is charged and enforced by thread_resched() */
+        bool out_of_budget = current_time_ns() - current_thread->dl.start >=
+                             current_thread->dl.budget;
+#if PLATFORM_HAS_DYNAMIC_TIMER
+        if (t) {
+            /* the oneshot budget timer expired, rearm it if it was early */
+            this_cpu(preempt_timer_armed) = false;
+            if (!out_of_budget)
+                thread_update_preempt_timer(arch_curr_cpu_num(), current_thread);
+        }
+#endif
+        THREAD_UNLOCK(state);
+        return out_of_budget ? INT_RESCHEDULE : INT_NO_RESCHEDULE;
+    }
+    bool deadline_ready =
+        run_queue_peek_deadline(&this_cpu(run_queues));
+    bool out_of_quota = thread_has_quota(current_thread) &&
+        thread_quota_charge(current_thread, current_time_ns());
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    /*
+     * Called from the preemption timer rather than the periodic tick. Stop
+     * ticking if our competition was stolen by another cpu.
+     */
+    if (t)
+        thread_update_preempt_timer(arch_curr_cpu_num(), current_thread);
+#endif
     THREAD_UNLOCK(state);
 
+    if (deadline_ready || out_of_quota)
+        return INT_RESCHEDULE;
+
     if (thread_is_real_time_or_idle(current_thread))
         return INT_NO_RESCHEDULE;
 
@@ -1029,29 +2114,40 @@ static enum handler_return thread_sleep_handler(timer_t *timer,
     insert_in_run_queue_head(t);
     /*
      * The awakened thread's thread_sleep_handler() is invoked
-     * on the cpu the thread went to sleep on.
-     * However the thread's pinned cpu may have changed
-     * while the thread was asleep and if so,
-     * this thread should be scheduled on the new pinned cpu.
+     * on the cpu the thread went to sleep on, but it may have been
+     * queued on another cpu: either its pinned cpu changed while it
+     * was asleep or a lower priority cpu was picked to run it.
      */
-    thread_pinned_cond_mp_reschedule(
-        get_current_thread(), t, arch_curr_cpu_num());
+    thread_mp_reschedule(get_current_thread(), t);
     THREAD_UNLOCK(state);
 
     return INT_RESCHEDULE;
 }
 
-/**
- * @brief  Put thread to sleep; delay specified in ms
- *
- * This function puts the current thread to sleep until the specified
- * delay in ns has expired.
- *
- * Note that this function could sleep for longer than the specified delay if
- * other threads are running.  When the timer expires, this thread will
- * be placed at the head of the run queue.
+/*
+ * Sleeps of at most THREAD_SLEEP_SPIN_NS are shorter than the timer interrupt
+ * and context switches it takes to block, so they poll the clock instead,
+ * yielding to other threads. Longer sleeps arm their timer early by the
+ * average wakeup latency, up to THREAD_SLEEP_SPIN_NS, and poll the rest.
  */
-void thread_sleep_ns(lk_time_ns_t delay_ns)
+#ifndef THREAD_SLEEP_SPIN_NS
+#define THREAD_SLEEP_SPIN_NS 10000
+#endif
+
+/* average delay from sleep timer expiry to the thread running, updated racily */
+static uint32_t thread_sleep_latency_ns;
+
+static void thread_sleep_update_latency(lk_time_ns_t latency_ns)
+{
+    uint32_t avg = __atomic_load_n(&thread_sleep_latency_ns, __ATOMIC_RELAXED);
+
+    /* a thread preempted after waking up should not skew the average */
+    latency_ns = MIN(latency_ns, THREAD_SLEEP_SPIN_NS);
+    avg = avg - avg / 8 + latency_ns / 8;
+    __atomic_store_n(&thread_sleep_latency_ns, avg, __ATOMIC_RELAXED);
+}
+
+static void thread_sleep_until_etc(lk_time_ns_t target_ns, lk_time_ns_t now_ns)
 {
     timer_t timer;
 
@@ -1061,10 +2157,21 @@ void thread_sleep_ns(lk_time_ns_t delay_ns)
     DEBUG_ASSERT(current_thread->state == THREAD_RUNNING);
     DEBUG_ASSERT(!thread_is_idle(current_thread));
 
+    if (target_ns - now_ns <= THREAD_SLEEP_SPIN_NS) {
+        /* yield at least once, as blocking would */
+        do {
+            thread_yield();
+        } while (current_time_ns() < target_ns);
+        return;
+    }
+
+    lk_time_ns_t wake_ns = target_ns -
+            __atomic_load_n(&thread_sleep_latency_ns, __ATOMIC_RELAXED);
+
     timer_initialize(&timer);
 
     THREAD_LOCK(state);
-    timer_set_oneshot_ns(&timer, delay_ns, thread_sleep_handler,
+    timer_set_oneshot_ns(&timer, wake_ns - now_ns, thread_sleep_handler,
                          (void *)current_thread);
     current_thread->state = THREAD_SLEEPING;
     thread_resched();
@@ -1075,6 +2182,32 @@ void thread_sleep_ns(lk_time_ns_t delay_ns)
      * it would corrupt the stack.
      */
     timer_cancel_sync(&timer);
+
+    now_ns = current_time_ns();
+    thread_sleep_update_latency(now_ns > wake_ns ? now_ns - wake_ns : 0);
+
+    while (now_ns < target_ns) {
+        thread_yield();
+        now_ns = current_time_ns();
+    }
+}
+
+/**
+ * @brief  Put thread to sleep; delay specified in ns
+ *
+ * This function puts the current thread to sleep until the specified
+ * delay in ns has expired.
+ *
+ * Note that this function could sleep for longer than the specified delay if
+ * other threads are running.  When the timer expires, this thread will
+ * be placed at the head of the run queue. Delays of at most
+ * THREAD_SLEEP_SPIN_NS do not block, but yield until they have expired.
+ */
+void thread_sleep_ns(lk_time_ns_t delay_ns)
+{
+    lk_time_ns_t now_ns = current_time_ns();
+
+    thread_sleep_until_etc(now_ns + delay_ns, now_ns);
 }
 
 /**
@@ -1089,8 +2222,8 @@ void thread_sleep_until_ns(lk_time_ns_t target_time_ns)
 {
     lk_time_ns_t now_ns = current_time_ns();
     if (now_ns < target_time_ns) {
-        /* TODO: Support absolute time in timer api and improve accuracy. */
-        thread_sleep_ns(target_time_ns - now_ns);
+        /* TODO: Support absolute time in timer api. */
+        thread_sleep_until_etc(target_time_ns, now_ns);
     }
 }
 
@@ -1106,8 +2239,12 @@ void thread_init_early(void)
     DEBUG_ASSERT(arch_curr_cpu_num() == 0);
 
     /* initialize the run queues */
-    for (i=0; i < NUM_PRIORITIES; i++)
-        list_initialize(&run_queue[i]);
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        for (i=0; i < NUM_PRIORITIES; i++)
+            list_initialize(&per_cpu(run_queues, cpu).queue[i]);
+        list_initialize(&per_cpu(run_queues, cpu).deadline_queue);
+        list_initialize(&per_cpu(run_queues, cpu).throttled_queue);
+    }
 
     /* initialize the thread list */
     list_initialize(&thread_list);
@@ -1123,13 +2260,14 @@ void thread_init_early(void)
 
     /* half construct this thread, since we're already running */
     t->priority = HIGHEST_PRIORITY;
+    t->base_priority = HIGHEST_PRIORITY;
     t->state = THREAD_RUNNING;
     t->flags = THREAD_FLAG_DETACHED;
     thread_set_curr_cpu(t, 0);
     thread_set_pinned_cpu(t, 0);
     wait_queue_init(&t->retcode_wait_queue);
     list_add_head(&thread_list, &t->thread_list_node);
-    cpu_priority[0] = t->priority;
+    per_cpu(cpu_priority, 0) = t->priority;
     set_current_thread(t);
 }
 
@@ -1153,9 +2291,17 @@ void thread_init(void)
 {
 #if PLATFORM_HAS_DYNAMIC_TIMER
     for (uint i = 0; i < SMP_MAX_CPUS; i++) {
-        timer_initialize(&preempt_timer[i]);
+        timer_initialize(&per_cpu(preempt_timer, i));
+    }
+#endif
+#if WITH_SMP
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        timer_initialize(&per_cpu(balance_timer, i));
     }
 #endif
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        timer_initialize(&per_cpu(quota_timer, i));
+    }
     thread_reaper_init();
 }
 
@@ -1184,7 +2330,9 @@ void thread_set_priority(int priority)
         priority = IDLE_PRIORITY + 1;
     if (priority > HIGHEST_PRIORITY)
         priority = HIGHEST_PRIORITY;
-    current_thread->priority = priority;
+    current_thread->base_priority = priority;
+    /* keep any priority inherited from waiters on mutexes we hold */
+    current_thread->priority = MAX(priority, mutex_inherited_priority(current_thread));
 
     current_thread->state = THREAD_READY;
     insert_in_run_queue_head(current_thread);
@@ -1193,25 +2341,50 @@ void thread_set_priority(int priority)
     THREAD_UNLOCK(state);
 }
 
-/**
- * thread_set_pinned_cpu() - Pin thread to a given CPU.
- * @t:      Thread to pin
- * @cpu:    cpu id on which to pin the thread
- */
-void thread_set_pinned_cpu(thread_t* t, int cpu) {
-#if WITH_SMP
-    DEBUG_ASSERT(t);
+void thread_set_effective_priority(thread_t *t, int priority)
+{
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
-    DEBUG_ASSERT(cpu >= -1 && cpu < SMP_MAX_CPUS);
-    DEBUG_ASSERT(!thread_lock_held());
+    DEBUG_ASSERT(thread_lock_held());
+    DEBUG_ASSERT(!thread_is_idle(t));
 
-    THREAD_LOCK(state);
-    if (t->pinned_cpu == cpu) {
-        goto done;
+    if (t->priority == priority)
+        return;
+
+    switch (t->state) {
+        case THREAD_READY:
+            /* requeue at the new priority, possibly on another cpu */
+            remove_from_run_queue(t);
+            t->priority = priority;
+            insert_in_run_queue_head(t);
+            thread_mp_reschedule(get_current_thread(), t);
+            break;
+        case THREAD_RUNNING:
+            t->priority = priority;
+#if WITH_SMP
+            if (t->curr_cpu >= 0)
+                per_cpu(cpu_priority, t->curr_cpu) = thread_cpu_priority(t);
+#endif
+#if PLATFORM_HAS_DYNAMIC_TIMER
+            /* a lower priority may expose us to threads already queued */
+            if (t == get_current_thread())
+                thread_update_preempt_timer(arch_curr_cpu_num(), t);
+#endif
+            break;
+        default:
+            /* picked up next time the thread becomes ready */
+            t->priority = priority;
+            break;
     }
+}
 
-    t->pinned_cpu = cpu;
-    if ((t->pinned_cpu > -1) && (t->pinned_cpu == t->curr_cpu)) {
+#if WITH_SMP
+/*
+ * Move thread @t to a cpu it may run on after its pinned cpu or affinity mask
+ * changed. Must be called with the thread lock held.
+ */
+static void thread_cpu_constraints_changed(thread_t *t)
+{
+    if ((t->curr_cpu > -1) && thread_can_run_on(t, t->curr_cpu)) {
         /*
          * No need to reschedule the thread on a new cpu.
          * This exit path is also used during the initial
@@ -1219,7 +2392,7 @@ void thread_set_pinned_cpu(thread_t* t, int cpu) {
          * see thread_init_early()
          * and thread_secondary_cpu_init_early()
          */
-        goto done;
+        return;
     }
 
     switch(t->state){
@@ -1229,7 +2402,7 @@ void thread_set_pinned_cpu(thread_t* t, int cpu) {
              * the cpu pinning will apply at a later stage
              * when thread is scheduled
              */
-            goto done;
+            return;
         }
         case THREAD_READY: {
             DEBUG_ASSERT(!thread_is_idle(t));
@@ -1239,11 +2412,14 @@ void thread_set_pinned_cpu(thread_t* t, int cpu) {
             /*
              * Thread `t` is ready and shall be rescheduled
              * according to a new cpu target (either the
-             * pinned cpu if pinned cpu > -1, or any available
-             * cpu if pinned cpu == -1).
+             * pinned cpu if pinned cpu > -1, or any cpu in its
+             * affinity mask if pinned cpu == -1). Move it to the run
+             * queue matching that target first.
              */
-            int curr_cpu = arch_curr_cpu_num();
-            if (t->pinned_cpu == -1 || t->pinned_cpu == curr_cpu) {
+            remove_from_run_queue(t);
+            insert_in_run_queue_head(t);
+            uint curr_cpu = arch_curr_cpu_num();
+            if (thread_rq_cpu(t) == curr_cpu) {
                 if (current_thread->priority < t->priority) {
                     /*
                      * if the thread is to be rescheduled on the current
@@ -1251,7 +2427,7 @@ void thread_set_pinned_cpu(thread_t* t, int cpu) {
                      * shall be invoked.
                      */
                     thread_preempt_lock_held();
-                    goto done;
+                    return;
                 }
                 if (t->pinned_cpu == -1
                     && thread_is_realtime(current_thread)) {
@@ -1270,30 +2446,22 @@ void thread_set_pinned_cpu(thread_t* t, int cpu) {
                 }
             } else {
                 /*
-                 * if the thread is pinned on another cpu than current
-                 * an ipi may be sent to the best cpu. This is achieved
+                 * if the thread is queued on another cpu than current
+                 * an ipi may be sent to that cpu. This is achieved
                  * by invoking thread_mp_reschedule().
                  */
                 thread_mp_reschedule(current_thread, t);
             }
-            goto done;
+            return;
         }
         case THREAD_RUNNING: {
             DEBUG_ASSERT(!thread_is_idle(t));
             int thread_curr_cpu = t->curr_cpu;
             DEBUG_ASSERT(thread_curr_cpu > -1);
             thread_t *current_thread = get_current_thread();
-            if (t->pinned_cpu == -1){
-                /*
-                 * pinned cpu is reset,
-                 * current cpu still is a valid option,
-                 * nothing to do
-                 */
-                goto done;
-            }
             /*
-             * Thread `t` is running and its pinned cpu is
-             * different from its current cpu, two cases to handle:
+             * Thread `t` is running and its current cpu is no
+             * longer allowed, two cases to handle:
              * - Running on current cpu
              * - Running on another cpu than current
              */
@@ -1309,7 +2477,7 @@ void thread_set_pinned_cpu(thread_t* t, int cpu) {
                  */
                 DEBUG_ASSERT(thread_curr_cpu == (int)arch_curr_cpu_num());
                 thread_preempt_lock_held();
-                goto done;
+                return;
             }
             /*
              * Thread `t` is running on another cpu than
@@ -1322,7 +2490,7 @@ void thread_set_pinned_cpu(thread_t* t, int cpu) {
              */
             DEBUG_ASSERT(thread_curr_cpu != (int)arch_curr_cpu_num());
             mp_reschedule(1UL << (uint)thread_curr_cpu, 0);
-            goto done;
+            return;
         }
         case THREAD_BLOCKED:
         case THREAD_SLEEPING: {
@@ -1333,7 +2501,7 @@ void thread_set_pinned_cpu(thread_t* t, int cpu) {
              */
             DEBUG_ASSERT(!thread_is_idle(t));
             DEBUG_ASSERT(t != get_current_thread());
-            goto done;
+            return;
         }
         case THREAD_DEATH: {
             /*
@@ -1341,7 +2509,7 @@ void thread_set_pinned_cpu(thread_t* t, int cpu) {
              * invoked on such a dead/exited thread
              */
             DEBUG_ASSERT(false);
-            goto done;
+            return;
         }
         /*
          * Compiler option -Wswitch will catch missing
@@ -1349,7 +2517,26 @@ void thread_set_pinned_cpu(thread_t* t, int cpu) {
          * value is added and not handled.
          */
     }
-done:
+}
+#endif
+
+/**
+ * thread_set_pinned_cpu() - Pin thread to a given CPU.
+ * @t:      Thread to pin
+ * @cpu:    cpu id on which to pin the thread
+ */
+void thread_set_pinned_cpu(thread_t* t, int cpu) {
+#if WITH_SMP
+    DEBUG_ASSERT(t);
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+    DEBUG_ASSERT(cpu >= -1 && cpu < SMP_MAX_CPUS);
+    DEBUG_ASSERT(!thread_lock_held());
+
+    THREAD_LOCK(state);
+    if (t->pinned_cpu != cpu) {
+        t->pinned_cpu = cpu;
+        thread_cpu_constraints_changed(t);
+    }
     THREAD_UNLOCK(state);
 #if DEBUG_THREAD_CPU_PIN
     dprintf(ALWAYS,
@@ -1360,6 +2547,35 @@ done:
 #endif
 }
 
+/**
+ * thread_set_cpu_affinity() - Restrict a thread to a set of CPUs.
+ * @t:      Thread to restrict
+ * @mask:   cpus the thread may run on
+ */
+void thread_set_cpu_affinity(thread_t *t, mp_cpu_mask_t mask) {
+#if WITH_SMP
+    DEBUG_ASSERT(t);
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+    DEBUG_ASSERT(mask & (mp_cpu_mask_t)((1ULL << SMP_MAX_CPUS) - 1));
+    DEBUG_ASSERT(!thread_lock_held());
+
+    THREAD_LOCK(state);
+    if (t->cpu_affinity != mask) {
+        t->cpu_affinity = mask;
+        /* a pinned thread picks up the mask when it is unpinned */
+        if (t->pinned_cpu < 0)
+            thread_cpu_constraints_changed(t);
+    }
+    THREAD_UNLOCK(state);
+#if DEBUG_THREAD_CPU_PIN
+    dprintf(ALWAYS,
+            "%s(0x%x): thread %s, pinned_cpu %d, curr_cpu %d, state [%s]\n",
+            __func__, mask, t->name, t->pinned_cpu, t->curr_cpu,
+            thread_state_to_str(t->state));
+#endif
+#endif
+}
+
 /**
  * @brief  Become an idle thread
  *
@@ -1383,6 +2599,7 @@ void thread_become_idle(void)
 
     /* mark ourself as idle */
     t->priority = IDLE_PRIORITY;
+    t->base_priority = IDLE_PRIORITY;
     t->flags |= THREAD_FLAG_IDLE;
     thread_set_pinned_cpu(t, arch_curr_cpu_num());
 
@@ -1413,6 +2630,7 @@ void thread_secondary_cpu_init_early(void)
 
     /* half construct this thread, since we're already running */
     t->priority = HIGHEST_PRIORITY;
+    t->base_priority = HIGHEST_PRIORITY;
     t->state = THREAD_RUNNING;
     t->flags = THREAD_FLAG_DETACHED | THREAD_FLAG_IDLE;
     thread_set_curr_cpu(t, cpu);
@@ -1424,7 +2642,7 @@ void thread_secondary_cpu_init_early(void)
     THREAD_LOCK(state);
 
     list_add_head(&thread_list, &t->thread_list_node);
-    cpu_priority[cpu] = t->priority;
+    per_cpu(cpu_priority, cpu) = t->priority;
     set_current_thread(t);
 
     THREAD_UNLOCK(state);
@@ -1435,6 +2653,7 @@ void thread_secondary_cpu_entry(void)
     uint cpu = arch_curr_cpu_num();
     thread_t *t = get_current_thread();
     t->priority = IDLE_PRIORITY;
+    t->base_priority = IDLE_PRIORITY;
 
     mp_set_curr_cpu_active(true);
     mp_set_cpu_idle(cpu);
@@ -1509,6 +2728,11 @@ void dump_thread(thread_t *t)
 
 #endif
     dprintf(INFO, "\tentry %p, arg %p, flags 0x%x\n", t->entry, t->arg, t->flags);
+    if (thread_is_deadline(t)) {
+        dprintf(INFO, "\tdeadline cpu %d, runtime %llu, deadline %llu, period %llu, budget %llu%s\n",
+                t->dl.cpu, t->dl.runtime, t->dl.deadline, t->dl.period,
+                t->dl.budget, t->dl.throttled ? " (throttled)" : "");
+    }
     dprintf(INFO, "\twait queue %p, wait queue ret %d\n", t->blocking_wait_queue, t->wait_queue_block_ret);
 #if WITH_KERNEL_VM
     dprintf(INFO, "\taspace %p\n", t->aspace);
@@ -1543,6 +2767,63 @@ void dump_all_threads(void)
     THREAD_UNLOCK(state);
 }
 
+#if THREAD_STATS
+struct thread_sched_hist_copy {
+    thread_t *thread;
+    char name[sizeof(((thread_t *)0)->name)];
+    struct thread_sched_hist hist;
+};
+
+/**
+ * @brief  Dump the scheduler histograms of all threads
+ *
+ * The histograms are copied under the thread lock and printed once it has
+ * been released.
+ */
+void dump_all_threads_sched_hist(void)
+{
+    struct thread_sched_hist_copy *copies = NULL;
+    uint capacity = 0;
+    uint count;
+    thread_t *t;
+
+    for (;;) {
+        count = 0;
+        THREAD_LOCK(state);
+        list_for_every_entry(&thread_list, t, thread_t, thread_list_node) {
+            if (thread_is_idle(t))
+                continue;
+            if (count < capacity) {
+                copies[count].thread = t;
+                strlcpy(copies[count].name, t->name,
+                        sizeof(copies[count].name));
+                copies[count].hist = t->sched_hist;
+            }
+            count++;
+        }
+        THREAD_UNLOCK(state);
+
+        if (count <= capacity)
+            break;
+
+        /* threads were created since the last pass, make room and retry */
+        free(copies);
+        capacity = count + 8;
+        copies = malloc(capacity * sizeof(*copies));
+        if (!copies) {
+            printf("failed to allocate histograms for %u threads\n", count);
+            return;
+        }
+    }
+
+    for (uint i = 0; i < count; i++) {
+        printf("thread %p (%s):\n", copies[i].thread, copies[i].name);
+        thread_sched_hist_dump(&copies[i].hist);
+    }
+    free(copies);
+}
+#endif
+
 /** @} */
 
 
@@ -1595,8 +2876,27 @@ static enum handler_return wait_queue_timeout_handler(timer_t *timer,
  */
 status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
 {
-    timer_t timer;
+    return wait_queue_block_unlock(wait, timeout, NULL);
+}
 
+/**
+ * @brief  Block on a wait queue, dropping an object lock
+ *
+ * Same as wait_queue_block(), but @lock (taken before the thread lock) is
+ * released once the current thread has been added to the wait queue. This
+ * lets objects protect their state with their own lock while still
+ * guaranteeing that a waker taking that lock sees this thread queued.
+ *
+ * @param wait     The wait queue to enter
+ * @param timeout  The maximum time, in ms, to wait
+ * @param lock     Lock to release before blocking, may be NULL
+ *
+ * @return ERR_TIMED_OUT on timeout, else returns the return
+ * value specified when the queue was woken by wait_queue_wake_one().
+ */
+status_t wait_queue_block_unlock(wait_queue_t *wait, lk_time_t timeout,
+                                 spin_lock_t *lock)
+{
     thread_t *current_thread = get_current_thread();
 
     DEBUG_ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
@@ -1604,8 +2904,11 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(thread_lock_held());
 
-    if (timeout == 0)
+    if (timeout == 0) {
+        if (lock)
+            spin_unlock(lock);
         return ERR_TIMED_OUT;
+    }
 
     list_add_tail(&wait->list, &current_thread->queue_node);
     wait->count++;
@@ -1615,23 +2918,28 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
 
     /* if the timeout is nonzero or noninfinite, set a callback to yank us out of the queue */
     if (timeout != INFINITE_TIME) {
-        timer_initialize(&timer);
-        timer_set_oneshot_ns(&timer, MS2NS(timeout),
+        timer_set_oneshot_ns(&current_thread->wait_timer, MS2NS(timeout),
                              wait_queue_timeout_handler,
                              (void *)current_thread);
     }
 
+    if (lock)
+        spin_unlock(lock);
+
     thread_resched();
 
     /* we don't really know if the timer fired or not, so it's better safe to try to cancel it */
-    if (timeout != INFINITE_TIME) {
+    if (timeout != INFINITE_TIME &&
+        !timer_try_cancel(&current_thread->wait_timer)) {
         /*
-         * The timer could be running on another CPU. Drop the thread-lock then
-         * cancel and wait for the stack allocated timer.
+         * The timer fired, and its callback is still running on another CPU,
+         * waiting for the thread lock or about to release it. It finds this
+         * thread no longer blocked, so drop the thread lock and wait for it to
+         * finish before the timer can be armed again.
          */
         thread_unlock_ints_disabled();
         arch_enable_ints();
-        timer_cancel_sync(&timer);
+        timer_cancel_sync(&current_thread->wait_timer);
         arch_disable_ints();
         thread_lock_ints_disabled();
     }
@@ -1654,6 +2962,19 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
  * @return  The number of threads woken (zero or one)
  */
 int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue_error)
+{
+    return wait_queue_wake_one_unlock(wait, reschedule, wait_queue_error, NULL);
+}
+
+/**
+ * @brief  Wake up one thread sleeping on a wait queue, dropping an object lock
+ *
+ * Same as wait_queue_wake_one(), but @lock (taken before the thread lock) is
+ * released after the woken thread has been made ready, and before the current
+ * thread is rescheduled.
+ */
+int wait_queue_wake_one_unlock(wait_queue_t *wait, bool reschedule,
+                               status_t wait_queue_error, spin_lock_t *lock)
 {
     thread_t *t;
     int ret = 0;
@@ -1682,6 +3003,10 @@ int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue
         }
         insert_in_run_queue_head(t);
         thread_mp_reschedule(current_thread, t);
+        if (lock) {
+            spin_unlock(lock);
+            lock = NULL;
+        }
         if (reschedule) {
             thread_resched();
         }
@@ -1689,6 +3014,9 @@ int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue
 
     }
 
+    if (lock)
+        spin_unlock(lock);
+
     return ret;
 }
 
@@ -1708,6 +3036,19 @@ int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue
  * @return  The number of threads woken (zero or one)
  */
 int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue_error)
+{
+    return wait_queue_wake_all_unlock(wait, reschedule, wait_queue_error, NULL);
+}
+
+/**
+ * @brief  Wake all threads sleeping on a wait queue, dropping an object lock
+ *
+ * Same as wait_queue_wake_all(), but @lock (taken before the thread lock) is
+ * released after the woken threads have been made ready, and before the
+ * current thread is rescheduled.
+ */
+int wait_queue_wake_all_unlock(wait_queue_t *wait, bool reschedule,
+                               status_t wait_queue_error, spin_lock_t *lock)
 {
     thread_t *t;
     int ret = 0;
@@ -1743,6 +3084,9 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
 
     DEBUG_ASSERT(wait->count == 0);
 
+    if (lock)
+        spin_unlock(lock);
+
     if (ret > 0) {
         mp_reschedule(mp_reschedule_target, 0);
         if (reschedule) {
@@ -1772,12 +3116,24 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
  * If any threads were waiting on this queue, they are all woken.
  */
 void wait_queue_destroy(wait_queue_t *wait, bool reschedule)
+{
+    wait_queue_destroy_unlock(wait, reschedule, NULL);
+}
+
+/**
+ * @brief  Free all resources allocated in wait_queue_init(), dropping an object lock
+ *
+ * Same as wait_queue_destroy(), but @lock (taken before the thread lock) is
+ * released before the current thread is rescheduled.
+ */
+void wait_queue_destroy_unlock(wait_queue_t *wait, bool reschedule,
+                               spin_lock_t *lock)
 {
     DEBUG_ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(thread_lock_held());
 
-    wait_queue_wake_all(wait, reschedule, ERR_OBJECT_DESTROYED);
+    wait_queue_wake_all_unlock(wait, reschedule, ERR_OBJECT_DESTROYED, lock);
     wait->magic = 0;
 }
 
@@ -32,12 +32,28 @@
  *
  * Timer callback functions are called in interrupt context.
  *
+ * Pending timers are kept in a per-cpu binary search tree ordered by expiry
+ * time, so arming and canceling a timer is O(log n) in the number of pending
+ * timers on that cpu. The earliest timer is cached for the tick handler.
+ *
+ * Each queue has its own lock, so the tick handler on one cpu does not contend
+ * with timers being armed or canceled on another. timer->cpu names the queue,
+ * and lock, that owns a timer. It only changes with the owning queue's lock
+ * held, and never while the callback is running, so a timer queued on another
+ * cpu can be canceled by locking the queue it names and checking that it still
+ * names the same queue.
+ *
+ * A timer may be given slack, the amount it is allowed to fire late. When
+ * programming the hardware timer we pick the latest time that is still within
+ * the slack of every timer due by then, so timers that expire close together
+ * are run from a single interrupt. Timers without slack fire as close to their
+ * scheduled time as the hardware allows.
+ *
  * @{
  */
 #include <debug.h>
 #include <trace.h>
 #include <assert.h>
-#include <list.h>
 #include <kernel/thread.h>
 #include <kernel/timer.h>
 #include <kernel/debug.h>
@@ -47,13 +63,15 @@
 
 #define LOCAL_TRACE 0
 
-spin_lock_t timer_lock;
-
 struct timer_state {
-    struct list_node timer_queue;
-} __CPU_ALIGN;
+    spin_lock_t lock;
+    struct bst_root timer_queue;
+    timer_t *next_timer; /* earliest timer in timer_queue */
+    bool hw_armed;
+    lk_time_ns_t hw_deadline; /* when the hardware timer fires, if hw_armed */
+};
 
-static struct timer_state timers[SMP_MAX_CPUS];
+static DEFINE_PER_CPU(struct timer_state, timers);
 
 static enum handler_return timer_tick(void *arg, lk_time_ns_t now);
 
@@ -65,72 +83,214 @@ void timer_initialize(timer_t *timer)
     *timer = (timer_t)TIMER_INITIAL_VALUE(*timer);
 }
 
+/*
+ * Order timers by expiry time. Timers expiring at the same time are ordered by
+ * address since the tree does not allow equal keys.
+ */
+static int timer_compare(struct bst_node *a, struct bst_node *b)
+{
+    timer_t *timer_a = containerof(a, timer_t, node);
+    timer_t *timer_b = containerof(b, timer_t, node);
+
+    if (timer_a->scheduled_time != timer_b->scheduled_time)
+        return time_gt(timer_b->scheduled_time, timer_a->scheduled_time) ? 1 : -1;
+    if (timer_a == timer_b)
+        return 0;
+    return (uintptr_t)timer_b > (uintptr_t)timer_a ? 1 : -1;
+}
+
+static bool timer_in_queue(timer_t *timer)
+{
+    /* a rank of 0 means the node is not in a tree */
+    return timer->node.rank != 0;
+}
+
+static timer_t *timer_queue_head(uint cpu)
+{
+    return per_cpu(timers, cpu).next_timer;
+}
+
+/*
+ * Lock the queue that owns @timer and return its cpu number. Returns a cpu
+ * number >= SMP_MAX_CPUS without taking a lock if the timer has never been
+ * armed.
+ */
+static uint timer_lock_queue(timer_t *timer)
+{
+    DEBUG_ASSERT(arch_ints_disabled());
+
+    for (;;) {
+        uint cpu = __atomic_load_n(&timer->cpu, __ATOMIC_RELAXED);
+        if (cpu >= SMP_MAX_CPUS)
+            return cpu;
+        spin_lock(&per_cpu(timers, cpu).lock);
+        if (likely(timer->cpu == cpu))
+            return cpu;
+        /* timer moved to another queue before we got the lock */
+        spin_unlock(&per_cpu(timers, cpu).lock);
+    }
+}
+
+static void timer_unlock_queue(uint cpu)
+{
+    if (cpu < SMP_MAX_CPUS)
+        spin_unlock(&per_cpu(timers, cpu).lock);
+}
+
 static void insert_timer_in_queue(uint cpu, timer_t *timer)
 {
-    timer_t *entry;
+    struct timer_state *ts = &per_cpu(timers, cpu);
+    timer_t *head = ts->next_timer;
 
     DEBUG_ASSERT(arch_ints_disabled());
+    DEBUG_ASSERT(spin_lock_held(&ts->lock));
 
     LTRACEF("timer %p, cpu %u, scheduled %llu, periodic %llu\n", timer, cpu,
             timer->scheduled_time, timer->periodic_time);
 
-    list_for_every_entry(&timers[cpu].timer_queue, entry, timer_t, node) {
-        if (time_gt(entry->scheduled_time, timer->scheduled_time)) {
-            list_add_before(&entry->node, &timer->node);
-            return;
+    __UNUSED bool inserted = bst_insert(&ts->timer_queue, &timer->node,
+                                        timer_compare);
+    DEBUG_ASSERT(inserted);
+
+    if (!head || timer_compare(&head->node, &timer->node) < 0)
+        ts->next_timer = timer;
+}
+
+static void delete_timer_from_queue(uint cpu, timer_t *timer)
+{
+    struct timer_state *ts = &per_cpu(timers, cpu);
+
+    DEBUG_ASSERT(arch_ints_disabled());
+    DEBUG_ASSERT(spin_lock_held(&ts->lock));
+    DEBUG_ASSERT(timer_in_queue(timer));
+
+    if (ts->next_timer == timer) {
+        ts->next_timer = bst_next_type(&ts->timer_queue, &timer->node,
+                                       timer_t, node);
+    }
+    bst_delete(&ts->timer_queue, &timer->node);
+}
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/* Limit on how many queued timers are examined to coalesce an interrupt */
+#define TIMER_COALESCE_SCAN_MAX 16
+
+/*
+ * Return the latest time the hardware timer can fire while still running every
+ * timer due by then within its slack. Only timers scheduled before the returned
+ * time are examined, which are the ones the next tick will run anyway.
+ */
+static lk_time_ns_t timer_queue_wakeup_time(uint cpu)
+{
+    struct timer_state *ts = &per_cpu(timers, cpu);
+    timer_t *timer = timer_queue_head(cpu);
+    lk_time_ns_t wakeup = timer->scheduled_time + timer->slack;
+
+    for (uint i = 0; i < TIMER_COALESCE_SCAN_MAX; i++) {
+        timer = bst_next_type(&ts->timer_queue, &timer->node, timer_t, node);
+        if (!timer || time_gt(timer->scheduled_time, wakeup))
+            return wakeup;
+        if (time_lt(timer->scheduled_time + timer->slack, wakeup))
+            wakeup = timer->scheduled_time + timer->slack;
+    }
+
+    /*
+     * Gave up before finding the end of the batch. Firing when the next timer
+     * is scheduled is within the slack of every timer due by then.
+     */
+    timer = bst_next_type(&ts->timer_queue, &timer->node, timer_t, node);
+    if (timer && time_lt(timer->scheduled_time, wakeup))
+        wakeup = timer->scheduled_time;
+    return wakeup;
+}
+
+/* Program, or stop, the hardware timer for the head of the local queue */
+static void timer_update_hw(uint cpu, lk_time_ns_t now)
+{
+    struct timer_state *ts = &per_cpu(timers, cpu);
+
+    DEBUG_ASSERT(spin_lock_held(&ts->lock));
+    DEBUG_ASSERT(cpu == arch_curr_cpu_num());
+
+    if (!timer_queue_head(cpu)) {
+        if (ts->hw_armed) {
+            LTRACEF("clearing old hw timer, nothing in the queue\n");
+            platform_stop_timer();
+            ts->hw_armed = false;
         }
+        return;
     }
 
-    /* walked off the end of the list */
-    list_add_tail(&timers[cpu].timer_queue, &timer->node);
+    lk_time_ns_t wakeup_time = timer_queue_wakeup_time(cpu);
+    if (time_lt(wakeup_time, now))
+        wakeup_time = now;
+
+    if (ts->hw_armed && ts->hw_deadline == wakeup_time)
+        return;
+
+    LTRACEF("setting new timer for %llu\n", wakeup_time);
+    platform_set_oneshot_timer(timer_tick, wakeup_time);
+    ts->hw_armed = true;
+    ts->hw_deadline = wakeup_time;
 }
+#endif
 
-static void timer_set(timer_t *timer, lk_time_ns_t delay, lk_time_ns_t period,
-                      timer_callback callback, void *arg)
+static void timer_set(timer_t *timer, lk_time_ns_t delay, lk_time_ns_t slack,
+                      lk_time_ns_t period, timer_callback callback, void *arg)
 {
     lk_time_ns_t now;
 
-    LTRACEF("timer %p, delay %llu, period %llu, callback %p, arg %p\n", timer,
-            delay, period, callback, arg);
+    LTRACEF("timer %p, delay %llu, slack %llu, period %llu, callback %p, arg %p\n",
+            timer, delay, slack, period, callback, arg);
 
     DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
 
     spin_lock_saved_state_t state;
-    spin_lock_irqsave(&timer_lock, state);
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    uint cpu = arch_curr_cpu_num();
+    uint old_cpu = timer_lock_queue(timer);
+
+    if (old_cpu < SMP_MAX_CPUS && timer_in_queue(timer)) {
+        panic("timer %p already in queue\n", timer);
+    }
+
+    /*
+     * It is not safe to move the timer to a new cpu while the callback is
+     * running.
+     */
+    DEBUG_ASSERT(!timer->running || old_cpu == cpu);
 
-    if (list_in_list(&timer->node)) {
-        panic("timer %p already in list\n", timer);
+    if (old_cpu != cpu) {
+        /*
+         * The timer is not queued, so nothing but its owner field refers to
+         * the old queue. Hand it over to this cpu before taking our own lock.
+         */
+        __atomic_store_n(&timer->cpu, cpu, __ATOMIC_RELAXED);
+        timer_unlock_queue(old_cpu);
+        spin_lock(&per_cpu(timers, cpu).lock);
     }
 
     now = current_time_ns();
     timer->scheduled_time = now + delay;
+    timer->slack = slack;
     timer->periodic_time = period;
     timer->callback = callback;
     timer->arg = arg;
 
     LTRACEF("scheduled time %llu\n", timer->scheduled_time);
 
-    uint cpu = arch_curr_cpu_num();
-
-    /*
-     * It is not safe to move the timer to a new cpu while the callback is
-     * running.
-     */
-    DEBUG_ASSERT(!timer->running || timer->cpu == cpu);
-
-    timer->cpu = cpu;
-
     insert_timer_in_queue(cpu, timer);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    if (list_peek_head_type(&timers[cpu].timer_queue, timer_t, node) == timer) {
-        /* we just modified the head of the timer queue */
-        LTRACEF("setting new timer for %llu nanosecs\n", delay);
-        platform_set_oneshot_timer(timer_tick, timer->scheduled_time);
+    /* a timer due after the current deadline will be handled by that tick */
+    if (!per_cpu(timers, cpu).hw_armed ||
+        !time_gt(timer->scheduled_time, per_cpu(timers, cpu).hw_deadline)) {
+        timer_update_hw(cpu, now);
     }
 #endif
 
-    spin_unlock_irqrestore(&timer_lock, state);
+    spin_unlock_irqrestore(&per_cpu(timers, cpu).lock, state);
 }
 
 /**
@@ -149,10 +309,29 @@ static void timer_set(timer_t *timer, lk_time_ns_t delay, lk_time_ns_t period,
  */
 void timer_set_oneshot_ns(timer_t *timer, lk_time_ns_t delay,
                           timer_callback callback, void *arg)
+{
+    timer_set_oneshot_ns_slack(timer, delay, 0, callback, arg);
+}
+
+/**
+ * @brief  Set up a timer that executes once, allowing it to fire late
+ *
+ * Like timer_set_oneshot_ns(), but the callback may run up to @slack ns after
+ * the delay has expired so that it can share an interrupt with other timers.
+ *
+ * @param  timer The timer to use
+ * @param  delay The delay, in ns, before the timer is executed
+ * @param  slack How much later, in ns, the timer is allowed to execute
+ * @param  callback  The function to call when the timer expires
+ * @param  arg  The argument to pass to the callback
+ */
+void timer_set_oneshot_ns_slack(timer_t *timer, lk_time_ns_t delay,
+                                lk_time_ns_t slack, timer_callback callback,
+                                void *arg)
 {
     if (delay == 0)
         delay = 1;
-    timer_set(timer, delay, 0, callback, arg);
+    timer_set(timer, delay, slack, 0, callback, arg);
 }
 
 /**
@@ -174,7 +353,32 @@ void timer_set_periodic_ns(timer_t *timer, lk_time_ns_t period,
 {
     if (period == 0)
         period = 1;
-    timer_set(timer, period, period, callback, arg);
+    timer_set(timer, period, 0, period, callback, arg);
+}
+
+/* remove @timer from the queue of @cpu, which must be locked */
+static void timer_cancel_locked(uint cpu, timer_t *timer)
+{
+    if (timer_in_queue(timer))
+        delete_timer_from_queue(cpu, timer);
+
+    /* to keep it from being reinserted into the queue if called from
+     * periodic timer callback.
+     */
+    timer->periodic_time = 0;
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    /*
+     * If we just modified our own queue, reprogram the hardware timer. A
+     * remote cpu whose head was removed just takes one early tick and
+     * reprograms itself from timer_tick.
+     */
+    if (cpu != arch_curr_cpu_num()) {
+        LTRACEF("timer %p was queued on cpu %u, leaving its hw timer\n", timer, cpu);
+    } else {
+        timer_update_hw(cpu, current_time_ns());
+    }
+#endif
 }
 
 /**
@@ -195,55 +399,56 @@ void timer_cancel_etc(timer_t *timer, bool wait)
     DEBUG_ASSERT(arch_ints_disabled() || wait);
 
     spin_lock_saved_state_t state;
-    spin_lock_irqsave(&timer_lock, state);
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    uint cpu = timer_lock_queue(timer);
+    if (cpu >= SMP_MAX_CPUS) {
+        /* never armed, nothing to cancel */
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+        return;
+    }
 
     /*
      * It is safe to cancel the timer without waiting on the same cpu that the
      * callback runs on.
      */
-    DEBUG_ASSERT(wait || arch_curr_cpu_num() == timer->cpu);
+    DEBUG_ASSERT(wait || arch_curr_cpu_num() == cpu);
 
     while (wait && timer->running) {
-        spin_unlock_irqrestore(&timer_lock, state);
+        spin_unlock_irqrestore(&per_cpu(timers, cpu).lock, state);
         thread_yield();
-        spin_lock_irqsave(&timer_lock, state);
+        arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+        cpu = timer_lock_queue(timer);
     }
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
-    uint cpu = arch_curr_cpu_num(); /* cpu could have changed in thread_yield */
+    timer_cancel_locked(cpu, timer);
 
-    timer_t *oldhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-#endif
+    spin_unlock_irqrestore(&per_cpu(timers, cpu).lock, state);
+}
 
-    if (list_in_list(&timer->node))
-        list_delete(&timer->node);
+/**
+ * @brief  Cancel a timer unless its callback is running
+ *
+ * Unlike timer_cancel(), this may be called from any cpu with interrupts
+ * disabled, since it never leaves a callback running behind the caller's back.
+ *
+ * @return false, without canceling the timer, if its callback is running.
+ */
+bool timer_try_cancel(timer_t *timer)
+{
+    DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
+    DEBUG_ASSERT(arch_ints_disabled());
 
-    /* to keep it from being reinserted into the queue if called from
-     * periodic timer callback.
-     */
-    timer->periodic_time = 0;
+    uint cpu = timer_lock_queue(timer);
+    if (cpu >= SMP_MAX_CPUS)
+        return true;
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
-    /* see if we've just modified the head of the current cpu timer queue */
-    timer_t *newhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-    if (newhead == NULL) {
-        LTRACEF("clearing old hw timer, nothing in the queue\n");
-        platform_stop_timer();
-    } else if (newhead != oldhead) {
-        lk_time_ns_t wakeup_time;
-        lk_time_ns_t now = current_time_ns();
-
-        if (time_lt(newhead->scheduled_time, now))
-            wakeup_time = now;
-        else
-            wakeup_time = newhead->scheduled_time;
-
-        LTRACEF("setting new timer to %llu\n", wakeup_time);
-        platform_set_oneshot_timer(timer_tick, wakeup_time);
-    }
-#endif
+    bool idle = !timer->running;
+    if (idle)
+        timer_cancel_locked(cpu, timer);
 
-    spin_unlock_irqrestore(&timer_lock, state);
+    spin_unlock(&per_cpu(timers, cpu).lock);
+    return idle;
 }
 
 /* called at interrupt time to process any pending timers */
@@ -261,11 +466,16 @@ static enum handler_return timer_tick(void *arg, lk_time_ns_t now)
 
     LTRACEF("cpu %u now %llu, sp %p\n", cpu, now, __GET_FRAME());
 
-    spin_lock(&timer_lock);
+    spin_lock(&per_cpu(timers, cpu).lock);
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    /* the oneshot timer that got us here has fired */
+    per_cpu(timers, cpu).hw_armed = false;
+#endif
 
     for (;;) {
         /* see if there's an event to process */
-        timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
+        timer = timer_queue_head(cpu);
         if (likely(timer == 0))
             break;
         LTRACEF("next item on timer queue %p at %llu now %llu (%p, arg %p)\n",
@@ -276,11 +486,11 @@ static enum handler_return timer_tick(void *arg, lk_time_ns_t now)
         /* process it */
         LTRACEF("timer %p\n", timer);
         DEBUG_ASSERT(timer && timer->magic == TIMER_MAGIC);
-        list_delete(&timer->node);
+        delete_timer_from_queue(cpu, timer);
         timer->running = true;
 
         /* we pulled it off the list, release the list lock to handle it */
-        spin_unlock(&timer_lock);
+        spin_unlock(&per_cpu(timers, cpu).lock);
 
         LTRACEF("dequeued timer %p, scheduled %llu periodic %llu\n", timer,
                 timer->scheduled_time, timer->periodic_time);
@@ -295,7 +505,7 @@ static enum handler_return timer_tick(void *arg, lk_time_ns_t now)
             ret = INT_RESCHEDULE;
 
         /* it may have been requeued or periodic, grab the lock so we can safely inspect it */
-        spin_lock(&timer_lock);
+        spin_lock(&per_cpu(timers, cpu).lock);
 
         /*
          * Check that timer did not get freed and overwritten while the callback
@@ -308,7 +518,7 @@ static enum handler_return timer_tick(void *arg, lk_time_ns_t now)
         /* if it was a periodic timer and it hasn't been requeued
          * by the callback put it back in the list
          */
-        if (periodic && !list_in_list(&timer->node) && timer->periodic_time > 0) {
+        if (periodic && !timer_in_queue(timer) && timer->periodic_time > 0) {
             LTRACEF("periodic timer, period %llu\n", timer->periodic_time);
             timer->scheduled_time = now + timer->periodic_time;
             insert_timer_in_queue(cpu, timer);
@@ -317,21 +527,19 @@ static enum handler_return timer_tick(void *arg, lk_time_ns_t now)
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
     /* reset the timer to the next event */
-    timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
+    timer = timer_queue_head(cpu);
     if (timer) {
         /* has to be the case or it would have fired already */
         DEBUG_ASSERT(time_gt(timer->scheduled_time, now));
 
-        LTRACEF("setting new timer for %llu nanosecs from now (%llu) for event %p\n",
-                timer->scheduled_time - now, timer->scheduled_time, timer);
-        platform_set_oneshot_timer(timer_tick, timer->scheduled_time);
+        timer_update_hw(cpu, now);
     }
 
     /* we're done manipulating the timer queue */
-    spin_unlock(&timer_lock);
+    spin_unlock(&per_cpu(timers, cpu).lock);
 #else
     /* release the timer lock before calling the tick handler */
-    spin_unlock(&timer_lock);
+    spin_unlock(&per_cpu(timers, cpu).lock);
 
     /* let the scheduler have a shot to do quantum expiration, etc */
     /* in case of dynamic timer, the scheduler will set up a periodic timer */
@@ -344,9 +552,11 @@ static enum handler_return timer_tick(void *arg, lk_time_ns_t now)
 
 void timer_init(void)
 {
-    timer_lock = SPIN_LOCK_INITIAL_VALUE;
     for (uint i = 0; i < SMP_MAX_CPUS; i++) {
-        list_initialize(&timers[i].timer_queue);
+        spin_lock_init(&per_cpu(timers, i).lock);
+        bst_root_initialize(&per_cpu(timers, i).timer_queue);
+        per_cpu(timers, i).next_timer = NULL;
+        per_cpu(timers, i).hw_armed = false;
     }
 #if !PLATFORM_HAS_DYNAMIC_TIMER
     /* register for a periodic timer tick */
@@ -26,6 +26,7 @@
 #include <assert.h>
 #include <bits.h>
 #include <trace.h>
+#include <kernel/percpu.h>
 #include <kernel/thread.h>
 
 #define LOCAL_TRACE 0
@@ -34,8 +35,9 @@
 
 static uint64_t last_asid;
 static bool old_asid_active;
-static struct arch_aspace *active_aspace[SMP_MAX_CPUS];
-static uint64_t active_asid_version[SMP_MAX_CPUS];
+/* written by their own cpu on every context switch, keep them apart */
+static DEFINE_PER_CPU(struct arch_aspace *, active_aspace);
+static DEFINE_PER_CPU(uint64_t, active_asid_version);
 
 static bool vmm_asid_current(struct arch_aspace *aspace, uint64_t ref,
                              uint64_t asid_mask)
@@ -60,7 +62,7 @@ static void vmm_asid_allocate(struct arch_aspace *aspace, uint cpu,
 {
     uint i;
 
-    active_aspace[cpu] = aspace;
+    per_cpu(active_aspace, cpu) = aspace;
 
     if (vmm_asid_current(aspace, last_asid, asid_mask)) {
         return;
@@ -71,7 +73,7 @@ static void vmm_asid_allocate(struct arch_aspace *aspace, uint cpu,
             if (i == cpu) {
                 continue;
             }
-            if (active_aspace[i] == aspace) {
+            if (per_cpu(active_aspace, i) == aspace) {
                 /*
                  * Don't allocate a new asid if aspace is active on another
                  * CPU. That CPU could perform asid specific tlb invalidate
@@ -92,13 +94,14 @@ static void vmm_asid_allocate(struct arch_aspace *aspace, uint cpu,
         i = 0;
         old_asid_active = false;
         while (i < SMP_MAX_CPUS) {
-            if (!vmm_asid_current(active_aspace[i], last_asid, asid_mask)) {
+            if (!vmm_asid_current(per_cpu(active_aspace, i), last_asid,
+                                  asid_mask)) {
                 old_asid_active = true;
-                if (!((active_aspace[i]->asid ^ last_asid) & asid_mask)) {
+                if (!((per_cpu(active_aspace, i)->asid ^ last_asid) & asid_mask)) {
                     /* Skip asid in use by other CPUs */
                     aspace->asid = ++last_asid;
                     LTRACEF("cpu %d: conflict asid 0x%llx at cpu %d, new asid 0x%llx\n",
-                            cpu, active_aspace[i]->asid, i, aspace->asid);
+                            cpu, per_cpu(active_aspace, i)->asid, i, aspace->asid);
                     i = 0;
                     continue;
                 }
@@ -128,12 +131,12 @@ bool vmm_asid_activate(struct arch_aspace *aspace, uint asid_bits)
 
     vmm_asid_allocate(aspace, cpu, asid_mask);
 
-    if (vmm_asid_current(aspace, active_asid_version[cpu], asid_mask)) {
+    if (vmm_asid_current(aspace, per_cpu(active_asid_version, cpu), asid_mask)) {
         return false;
     }
     DEBUG_ASSERT(aspace); /* NULL aspace is always current */
 
-    active_asid_version[cpu] = aspace->asid & ~asid_mask;
+    per_cpu(active_asid_version, cpu) = aspace->asid & ~asid_mask;
     LTRACEF("cpu %d: aspace %p, asid 0x%llx\n", cpu, aspace, aspace->asid);
 
     return true;
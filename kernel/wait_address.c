@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2026 Google Inc. All rights reserved
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief  Wait on address
+ *
+ * @defgroup wait_address Wait on address
+ *
+ * Each hash bucket holds the waiters for every address hashing to it, in the
+ * order they started waiting. A waiter is a struct wait_address_waiter on the
+ * stack of the waiting thread, which blocks on the private wait queue in it.
+ * Waking a thread removes its waiter from the bucket and wakes its queue with
+ * both the bucket lock and the thread lock held, so the waiter stays valid
+ * until then. A waiter that timed out may still be in its bucket and removes
+ * itself.
+ *
+ * requeue_address() removes waiters the same way but moves the thread from its
+ * private queue to a mutex's wait queue with mutex_requeue(). The bucket lock
+ * is the lock of every private queue in the bucket, as mutex_requeue()
+ * requires. The thread finds blocking_mutex set when it returns from its
+ * wait, and its waiter is no longer referenced by then.
+ *
+ * Lock order: bucket lock, then mutex lock, then thread lock.
+ *
+ * @{
+ */
+
+#include <kernel/wait_address.h>
+#include <debug.h>
+#include <assert.h>
+#include <err.h>
+#include <list.h>
+#include <kernel/mutex.h>
+#include <kernel/thread.h>
+
+#define WAIT_ADDRESS_HASH_BITS 6
+#define WAIT_ADDRESS_HASH_SIZE (1U << WAIT_ADDRESS_HASH_BITS)
+
+struct wait_address_bucket {
+    spin_lock_t lock;
+    struct list_node waiters;
+} __CPU_ALIGN;
+
+struct wait_address_waiter {
+    struct list_node node;
+    volatile uint32_t *addr;
+    wait_queue_t wait;
+};
+
+static struct wait_address_bucket wait_address_table[WAIT_ADDRESS_HASH_SIZE];
+
+static struct wait_address_bucket *wait_address_bucket(volatile uint32_t *addr)
+{
+    /* fibonacci hashing, the low bits of an aligned address are always 0 */
+    uint64_t key = (uintptr_t)addr / sizeof(*addr);
+    uint hash = (key * 0x9e3779b97f4a7c15ULL) >> (64 - WAIT_ADDRESS_HASH_BITS);
+
+    return &wait_address_table[hash];
+}
+
+/**
+ * @brief  Block until woken, if a word holds an expected value
+ *
+ * @param addr      Word to wait on
+ * @param expected  Value @addr must hold for the thread to block
+ * @param timeout   The maximum time, in ms, to wait
+ *
+ * @return NO_ERROR if woken, WAIT_ADDRESS_REQUEUED if moved to a mutex by
+ * requeue_address(), ERR_BAD_STATE if @addr did not hold @expected, or
+ * ERR_TIMED_OUT.
+ */
+status_t wait_on_address(volatile uint32_t *addr, uint32_t expected,
+                         lk_time_t timeout)
+{
+    thread_t *current_thread = get_current_thread();
+    struct wait_address_bucket *bucket = wait_address_bucket(addr);
+    struct wait_address_waiter waiter;
+    spin_lock_saved_state_t state;
+    status_t ret;
+
+    DEBUG_ASSERT(!arch_ints_disabled());
+    DEBUG_ASSERT(!current_thread->blocking_mutex);
+
+    spin_lock_irqsave(&bucket->lock, state);
+
+    if (__atomic_load_n(addr, __ATOMIC_RELAXED) != expected) {
+        spin_unlock_irqrestore(&bucket->lock, state);
+        return ERR_BAD_STATE;
+    }
+
+    waiter.addr = addr;
+    wait_queue_init(&waiter.wait);
+    list_add_tail(&bucket->waiters, &waiter.node);
+
+    thread_lock_ints_disabled();
+    ret = wait_queue_block_unlock(&waiter.wait, timeout, &bucket->lock);
+    if (current_thread->blocking_mutex) {
+        /* requeued, even if we then timed out waiting for the mutex */
+        current_thread->blocking_mutex = NULL;
+        ret = WAIT_ADDRESS_REQUEUED;
+    }
+    thread_unlock_ints_disabled();
+
+    if (ret == ERR_TIMED_OUT) {
+        /* not woken, or woken after the timeout already removed us */
+        spin_lock(&bucket->lock);
+        if (list_in_list(&waiter.node))
+            list_delete(&waiter.node);
+        spin_unlock(&bucket->lock);
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    return ret;
+}
+
+/**
+ * @brief  Wake threads waiting on a word
+ *
+ * @param addr   Word the threads to wake passed to wait_on_address()
+ * @param count  Maximum number of threads to wake
+ *
+ * @return The number of threads woken.
+ */
+int wake_address(volatile uint32_t *addr, uint32_t count)
+{
+    struct wait_address_bucket *bucket = wait_address_bucket(addr);
+    struct wait_address_waiter *waiter;
+    struct wait_address_waiter *temp;
+    spin_lock_saved_state_t state;
+    bool thread_locked = false;
+    int woken = 0;
+
+    spin_lock_irqsave(&bucket->lock, state);
+
+    list_for_every_entry_safe(&bucket->waiters, waiter, temp,
+                              struct wait_address_waiter, node) {
+        if ((uint32_t)woken == count)
+            break;
+        if (waiter->addr != addr)
+            continue;
+
+        if (!thread_locked) {
+            thread_lock_ints_disabled();
+            thread_locked = true;
+        }
+        list_delete(&waiter->node);
+        /* a waiter that timed out is no longer on its queue */
+        woken += wait_queue_wake_one(&waiter->wait, false, NO_ERROR);
+    }
+
+    if (thread_locked)
+        thread_unlock_ints_disabled();
+    spin_unlock_irqrestore(&bucket->lock, state);
+
+    return woken;
+}
+
+/**
+ * @brief  Move threads waiting on a word to the wait queue of a mutex
+ *
+ * The moved threads wait for @m as if they had blocked in mutex_acquire(),
+ * and boost its holder. Their wait_on_address() returns
+ * WAIT_ADDRESS_REQUEUED once they are woken, after which they must finish
+ * acquiring the mutex with mutex_acquire_requeued().
+ *
+ * @param addr   Word the threads to move passed to wait_on_address()
+ * @param m      Mutex to move them to
+ * @param count  Maximum number of threads to move
+ *
+ * @return The number of threads moved.
+ */
+int requeue_address(volatile uint32_t *addr, mutex_t *m, uint32_t count)
+{
+    struct wait_address_bucket *bucket = wait_address_bucket(addr);
+    struct wait_address_waiter *waiter;
+    struct wait_address_waiter *temp;
+    spin_lock_saved_state_t state;
+    int moved = 0;
+
+    spin_lock_irqsave(&bucket->lock, state);
+
+    list_for_every_entry_safe(&bucket->waiters, waiter, temp,
+                              struct wait_address_waiter, node) {
+        if ((uint32_t)moved == count)
+            break;
+        if (waiter->addr != addr)
+            continue;
+
+        list_delete(&waiter->node);
+        /* a waiter that timed out is no longer on its queue */
+        moved += mutex_requeue(m, &waiter->wait, 1);
+    }
+
+    spin_unlock_irqrestore(&bucket->lock, state);
+
+    return moved;
+}
+
+void wait_address_init(void)
+{
+    for (uint i = 0; i < WAIT_ADDRESS_HASH_SIZE; i++) {
+        spin_lock_init(&wait_address_table[i].lock);
+        list_initialize(&wait_address_table[i].waiters);
+    }
+}
+
+/* @} */